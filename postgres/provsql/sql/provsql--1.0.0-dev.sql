@@ -9,15 +9,15 @@ CREATE TYPE agg_token;
 
 CREATE FUNCTION agg_token_in(cstring)
   RETURNS agg_token
-  AS 'provsql','agg_token_in' LANGUAGE C IMMUTABLE STRICT;
+  AS 'provsql','agg_token_in' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 CREATE FUNCTION agg_token_out(agg_token)
   RETURNS cstring
-  AS 'provsql','agg_token_out' LANGUAGE C IMMUTABLE STRICT;
+  AS 'provsql','agg_token_out' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 CREATE FUNCTION agg_token_cast(agg_token)
   RETURNS text
-  AS 'provsql','agg_token_cast' LANGUAGE C IMMUTABLE STRICT;
+  AS 'provsql','agg_token_cast' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 CREATE TYPE agg_token (
   internallength = 117,
@@ -32,10 +32,106 @@ $$
 BEGIN
   RETURN agg_token_cast(aggtok)::uuid;
 END
-$$ LANGUAGE plpgsql STRICT SET search_path=provsql,pg_temp,public SECURITY DEFINER;
+$$ LANGUAGE plpgsql STRICT PARALLEL SAFE SET search_path=provsql,pg_temp,public SECURITY DEFINER;
 
 CREATE CAST (agg_token AS UUID) WITH FUNCTION agg_token_uuid(agg_token) AS IMPLICIT;
 
+-- Create token8 type for compact provenance tokens, see
+-- add_provenance(..., compact => true)
+CREATE TYPE token8;
+
+CREATE FUNCTION token8_in(cstring)
+  RETURNS token8
+  AS 'provsql','token8_in' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION token8_out(token8)
+  RETURNS cstring
+  AS 'provsql','token8_out' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE TYPE token8 (
+  internallength = 8,
+  input = token8_in,
+  output = token8_out,
+  passedbyvalue,
+  alignment = double
+);
+
+CREATE FUNCTION token8_eq(token8, token8) RETURNS boolean
+  AS 'provsql','token8_eq' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+CREATE FUNCTION token8_ne(token8, token8) RETURNS boolean
+  AS 'provsql','token8_ne' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+CREATE FUNCTION token8_lt(token8, token8) RETURNS boolean
+  AS 'provsql','token8_lt' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+CREATE FUNCTION token8_le(token8, token8) RETURNS boolean
+  AS 'provsql','token8_le' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+CREATE FUNCTION token8_gt(token8, token8) RETURNS boolean
+  AS 'provsql','token8_gt' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+CREATE FUNCTION token8_ge(token8, token8) RETURNS boolean
+  AS 'provsql','token8_ge' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+CREATE FUNCTION token8_cmp(token8, token8) RETURNS integer
+  AS 'provsql','token8_cmp' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+CREATE FUNCTION token8_hash(token8) RETURNS integer
+  AS 'provsql','token8_hash' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+
+CREATE OPERATOR = (
+  leftarg = token8, rightarg = token8, procedure = token8_eq,
+  commutator = =, negator = <>,
+  restrict = eqsel, join = eqjoinsel, hashes, merges
+);
+CREATE OPERATOR <> (
+  leftarg = token8, rightarg = token8, procedure = token8_ne,
+  commutator = <>, negator = =,
+  restrict = neqsel, join = neqjoinsel
+);
+CREATE OPERATOR < (
+  leftarg = token8, rightarg = token8, procedure = token8_lt,
+  commutator = >, negator = >=,
+  restrict = scalarltsel, join = scalarltjoinsel
+);
+CREATE OPERATOR <= (
+  leftarg = token8, rightarg = token8, procedure = token8_le,
+  commutator = >=, negator = >,
+  restrict = scalarlesel, join = scalarlejoinsel
+);
+CREATE OPERATOR > (
+  leftarg = token8, rightarg = token8, procedure = token8_gt,
+  commutator = <, negator = <=,
+  restrict = scalargtsel, join = scalargtjoinsel
+);
+CREATE OPERATOR >= (
+  leftarg = token8, rightarg = token8, procedure = token8_ge,
+  commutator = <=, negator = <,
+  restrict = scalargesel, join = scalargejoinsel
+);
+
+CREATE OPERATOR CLASS token8_ops
+  DEFAULT FOR TYPE token8 USING btree AS
+    OPERATOR 1 <,
+    OPERATOR 2 <=,
+    OPERATOR 3 =,
+    OPERATOR 4 >=,
+    OPERATOR 5 >,
+    FUNCTION 1 token8_cmp(token8, token8);
+
+CREATE OPERATOR CLASS token8_ops
+  DEFAULT FOR TYPE token8 USING hash AS
+    OPERATOR 1 =,
+    FUNCTION 1 token8_hash(token8);
+
+CREATE SEQUENCE token8_seq;
+
+CREATE FUNCTION token8_uuid(token8)
+  RETURNS uuid
+  AS 'provsql','token8_uuid' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION uuid_token8(uuid)
+  RETURNS token8
+  AS 'provsql','uuid_token8' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE CAST (token8 AS UUID) WITH FUNCTION token8_uuid(token8) AS IMPLICIT;
+CREATE CAST (UUID AS token8) WITH FUNCTION uuid_token8(uuid);
+CREATE CAST (bigint AS token8) WITHOUT FUNCTION;
+
 CREATE TYPE provenance_gate AS
   ENUM('input','plus','times','monus','project','zero','one','eq','agg','semimod','cmp','delta','value','mulinput');
 
@@ -44,51 +140,68 @@ CREATE OR REPLACE FUNCTION create_gate(
   type provenance_gate,
   children uuid[] DEFAULT NULL)
   RETURNS void AS
-  'provsql','create_gate' LANGUAGE C;
+  'provsql','create_gate' LANGUAGE C PARALLEL SAFE;
+CREATE OR REPLACE FUNCTION create_gates(
+  tokens UUID[],
+  types provenance_gate[],
+  children uuid[][] DEFAULT NULL)
+  RETURNS void AS
+  'provsql','create_gates' LANGUAGE C PARALLEL SAFE;
 CREATE OR REPLACE FUNCTION get_gate_type(
   token UUID)
   RETURNS provenance_gate AS
-  'provsql','get_gate_type' LANGUAGE C;
+  'provsql','get_gate_type' LANGUAGE C PARALLEL SAFE;
 CREATE OR REPLACE FUNCTION get_children(
   token UUID)
   RETURNS uuid[] AS
-  'provsql','get_children' LANGUAGE C;
+  'provsql','get_children' LANGUAGE C PARALLEL SAFE;
 CREATE OR REPLACE FUNCTION set_prob(
   token UUID, p DOUBLE PRECISION)
   RETURNS void AS
-  'provsql','set_prob' LANGUAGE C;
+  'provsql','set_prob' LANGUAGE C PARALLEL SAFE;
+CREATE OR REPLACE FUNCTION set_probs(
+  tokens UUID[], p DOUBLE PRECISION[])
+  RETURNS void AS
+  'provsql','set_probs' LANGUAGE C PARALLEL SAFE;
 CREATE OR REPLACE FUNCTION get_prob(
   token UUID)
   RETURNS DOUBLE PRECISION AS
-  'provsql','get_prob' LANGUAGE C;
+  'provsql','get_prob' LANGUAGE C PARALLEL SAFE;
 CREATE OR REPLACE FUNCTION set_infos(
   token UUID, info1 INT, info2 INT DEFAULT NULL)
   RETURNS void AS
-  'provsql','set_infos' LANGUAGE C;
+  'provsql','set_infos' LANGUAGE C PARALLEL SAFE;
 CREATE OR REPLACE FUNCTION get_infos(
   token UUID, OUT info1 INT, OUT info2 INT)
   RETURNS record AS
-  'provsql','get_infos' LANGUAGE C;
-
-CREATE UNLOGGED TABLE provenance_circuit_extra(
-  gate UUID,
-  info1 INT,
-  info2 INT);
-
-CREATE UNLOGGED TABLE aggregation_circuit_extra(
-  gate UUID PRIMARY KEY,
-  aggfnoid INT,
-  aggtype INT,
-  val VARCHAR
-);
-
-CREATE UNLOGGED TABLE aggregation_values(
-  gate UUID PRIMARY KEY,
-  val VARCHAR
+  'provsql','get_infos' LANGUAGE C PARALLEL SAFE;
+CREATE OR REPLACE FUNCTION get_extra(token UUID)
+  RETURNS TEXT AS
+  'provsql','get_extra' LANGUAGE C PARALLEL SAFE;
+CREATE OR REPLACE FUNCTION get_extra_infos(token UUID)
+  RETURNS INTEGER[] AS
+  'provsql','get_extra_infos' LANGUAGE C PARALLEL SAFE;
+CREATE OR REPLACE FUNCTION gate_cache_stats(
+  OUT hits BIGINT, OUT misses BIGINT)
+  RETURNS record AS
+  'provsql','gate_cache_stats' LANGUAGE C PARALLEL RESTRICTED;
+CREATE OR REPLACE FUNCTION stat(
+  OUT name TEXT, OUT value DOUBLE PRECISION)
+  RETURNS SETOF record AS
+  'provsql','stat' LANGUAGE C PARALLEL SAFE;
+
+CREATE VIEW pg_stat_provsql AS SELECT * FROM stat();
+
+-- Tokens whose gates are kept by vacuum_circuit even when they do not
+-- appear in any table
+CREATE TABLE pinned_tokens(
+  token UUID PRIMARY KEY
 );
 
-CREATE INDEX ON provenance_circuit_extra (gate);
+SELECT pg_catalog.pg_extension_config_dump('pinned_tokens', '');
 
+-- Row-level trigger of tables to which provenance was added by earlier
+-- versions, see add_gates_trigger
 CREATE OR REPLACE FUNCTION add_gate_trigger()
   RETURNS TRIGGER AS
 $$
@@ -100,13 +213,25 @@ BEGIN
 END
 $$ LANGUAGE plpgsql SET search_path=provsql,pg_temp SECURITY DEFINER;
 
-CREATE OR REPLACE FUNCTION add_provenance(_tbl regclass)
+CREATE OR REPLACE FUNCTION create_input_gates(_tbl regclass)
+  RETURNS void AS
+  'provsql','create_input_gates' LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION add_gates_trigger()
+  RETURNS TRIGGER AS
+  'provsql','add_gates_trigger' LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION add_provenance(_tbl regclass, compact boolean DEFAULT false)
   RETURNS void AS
 $$
 BEGIN
-  EXECUTE format('ALTER TABLE %I ADD COLUMN provsql UUID UNIQUE DEFAULT public.uuid_generate_v4()', _tbl);
-  EXECUTE format('SELECT provsql.create_gate(provsql, ''input'') FROM %I', _tbl);
-  EXECUTE format('CREATE TRIGGER add_gate BEFORE INSERT ON %I FOR EACH ROW EXECUTE PROCEDURE provsql.add_gate_trigger()',_tbl);
+  IF compact THEN
+    EXECUTE format('ALTER TABLE %I ADD COLUMN provsql provsql.token8 UNIQUE DEFAULT nextval(''provsql.token8_seq'')::provsql.token8', _tbl);
+  ELSE
+    EXECUTE format('ALTER TABLE %I ADD COLUMN provsql UUID UNIQUE DEFAULT public.uuid_generate_v4()', _tbl);
+  END IF;
+  PERFORM provsql.create_input_gates(_tbl);
+  EXECUTE format('CREATE TRIGGER add_gate AFTER INSERT ON %I REFERENCING NEW TABLE AS provsql_new_rows FOR EACH STATEMENT EXECUTE PROCEDURE provsql.add_gates_trigger()',_tbl);
 END
 $$ LANGUAGE plpgsql SECURITY DEFINER;
 
@@ -123,53 +248,18 @@ BEGIN
 END
 $$ LANGUAGE plpgsql;
 
+CREATE OR REPLACE FUNCTION create_mulinput_gates(_tbl regclass, token_att text, key_att text)
+  RETURNS void AS
+  'provsql','create_mulinput_gates' LANGUAGE C STRICT;
+
 CREATE OR REPLACE FUNCTION repair_key(_tbl regclass, key_att text)
   RETURNS void AS
 $$
-DECLARE
-  key RECORD;
-  key_token uuid;
-  token uuid;
-  record RECORD;
-  nb_rows INTEGER;
-  ind INTEGER;
-  select_key_att TEXT;
-  where_condition TEXT;
 BEGIN
-  IF key_att = '' THEN
-    key_att := '()';
-    select_key_att := '1';
-  ELSE
-    select_key_att := key_att;
-  END IF;
-
   EXECUTE format('ALTER TABLE %I ADD COLUMN provsql_temp UUID UNIQUE DEFAULT uuid_generate_v4()', _tbl);
-
-  FOR key IN
-    EXECUTE format('SELECT %s AS key FROM %I GROUP BY %s', select_key_att, _tbl, key_att)
-  LOOP
-    IF key_att = '()' THEN
-      where_condition := '';
-    ELSE
-      where_condition := format('WHERE %s = %L', key_att, key.key);
-    END IF;
-
-    EXECUTE format('SELECT COUNT(*) FROM %I %s', _tbl, where_condition) INTO nb_rows;
-
-    key_token := uuid_generate_v4();
-    ind := 1;
-    FOR record IN
-      EXECUTE format('SELECT provsql_temp FROM %I %s', _tbl, where_condition)
-    LOOP
-      token:=record.provsql_temp;
-      PERFORM provsql.create_gate(token, 'mulinput', ARRAY[key_token]);
-      PERFORM provsql.set_prob(token, 1./nb_rows);
-      PERFORM provsql.set_infos(token, ind);
-      ind := ind + 1;
-    END LOOP;
-  END LOOP;
+  PERFORM provsql.create_mulinput_gates(_tbl, 'provsql_temp', key_att);
   EXECUTE format('ALTER TABLE %I RENAME COLUMN provsql_temp TO provsql', _tbl);
-  EXECUTE format('CREATE TRIGGER add_gate BEFORE INSERT ON %I FOR EACH ROW EXECUTE PROCEDURE provsql.add_gate_trigger()',_tbl);
+  EXECUTE format('CREATE TRIGGER add_gate AFTER INSERT ON %I REFERENCING NEW TABLE AS provsql_new_rows FOR EACH STATEMENT EXECUTE PROCEDURE provsql.add_gates_trigger()',_tbl);
 END
 $$ LANGUAGE plpgsql;
 
@@ -189,17 +279,17 @@ CREATE FUNCTION uuid_ns_provsql() RETURNS uuid AS
 $$
  -- uuid_generate_v5(uuid_ns_url(),'http://pierre.senellart.com/software/provsql/')
  SELECT '920d4f02-8718-5319-9532-d4ab83a64489'::uuid
-$$ LANGUAGE SQL IMMUTABLE;
+$$ LANGUAGE SQL IMMUTABLE PARALLEL SAFE;
 
 CREATE FUNCTION gate_zero() RETURNS uuid AS
 $$
   SELECT public.uuid_generate_v5(provsql.uuid_ns_provsql(),'zero');
-$$ LANGUAGE SQL IMMUTABLE;
+$$ LANGUAGE SQL IMMUTABLE PARALLEL SAFE;
 
 CREATE FUNCTION gate_one() RETURNS uuid AS
 $$
   SELECT public.uuid_generate_v5(provsql.uuid_ns_provsql(),'one');
-$$ LANGUAGE SQL IMMUTABLE;
+$$ LANGUAGE SQL IMMUTABLE PARALLEL SAFE;
 
 CREATE FUNCTION uuid_provsql_concat(state uuid, token UUID)
   RETURNS UUID AS
@@ -211,143 +301,63 @@ $$
     ELSE
       uuid_generate_v5(uuid_ns_provsql(),concat(state,token))
     END;
-$$ LANGUAGE SQL IMMUTABLE SET search_path=provsql,public;
+$$ LANGUAGE SQL IMMUTABLE PARALLEL SAFE SET search_path=provsql,public;
 
 CREATE AGGREGATE uuid_provsql_agg(UUID) (
   SFUNC = uuid_provsql_concat,
-  STYPE = UUID
+  STYPE = UUID,
+  PARALLEL = SAFE
 );
 
 CREATE FUNCTION provenance_times(VARIADIC tokens uuid[])
   RETURNS UUID AS
-$$
-DECLARE
-  times_token uuid;
-  filtered_tokens uuid[];
-BEGIN
-  SELECT array_agg(t) FROM unnest(tokens) t WHERE t <> gate_one() INTO filtered_tokens;
-
-  CASE array_length(filtered_tokens,1)
-    WHEN 0 THEN
-      times_token:=gate_one();
-    WHEN 1 THEN
-      times_token:=filtered_tokens[1];
-    ELSE
-      SELECT uuid_generate_v5(uuid_ns_provsql(),concat('times',uuid_provsql_agg(t)))
-      INTO times_token
-      FROM unnest(filtered_tokens) t;
-
-      PERFORM create_gate(times_token, 'times', filtered_tokens);
-  END CASE;
-
-  RETURN times_token;
-END
-$$ LANGUAGE plpgsql SET search_path=provsql,pg_temp,public SECURITY DEFINER;
+  'provsql','provenance_times' LANGUAGE C PARALLEL SAFE;
 
 CREATE FUNCTION provenance_monus(token1 UUID, token2 UUID)
   RETURNS UUID AS
-$$
-DECLARE
-  monus_token uuid;
-BEGIN
-  IF token2 IS NULL THEN
-    -- Special semantics, because of a LEFT OUTER JOIN used by the
-    -- difference operator: token2 NULL means there is no second argument
-    RETURN token1;
-  END IF;
-
-  IF token1 = token2 THEN
-    -- X-X=0
-    monus_token:=gate_zero();
-  ELSIF token1 = gate_zero() THEN
-    -- 0-X=0
-    monus_token:=gate_zero();
-  ELSIF token2 = gate_zero() THEN
-    -- X-0=X
-    monus_token:=token1;
-  ELSE
-    monus_token:=uuid_generate_v5(uuid_ns_provsql(),concat('monus',token1,token2));
-    PERFORM create_gate(monus_token, 'monus', ARRAY[token1::uuid, token2::uuid]);
-  END IF;
-
-  RETURN monus_token;
-END
-$$ LANGUAGE plpgsql SET search_path=provsql,pg_temp,public SECURITY DEFINER;
+  'provsql','provenance_monus' LANGUAGE C PARALLEL SAFE;
 
+-- All gate constructors only write to the shared memory store, and can
+-- be run in parallel workers
 CREATE FUNCTION provenance_project(token UUID, VARIADIC positions int[])
   RETURNS UUID AS
-$$
-DECLARE
-  project_token uuid;
-  rec record;
-BEGIN
-  project_token:=uuid_generate_v5(uuid_ns_provsql(),concat(token,positions));
-
-  LOCK TABLE provenance_circuit_extra;
-  SELECT 1 FROM provenance_circuit_extra WHERE gate = project_token INTO rec;
-  IF rec IS NULL THEN
-    PERFORM create_gate(project_token, 'project', ARRAY[token::uuid]);
-    INSERT INTO provenance_circuit_extra
-      SELECT gate, case when info=0 then null else info end, idx
-      FROM (
-              SELECT project_token gate, info, idx FROM unnest(positions) WITH ORDINALITY AS a(info, idx)
-            ) t;
-  END IF;
-
-  RETURN project_token;
-END
-$$ LANGUAGE plpgsql SET search_path=provsql,pg_temp,public SECURITY DEFINER;
+  'provsql','provenance_project' LANGUAGE C STRICT PARALLEL SAFE;
 
 CREATE FUNCTION provenance_eq(token UUID, pos1 int, pos2 int)
   RETURNS UUID AS
-$$
-DECLARE
-  eq_token uuid;
-  rec record;
-BEGIN
-  eq_token:=uuid_generate_v5(uuid_ns_provsql(),concat(token,pos1,pos2));
-
-  LOCK TABLE provenance_circuit_extra;
-  SELECT 1 FROM provenance_circuit_extra WHERE gate = eq_token INTO rec;
-  IF rec IS NULL THEN
-    PERFORM create_gate(eq_token, 'eq', ARRAY[token::uuid]);
-    PERFORM set_infos(eq_token, pos1, pos2);
-    INSERT INTO provenance_circuit_extra VALUES(eq_token, pos1, pos2);
-  END IF;
-  RETURN eq_token;
-END
-$$ LANGUAGE plpgsql SET search_path=provsql,pg_temp,public SECURITY DEFINER;
+  'provsql','provenance_eq' LANGUAGE C STRICT PARALLEL SAFE;
 
 CREATE OR REPLACE FUNCTION provenance_plus(tokens uuid[])
   RETURNS UUID AS
-$$
-DECLARE
-  c INTEGER;
-  plus_token uuid;
-  filtered_tokens uuid[];
-BEGIN
-  c:=array_length(tokens, 1);
-
-  IF c = 0 THEN
-    plus_token := gate_zero();
-  ELSIF c = 1 THEN
-    plus_token := tokens[1];
-  ELSE
-    SELECT array_agg(t)
-    FROM (SELECT t from unnest(tokens) t ORDER BY t) tmp
-    WHERE t <> gate_zero()
-    INTO filtered_tokens;
-
-    plus_token := uuid_generate_v5(
-      uuid_ns_provsql(),
-      concat('plus',array_to_string(filtered_tokens, ',')));
-
-    PERFORM create_gate(plus_token, 'plus', filtered_tokens);
-  END IF;
-
-  RETURN plus_token;
-END
-$$ LANGUAGE plpgsql STRICT SET search_path=provsql,pg_temp,public SECURITY DEFINER;
+  'provsql','provenance_plus' LANGUAGE C STRICT PARALLEL SAFE;
+
+CREATE FUNCTION provenance_plus_agg_transfn(state internal, token UUID)
+  RETURNS internal AS
+  'provsql','provenance_plus_agg_transfn' LANGUAGE C PARALLEL SAFE;
+CREATE FUNCTION provenance_plus_agg_combinefn(state1 internal, state2 internal)
+  RETURNS internal AS
+  'provsql','provenance_plus_agg_combinefn' LANGUAGE C PARALLEL SAFE;
+CREATE FUNCTION provenance_plus_agg_serialfn(state internal)
+  RETURNS bytea AS
+  'provsql','provenance_plus_agg_serialfn' LANGUAGE C STRICT PARALLEL SAFE;
+CREATE FUNCTION provenance_plus_agg_deserialfn(data bytea, dummy internal)
+  RETURNS internal AS
+  'provsql','provenance_plus_agg_deserialfn' LANGUAGE C STRICT PARALLEL SAFE;
+CREATE FUNCTION provenance_plus_agg_finalfn(state internal)
+  RETURNS UUID AS
+  'provsql','provenance_plus_agg_finalfn' LANGUAGE C PARALLEL SAFE;
+
+-- Same as provenance_plus(array_agg(token)), used by the rewriting of
+-- GROUP BY and DISTINCT queries
+CREATE AGGREGATE provenance_plus_agg(UUID) (
+  SFUNC = provenance_plus_agg_transfn,
+  STYPE = internal,
+  FINALFUNC = provenance_plus_agg_finalfn,
+  COMBINEFUNC = provenance_plus_agg_combinefn,
+  SERIALFUNC = provenance_plus_agg_serialfn,
+  DESERIALFUNC = provenance_plus_agg_deserialfn,
+  PARALLEL = SAFE
+);
 
 CREATE OR REPLACE FUNCTION provenance_evaluate(
   token UUID,
@@ -442,16 +452,16 @@ BEGIN
     RETURN NULL;
   ELSIF gt='agg' THEN
     EXECUTE format('SELECT %I(%I(provsql.aggregation_evaluate(t,%L,%L,%L,%L,%L::%s,%L,%L,%L,%L,%L)),pp.proname::varchar) FROM
-                    unnest(get_children(%L)) AS t, provsql.aggregation_circuit_extra ace, pg_proc pp
-                    WHERE ace.gate=%L AND pp.oid=ace.aggfnoid
+                    unnest(get_children(%L)) AS t, pg_proc pp
+                    WHERE pp.oid=(provsql.get_infos(%L)).info1
                     GROUP BY pp.proname',
       agg_function_final, agg_function,token2value,agg_function_final,agg_function,semimod_function,element_one,value_type,value_type,plus_function,times_function,
       monus_function,delta_function,token,token)
     INTO result;
   ELSE
     -- gt='semimod'
-    EXECUTE format('SELECT %I(val,provsql.provenance_evaluate((get_children(%L))[1],%L,%L::%s,%L,%L,%L,%L,%L)) FROM provsql.aggregation_values av WHERE gate=(get_children(%L))[2]',
-      semimod_function,token,token2value,element_one,value_type,value_type,plus_function,times_function,monus_function,delta_function,token)
+    EXECUTE format('SELECT %I(provsql.get_extra((get_children(%L))[2])::varchar,provsql.provenance_evaluate((get_children(%L))[1],%L,%L::%s,%L,%L,%L,%L,%L))',
+      semimod_function,token,token,token2value,element_one,value_type,value_type,plus_function,times_function,monus_function,delta_function)
     INTO result;
   END IF;
   RETURN result;
@@ -470,17 +480,14 @@ BEGIN
       SELECT $1,t,provsql.get_gate_type($1) FROM unnest(provsql.get_children($1)) AS t
         UNION ALL
       SELECT p1.t,u,provsql.get_gate_type(p1.t) FROM transitive_closure p1, unnest(provsql.get_children(p1.t)) AS u)
-    SELECT t1.*, infos FROM (
+    SELECT t1.*, provsql.get_extra_infos(t1.f) FROM (
       SELECT f::uuid,t::uuid,gate_type,NULL FROM transitive_closure
         UNION ALL
       SELECT p2.provenance::uuid as f, NULL::uuid, ''input'', CAST (p2.value AS varchar) FROM transitive_closure p1 JOIN ' || token2desc || ' AS p2
         ON p2.provenance=t
         UNION ALL
       SELECT provenance::uuid as f, NULL::uuid, ''input'', CAST (value AS varchar) FROM ' || token2desc || ' WHERE provenance=$1
-    ) t1
-    LEFT OUTER JOIN (
-      SELECT gate, ARRAY_AGG(ARRAY[info1,info2]) infos FROM provsql.provenance_circuit_extra GROUP BY gate
-    ) t2 on t1.f=t2.gate'
+    ) t1'
   USING token LOOP;
   RETURN;
 END
@@ -501,11 +508,11 @@ BEGIN
     FROM pg_attribute a1 JOIN pg_type ON atttypid=pg_type.oid
                         JOIN pg_class ON attrelid=pg_class.oid
                         JOIN pg_namespace ON relnamespace=pg_namespace.oid
-    WHERE typname='uuid' AND relkind='r'
+    WHERE typname IN ('uuid', 'token8') AND relkind='r'
                                      AND nspname<>'provsql'
                                      AND attname='provsql'
   LOOP
-    EXECUTE format('SELECT * FROM %I WHERE provsql=%L',t.relname,token) INTO result;
+    EXECUTE format('SELECT * FROM %I WHERE provsql=%L::uuid',t.relname,token) INTO result;
     IF result IS NOT NULL THEN
       table_name:=t.relname;
       nb_columns:=t.c;
@@ -522,41 +529,20 @@ $$
       SELECT $1,t,id,provsql.get_gate_type($1) FROM unnest(provsql.get_children($1)) WITH ORDINALITY AS a(t,id)
         UNION ALL
       SELECT p1.t,u,id,provsql.get_gate_type(p1.t) FROM transitive_closure p1, unnest(provsql.get_children(p1.t)) WITH ORDINALITY AS a(u, id)
-    ) SELECT t1.f, t1.t, t1.gate_type, table_name, nb_columns, infos, row_number() over() FROM (
+    ) SELECT t1.f, t1.t, t1.gate_type, table_name, nb_columns, provsql.get_extra_infos(t1.f), row_number() over() FROM (
       SELECT f, t::uuid, idx, gate_type, NULL AS table_name, NULL AS nb_columns FROM transitive_closure
       UNION ALL
         SELECT DISTINCT t, NULL::uuid, NULL::int, 'input'::provenance_gate, (id).table_name, (id).nb_columns FROM transitive_closure JOIN (SELECT t AS prov, provsql.identify_token(t) as id FROM transitive_closure WHERE t NOT IN (SELECT f FROM transitive_closure)) temp ON t=prov
       UNION ALL
         SELECT DISTINCT $1, NULL::uuid, NULL::int, 'input'::provenance_gate, (id).table_name, (id).nb_columns FROM (SELECT provsql.identify_token($1) AS id WHERE $1 NOT IN (SELECT f FROM transitive_closure)) temp
-      ) t1 LEFT OUTER JOIN (
-      SELECT gate, ARRAY_AGG(ARRAY[info1,info2]) infos FROM provenance_circuit_extra GROUP BY gate
-    ) t2 ON t1.f=t2.gate ORDER BY f,idx
+      ) t1 ORDER BY f,idx
 $$
 LANGUAGE sql;
 
 --functions and aggregates for aggregate evaluation
-CREATE OR REPLACE FUNCTION provenance_delta
-  (token UUID)
+CREATE OR REPLACE FUNCTION provenance_delta(token UUID)
   RETURNS UUID AS
-$$
-DECLARE
-  delta_token uuid;
-BEGIN
-  IF token = gate_zero() THEN
-    return token;
-  END IF;
-
-  IF token = gate_one() THEN
-    return token;
-  END IF;
-
-  delta_token:=uuid_generate_v5(uuid_ns_provsql(),concat('delta',token));
-
-  PERFORM create_gate(delta_token,'delta',ARRAY[token::uuid]);
-
-  RETURN delta_token;
-END
-$$ LANGUAGE plpgsql SET search_path=provsql,pg_temp,public SECURITY DEFINER;
+  'provsql','provenance_delta' LANGUAGE C STRICT PARALLEL SAFE;
 
 CREATE OR REPLACE FUNCTION provenance_aggregate(
     aggfnoid integer,
@@ -564,64 +550,11 @@ CREATE OR REPLACE FUNCTION provenance_aggregate(
     val anyelement,
     tokens uuid[])
   RETURNS agg_token AS
-$$
-DECLARE
-  c INTEGER;
-  agg_tok uuid;
-  agg_val varchar;
-  agg_tok_tuple agg_token;
-BEGIN
-  c:=array_length(tokens, 1);
-
-  agg_val = CAST(val as VARCHAR);
-
-  IF c = 0 THEN
-    agg_tok := gate_zero();
-  ELSE
-    agg_tok := uuid_generate_v5(
-      uuid_ns_provsql(),
-      concat('agg',array_to_string(tokens, ',')));
-    LOCK TABLE aggregation_circuit_extra;
-    PERFORM create_gate(agg_tok, 'agg', array_agg(t))
-      FROM unnest(tokens) AS t
-      WHERE t != gate_zero();
-    BEGIN
-      INSERT INTO aggregation_circuit_extra VALUES(agg_tok, aggfnoid, aggtype, agg_val);
-    EXCEPTION WHEN unique_violation THEN
-    END;
-  END IF;
-
-  RETURN '( '||agg_tok||' , '||agg_val||' )';
-END
-$$ LANGUAGE plpgsql STRICT SET search_path=provsql,pg_temp,public SECURITY DEFINER;
+  'provsql','provenance_aggregate' LANGUAGE C STRICT PARALLEL SAFE;
 
 CREATE FUNCTION provenance_semimod(val anyelement, token UUID)
   RETURNS UUID AS
-$$
-DECLARE
-  semimod_token uuid;
-  value_token uuid;
-BEGIN
-  LOCK TABLE aggregation_values;
-
-  SELECT uuid_generate_v5(uuid_ns_provsql(),concat('value',CAST(val AS VARCHAR)))
-    INTO value_token;
-  SELECT uuid_generate_v5(uuid_ns_provsql(),concat('semimod',value_token,token))
-    INTO semimod_token;
-
-  --create value gates
-  PERFORM create_gate(value_token,'value');
-  BEGIN
-    INSERT INTO aggregation_values VALUES(value_token,CAST(val AS VARCHAR));
-  EXCEPTION WHEN unique_violation THEN
-  END;
-
-  --create semimod gate
-  PERFORM create_gate(semimod_token,'semimod',ARRAY[token::uuid,value_token]);
-
-  RETURN semimod_token;
-END
-$$ LANGUAGE plpgsql SET search_path=provsql,pg_temp,public SECURITY DEFINER;
+  'provsql','provenance_semimod' LANGUAGE C PARALLEL SAFE;
 
 CREATE OR REPLACE FUNCTION provenance_evaluate(
   token UUID,
@@ -653,7 +586,18 @@ CREATE OR REPLACE FUNCTION probability_evaluate(
   method text = NULL,
   arguments text = NULL)
   RETURNS DOUBLE PRECISION AS
-  'provsql','probability_evaluate' LANGUAGE C;
+  'provsql','probability_evaluate' LANGUAGE C PARALLEL RESTRICTED;
+
+CREATE OR REPLACE FUNCTION probability_interval(
+  token UUID,
+  epsilon DOUBLE PRECISION,
+  delta DOUBLE PRECISION,
+  arguments text = NULL,
+  OUT probability DOUBLE PRECISION,
+  OUT low DOUBLE PRECISION,
+  OUT high DOUBLE PRECISION,
+  OUT samples BIGINT)
+  AS 'provsql','probability_interval' LANGUAGE C PARALLEL RESTRICTED;
 
 CREATE OR REPLACE FUNCTION view_circuit(
   token UUID,
@@ -663,7 +607,7 @@ CREATE OR REPLACE FUNCTION view_circuit(
   'provsql','view_circuit' LANGUAGE C;
 
 CREATE OR REPLACE FUNCTION provenance() RETURNS UUID AS
- 'provsql', 'provenance' LANGUAGE C;
+ 'provsql', 'provenance' LANGUAGE C PARALLEL SAFE;
 
 CREATE OR REPLACE FUNCTION where_provenance(token UUID)
   RETURNS text AS
@@ -675,11 +619,33 @@ CREATE OR REPLACE FUNCTION dump_data() RETURNS TEXT AS
 CREATE OR REPLACE FUNCTION read_data_dump() RETURNS TEXT AS
   'provsql', 'read_data_dump' LANGUAGE C;
 
+CREATE OR REPLACE FUNCTION pin_token(token UUID)
+  RETURNS void AS
+$$
+BEGIN
+  INSERT INTO pinned_tokens VALUES(token) ON CONFLICT DO NOTHING;
+END
+$$ LANGUAGE plpgsql STRICT SET search_path=provsql,pg_temp SECURITY DEFINER;
+
+CREATE OR REPLACE FUNCTION unpin_token(token UUID)
+  RETURNS void AS
+$$
+BEGIN
+  DELETE FROM pinned_tokens p WHERE p.token = unpin_token.token;
+END
+$$ LANGUAGE plpgsql STRICT SET search_path=provsql,pg_temp SECURITY DEFINER;
+
+CREATE OR REPLACE FUNCTION vacuum_circuit() RETURNS BIGINT AS
+  'provsql', 'vacuum_circuit' LANGUAGE C;
+
+REVOKE EXECUTE ON FUNCTION vacuum_circuit() FROM PUBLIC;
+
 
 SELECT create_gate(gate_zero(), 'zero');
 SELECT create_gate(gate_one(), 'one');
 
 GRANT USAGE ON SCHEMA provsql TO PUBLIC;
-GRANT SELECT ON provenance_circuit_extra TO PUBLIC;
+GRANT USAGE ON SEQUENCE token8_seq TO PUBLIC;
+GRANT SELECT ON pg_stat_provsql TO PUBLIC;
 
 SET search_path TO public;
@@ -4,6 +4,8 @@
 extern "C" {
 #include <unistd.h>
 #include <math.h>
+#include <signal.h>
+#include <pthread.h>
 }
 
 #include <cassert>
@@ -13,6 +15,14 @@ extern "C" {
 #include <cstdlib>
 #include <iostream>
 #include <vector>
+#include <stack>
+#include <algorithm>
+#include <array>
+#include <iterator>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <system_error>
 
 #include "dDNNF.h"
 
@@ -33,21 +43,27 @@ gate_t BooleanCircuit::setGate(BooleanGate type)
   auto id = Circuit::setGate(type);
   if(type == BooleanGate::IN) {
     setProb(id,1.);
-    inputs.insert(id);
+    inputs.push_back(id);
   } else if(type == BooleanGate::MULIN) {
-    mulinputs.insert(id);
+    mulinputs.push_back(id);
   }
   return id;
 }
 
 gate_t BooleanCircuit::setGate(const uuid &u, BooleanGate type)
 {
- auto id = Circuit::setGate(u, type);
+  // A gate is only recorded once among inputs or mulinputs, even when
+  // its type is set several times
+  bool known = hasGate(u) && getGateType(getGate(u)) == type;
+  auto id = Circuit::setGate(u, type);
+  if(known)
+    return id;
+
   if(type == BooleanGate::IN) {
     setProb(id,1.);
-    inputs.insert(id);
+    inputs.push_back(id);
   } else if(type == BooleanGate::MULIN) {
-    mulinputs.insert(id);
+    mulinputs.push_back(id);
   }
   return id;
 }
@@ -70,6 +86,7 @@ gate_t BooleanCircuit::addGate()
 {
   auto id=Circuit::addGate();
   prob.push_back(1);
+  info.push_back(0);
   return id;
 }
 
@@ -124,93 +141,616 @@ std::string BooleanCircuit::toString(gate_t g) const
   return "("+result+")";
 }
 
-bool BooleanCircuit::evaluate(gate_t g, const std::unordered_set<gate_t> &sampled) const
+std::vector<gate_t> BooleanCircuit::topologicalOrder(gate_t g) const
 {
-  bool disjunction=false;
+  std::vector<gate_t> order;
+  std::vector<bool> seen(gates.size());
+  std::stack<std::pair<gate_t, unsigned>> stack;
+
+  seen[static_cast<std::underlying_type<gate_t>::type>(g)] = true;
+  stack.emplace(g, 0);
+
+  while(!stack.empty()) {
+    auto &[h, next] = stack.top();
+    auto w = getWires(h);
+
+    if(next < w.size()) {
+      auto child = w[next++];
+      if(!seen[static_cast<std::underlying_type<gate_t>::type>(child)]) {
+        seen[static_cast<std::underlying_type<gate_t>::type>(child)] = true;
+        stack.emplace(child, 0);
+      }
+    } else {
+      order.push_back(h);
+      stack.pop();
+    }
+  }
 
-  switch(getGateType(g)) {
-    case BooleanGate::IN:
-      return sampled.find(g)!=sampled.end();
-    case BooleanGate::MULIN:
-    case BooleanGate::MULVAR:
-      throw CircuitException("Monte-Carlo sampling not implemented on multivalued inputs");
+  return order;
+}
+
+// splitmix64, used as a counter-based generator: the random word of
+// a given counter only depends on the seed and on that counter
+static inline uint64_t random_word(uint64_t seed, uint64_t counter)
+{
+  uint64_t x = seed + (counter + 1) * 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// 64 independent bits, each set with probability p, up to 2^-32: the
+// binary digits 0.b1...b32 of p are read from b32 to b1, each 1 (resp.
+// 0) digit oring (resp. anding) a uniform random word into the result,
+// so that a bit is set with probability (1+q)/2 (resp. q/2) if it was
+// with probability q. Trailing zero digits leave the result at 0.
+static inline uint64_t random_bits(double p, uint64_t seed, uint64_t counter)
+{
+  if(p >= 1.)
+    return ~0ULL;
+  if(!(p > 0.))
+    return 0;
+
+  uint32_t digits = static_cast<uint32_t>(p * 4294967296.);
+  if(digits == 0)
+    return 0;
+
+  uint64_t result = 0;
+  for(unsigned k = __builtin_ctz(digits); k < 32; ++k) {
+    uint64_t r = random_word(seed, counter * 32 + k);
+    if(digits & (1u << k))
+      result |= r;
+    else
+      result &= r;
+  }
+
+  return result;
+}
+
+std::vector<gate_t> BooleanCircuit::monteCarloOrder(gate_t g) const
+{
+  auto order = topologicalOrder(g);
+
+  for(auto h: order) {
+    switch(getGateType(h)) {
+      case BooleanGate::MULIN:
+      case BooleanGate::MULVAR:
+        throw CircuitException("Monte-Carlo sampling not implemented on multivalued inputs");
+      case BooleanGate::UNDETERMINED:
+        throw CircuitException("Incorrect gate type");
+      default:
+        ;
+    }
+  }
+
+  return order;
+}
+
+uint64_t BooleanCircuit::bitEvaluation(gate_t h, const std::vector<uint64_t> &values) const
+{
+  uint64_t v;
+
+  switch(getGateType(h)) {
     case BooleanGate::NOT:
-      return !evaluate(*(getWires(g).begin()), sampled);
+      v = ~values[static_cast<std::underlying_type<gate_t>::type>(getWires(h)[0])];
+      break;
     case BooleanGate::AND:
-      disjunction = false;
+      v = ~0ULL;
+      for(auto c: getWires(h))
+        v &= values[static_cast<std::underlying_type<gate_t>::type>(c)];
       break;
     case BooleanGate::OR:
-      disjunction = true;
+      v = 0;
+      for(auto c: getWires(h))
+        v |= values[static_cast<std::underlying_type<gate_t>::type>(c)];
       break;
-    case BooleanGate::UNDETERMINED:
-      throw CircuitException("Incorrect gate type");
+    default:
+      v = 0; // excluded by monteCarloOrder, input gates are set by callers
   }
 
-  for(auto s: getWires(g)) {
-    bool e = evaluate(s, sampled);
-    if(disjunction && e)
-      return true;
-    if(!disjunction && !e)
-      return false;
-  }
+  return v;
+}
 
-  if(disjunction)
-    return false;
-  else
-    return true;
+// Number of threads used when nb_threads are asked for: one thread per
+// hardware thread at most, whatever the arguments given from SQL
+static unsigned available_threads(unsigned nb_threads)
+{
+  return std::max(1u, std::min(nb_threads, std::thread::hardware_concurrency()));
 }
 
-double BooleanCircuit::monteCarlo(gate_t g, unsigned samples) const
+// Runs f(0), ..., f(nb_threads-1), in parallel if nb_threads>1. Worker
+// threads must not run the signal handlers of the backend: they are
+// started with all signals blocked, SIGINT being handled by the calling
+// thread, which sets provsql_interrupted. An exception escaping a worker
+// would terminate the backend: the first one is thrown again once all
+// threads are joined.
+template<typename F>
+static void run_threads(unsigned nb_threads, F f)
 {
-  auto success{0u};
+  if(nb_threads == 1) {
+    f(0);
+    return;
+  }
+
+  std::vector<std::thread> threads;
+  std::vector<std::exception_ptr> errors(nb_threads);
 
-  for(unsigned i=0; i<samples; ++i) {
-    std::unordered_set<gate_t> sampled;
-    for(auto in: inputs) {
-      if(rand() *1. / RAND_MAX < getProb(in)) {
-        sampled.insert(in);
+  sigset_t all, previous;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &previous);
+  try {
+    for(unsigned t=0; t<nb_threads; ++t)
+      threads.emplace_back([&, t]() {
+        try {
+          f(t);
+        } catch(...) {
+          errors[t] = std::current_exception();
+        }
+      });
+  } catch(const std::system_error &) {
+    for(auto &thread: threads)
+      thread.join();
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    throw CircuitException("Cannot start threads");
+  }
+  pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+
+  for(auto &thread: threads)
+    thread.join();
+
+  for(const auto &e: errors)
+    if(e)
+      std::rethrow_exception(e);
+}
+
+uint64_t BooleanCircuit::monteCarloBatches(
+    gate_t g,
+    const std::vector<gate_t> &order,
+    uint64_t first,
+    uint64_t last,
+    uint64_t samples,
+    uint64_t seed,
+    unsigned nb_threads) const
+{
+  // Samples are drawn 64 at a time, one per bit of the words of values,
+  // evaluating the gates of order (reachable from g, children first)
+  // once per batch. The bits of an input gate in a batch are drawn from
+  // the counter (batch, gate): the result only depends on the seed, not
+  // on how batches are split among threads or calls.
+  const uint64_t nb_gates = gates.size();
+
+  // Evaluates batches [from,to), returns the number of successful
+  // samples; stops early if interrupted
+  auto run = [&](uint64_t from, uint64_t to, std::atomic<uint64_t> &done) {
+    std::vector<uint64_t> values(nb_gates);
+    uint64_t success = 0;
+
+    for(uint64_t batch=from; batch<to && !provsql_interrupted; ++batch) {
+      for(auto h: order) {
+        auto id = static_cast<std::underlying_type<gate_t>::type>(h);
+
+        if(getGateType(h) == BooleanGate::IN)
+          values[id] = random_bits(getProb(h), seed, batch * nb_gates + id);
+        else
+          values[id] = bitEvaluation(h, values);
       }
+
+      uint64_t result = values[static_cast<std::underlying_type<gate_t>::type>(g)];
+      if(samples < 64 * (batch + 1))
+        result &= (1ULL << (samples - 64 * batch)) - 1;
+      success += __builtin_popcountll(result);
+      ++done;
     }
 
-    if(evaluate(g, sampled))
-      ++success;
-    
+    return success;
+  };
+
+  std::atomic<uint64_t> done{0};
+  uint64_t success = 0;
+
+  nb_threads = std::max<uint64_t>(1, std::min<uint64_t>(available_threads(nb_threads), last - first));
+
+  std::vector<uint64_t> successes(nb_threads);
+
+  run_threads(nb_threads, [&](unsigned t) {
+    successes[t] = run(
+        first + (last - first) * t / nb_threads,
+        first + (last - first) * (t+1) / nb_threads,
+        done);
+  });
+  for(auto s: successes)
+    success += s;
+
+  if(provsql_interrupted)
+    throw CircuitException("Interrupted after "+std::to_string(std::min(samples, 64*(first+done.load())))+" samples");
+
+  return success;
+}
+
+double BooleanCircuit::monteCarlo(gate_t g, unsigned samples, uint64_t seed, unsigned nb_threads) const
+{
+  const auto order = monteCarloOrder(g);
+
+  return monteCarloBatches(g, order, 0, (samples + 63) / 64, samples, seed, nb_threads) * 1. / samples;
+}
+
+MonteCarloEstimate BooleanCircuit::adaptiveMonteCarlo(gate_t g, double epsilon, double delta, uint64_t seed, unsigned nb_threads) const
+{
+  // Sampling stops at the first of the checkpoints n = 1024, 2048,
+  // 4096... where the empirical Bernstein bound of Maurer and Pontil,
+  // at confidence delta/2^(k+2) for the k-th checkpoint, is within
+  // epsilon, and at the latest once n reaches the number of samples for
+  // which Hoeffding's bound, at confidence delta/2, is epsilon. Over all
+  // checkpoints, the interval fails with probability at most delta.
+  const auto order = monteCarloOrder(g);
+  const uint64_t hoeffding = static_cast<uint64_t>(ceil(log(4/delta) / (2*epsilon*epsilon)));
+  uint64_t n = 0, success = 0;
+  double delta_k = delta / 4;
+  MonteCarloEstimate result;
+
+  for(uint64_t target = 1024; ; target *= 2, delta_k /= 2) {
+    target = std::min(target, hoeffding);
+    success += monteCarloBatches(g, order, n / 64, (target + 63) / 64, target, seed, nb_threads);
+    n = target;
+
+    double p = success * 1. / n;
+    double width;
+
+    if(n == hoeffding)
+      width = epsilon;
+    else {
+      double variance = p * (1 - p) * n / (n - 1);
+      double l = log(4 / delta_k);
+      width = sqrt(2 * variance * l / n) + 7 * l / (3 * (n - 1));
+    }
+
+    if(width <= epsilon || n == hoeffding) {
+      result.probability = p;
+      result.low = std::max(0., p - width);
+      result.high = std::min(1., p + width);
+      result.samples = n;
+      return result;
+    }
+  }
+}
+
+std::vector<std::vector<gate_t>> BooleanCircuit::monotoneDNF(gate_t g) const
+{
+  // The DNF of each gate, as a list of sorted clauses of input gates, is
+  // computed children first: OR gates concatenate the DNFs of their
+  // children, AND gates distribute over them, so that a circuit already
+  // in DNF is flattened in linear time. The DNF of a gate is freed once
+  // all of its parents have used it.
+  const auto order = topologicalOrder(g);
+  std::vector<std::vector<std::vector<gate_t>>> dnf(gates.size());
+  std::vector<unsigned> uses(gates.size());
+
+  for(auto h: order) {
+    switch(getGateType(h)) {
+      case BooleanGate::IN:
+      case BooleanGate::AND:
+      case BooleanGate::OR:
+        break;
+      default:
+        throw CircuitException("FPRAS only implemented on monotone circuits");
+    }
+
+    for(auto c: getWires(h))
+      ++uses[static_cast<std::underlying_type<gate_t>::type>(c)];
+  }
+
+  for(auto h: order) {
+    auto &d = dnf[static_cast<std::underlying_type<gate_t>::type>(h)];
+
+    switch(getGateType(h)) {
+      case BooleanGate::IN:
+        d.push_back({h});
+        break;
+
+      case BooleanGate::OR:
+        for(auto c: getWires(h)) {
+          const auto &dc = dnf[static_cast<std::underlying_type<gate_t>::type>(c)];
+          if(d.size() + dc.size() > MAX_DNF_CLAUSES)
+            throw CircuitException("DNF with more than "+std::to_string(MAX_DNF_CLAUSES)+" clauses");
+          d.insert(d.end(), dc.begin(), dc.end());
+        }
+        break;
+
+      case BooleanGate::AND:
+        d.emplace_back();
+        for(auto c: getWires(h)) {
+          const auto &dc = dnf[static_cast<std::underlying_type<gate_t>::type>(c)];
+          if(d.size() * dc.size() > MAX_DNF_CLAUSES)
+            throw CircuitException("DNF with more than "+std::to_string(MAX_DNF_CLAUSES)+" clauses");
+
+          std::vector<std::vector<gate_t>> product;
+          product.reserve(d.size() * dc.size());
+          for(const auto &a: d)
+            for(const auto &b: dc) {
+              product.emplace_back();
+              std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(product.back()));
+            }
+          d = std::move(product);
+        }
+        break;
+
+      default:
+        assert(false);
+    }
+
+    std::sort(d.begin(), d.end());
+    d.erase(std::unique(d.begin(), d.end()), d.end());
+
+    for(auto c: getWires(h))
+      if(--uses[static_cast<std::underlying_type<gate_t>::type>(c)] == 0)
+        std::vector<std::vector<gate_t>>().swap(dnf[static_cast<std::underlying_type<gate_t>::type>(c)]);
+
     if(provsql_interrupted)
-      throw CircuitException("Interrupted after "+std::to_string(i+1)+" samples");
+      throw CircuitException("Interrupted");
   }
 
-  return success*1./samples;
+  return std::move(dnf[static_cast<std::underlying_type<gate_t>::type>(g)]);
 }
 
-double BooleanCircuit::possibleWorlds(gate_t g) const
-{ 
-  if(inputs.size()>=8*sizeof(unsigned long long))
+double BooleanCircuit::karpLubyMadras(gate_t g, double epsilon, double delta, uint64_t seed) const
+{
+  // Self-adjusting coverage algorithm of Karp, Luby, and Madras, on the
+  // m clauses of the DNF of g, of probabilities summing to U. A trial
+  // draws a clause with probability proportional to its probability,
+  // then a world in which that clause holds, then clauses uniformly
+  // until one holds in that world; a trial takes m.P(g)/U draws on
+  // average. After T=8(1+epsilon).m.ln(3/delta)/epsilon^2 draws in all,
+  // T.U/(m.N), with N the number of completed trials, is within a
+  // factor 1±epsilon of P(g) with probability at least 1-delta, however
+  // small P(g) is.
+  auto dnf = monotoneDNF(g);
+
+  // Clauses of probability 0 never hold
+  std::vector<double> cumulated;
+  double U = 0.;
+
+  dnf.erase(std::remove_if(dnf.begin(), dnf.end(), [&](const auto &clause) {
+    double p = 1.;
+    for(auto x: clause)
+      p *= getProb(x);
+    if(p <= 0.)
+      return true;
+    U += p;
+    cumulated.push_back(U);
+    return false;
+  }), dnf.end());
+
+  if(dnf.empty())
+    return 0.;
+  if(dnf[0].empty())
+    return 1.;
+
+  const uint64_t m = dnf.size();
+  const uint64_t T = static_cast<uint64_t>(ceil(8 * (1 + epsilon) * m * log(3 / delta) / (epsilon * epsilon)));
+
+  uint64_t counter = 0;
+  auto uniform = [&]() {
+    return (random_word(seed, counter++) >> 11) * (1. / 9007199254740992.);
+  };
+
+  // The world of a trial is drawn lazily: an input gate is only drawn
+  // the first time it is looked at in the trial
+  std::vector<uint64_t> trial_of(gates.size());
+  std::vector<char> value(gates.size());
+  uint64_t trial = 0, completed = 0;
+
+  auto holds = [&](gate_t x) {
+    auto id = static_cast<std::underlying_type<gate_t>::type>(x);
+    if(trial_of[id] != trial) {
+      trial_of[id] = trial;
+      value[id] = uniform() < getProb(x);
+    }
+    return value[id];
+  };
+
+  for(uint64_t step = 0; step < T; ) {
+    ++trial;
+
+    auto i = std::upper_bound(cumulated.begin(), cumulated.end(), uniform() * U) - cumulated.begin();
+    for(auto x: dnf[std::min<uint64_t>(i, m - 1)]) {
+      auto id = static_cast<std::underlying_type<gate_t>::type>(x);
+      trial_of[id] = trial;
+      value[id] = true;
+    }
+
+    bool satisfied = false;
+    while(!satisfied && step < T) {
+      if((++step & 0xffff) == 0 && provsql_interrupted)
+        throw CircuitException("Interrupted after "+std::to_string(step)+" steps");
+
+      const auto &clause = dnf[random_word(seed, counter++) % m];
+      satisfied = std::all_of(clause.begin(), clause.end(), holds);
+    }
+
+    if(satisfied)
+      ++completed;
+  }
+
+  // No trial completed only happens if the first one took T draws,
+  // with probability at most delta: the estimate is then undefined, and
+  // the union bound U, the only one known on P(g), is returned instead
+  if(completed == 0)
+    return std::min(1., U);
+
+  // The estimate can exceed 1 by a factor up to 1+epsilon
+  return std::min(1., T * U / (m * completed));
+}
+
+double BooleanCircuit::possibleWorlds(gate_t g, unsigned nb_threads) const
+{
+  // Worlds are enumerated over the input gates reachable from g whose
+  // probability is neither 0 nor 1, the others being constant. The
+  // first six of these variables vary along the 64 bits of the words of
+  // values, as in monteCarloBatches; the other ones, the high
+  // variables, follow a Gray code, so that each step flips a single
+  // variable, updates the weight of the world by a single ratio, and
+  // only evaluates again the gates above that variable. The Gray code is
+  // split into chunks, in which the last high variables are fixed,
+  // shared among threads.
+  const auto order = monteCarloOrder(g);
+  const auto nb_gates = gates.size();
+  std::vector<gate_t> variables;
+  std::vector<uint64_t> initial(nb_gates);
+
+  for(auto h: order)
+    if(getGateType(h) == BooleanGate::IN) {
+      double p = getProb(h);
+      if(p >= 1.)
+        initial[static_cast<std::underlying_type<gate_t>::type>(h)] = ~0ULL;
+      else if(p > 0.)
+        variables.push_back(h);
+    }
+
+  if(variables.size() >= 64)
     throw CircuitException("Too many possible worlds to iterate over");
 
-  unsigned long long nb=(1<<inputs.size());
-  double totalp=0.;
+  // Weights of the 64 bits, set by the first six variables; bits beyond
+  // the worlds of these variables have weight 0
+  static constexpr uint64_t bit_patterns[6] = {
+    0xAAAAAAAAAAAAAAAAULL, 0xCCCCCCCCCCCCCCCCULL, 0xF0F0F0F0F0F0F0F0ULL,
+    0xFF00FF00FF00FF00ULL, 0xFFFF0000FFFF0000ULL, 0xFFFFFFFF00000000ULL
+  };
+  const unsigned nb_low = std::min<unsigned>(variables.size(), 6);
+  double low_weight[64];
+
+  for(unsigned b=0; b<64; ++b) {
+    low_weight[b] = b < (1u << nb_low) ? 1. : 0.;
+    for(unsigned k=0; k<nb_low; ++k) {
+      double p = getProb(variables[k]);
+      low_weight[b] *= (b >> k & 1) ? p : 1 - p;
+    }
+  }
+  for(unsigned k=0; k<nb_low; ++k)
+    initial[static_cast<std::underlying_type<gate_t>::type>(variables[k])] = bit_patterns[k];
+
+  // Total weight of the bits set in each byte of a word
+  std::vector<std::array<double, 256>> byte_weight(8);
+  for(unsigned j=0; j<8; ++j)
+    for(unsigned x=0; x<256; ++x) {
+      byte_weight[j][x] = 0.;
+      for(unsigned b=0; b<8; ++b)
+        if(x >> b & 1)
+          byte_weight[j][x] += low_weight[8*j+b];
+    }
 
-  for(unsigned long long i=0; i < nb; ++i) {
-    std::unordered_set<gate_t> s;
-    double p = 1;
+  const std::vector<gate_t> high(variables.begin() + nb_low, variables.end());
+  const unsigned nb_high = high.size();
+
+  // Gates to evaluate again when a high variable is flipped, children
+  // first
+  std::vector<std::vector<gate_t>> cones(nb_high);
+  std::vector<double> ratio(nb_high), inverse_ratio(nb_high);
+
+  for(unsigned i=0; i<nb_high; ++i) {
+    std::vector<bool> above(nb_gates);
+    above[static_cast<std::underlying_type<gate_t>::type>(high[i])] = true;
+
+    for(auto h: order) {
+      if(getGateType(h) == BooleanGate::IN)
+        continue;
+      for(auto c: getWires(h))
+        if(above[static_cast<std::underlying_type<gate_t>::type>(c)]) {
+          above[static_cast<std::underlying_type<gate_t>::type>(h)] = true;
+          cones[i].push_back(h);
+          break;
+        }
+    }
 
-    unsigned j=0;
-    for(gate_t in : inputs) {
-      if(i & (1 << j)) {
-        s.insert(in);
-        p*=getProb(in);
-      } else {
-        p*=1-getProb(in);
+    ratio[i] = getProb(high[i]) / (1 - getProb(high[i]));
+    inverse_ratio[i] = (1 - getProb(high[i])) / getProb(high[i]);
+  }
+
+  const unsigned nb_fixed = std::min(nb_high, 8u);
+  const unsigned nb_gray = nb_high - nb_fixed;
+  const uint64_t nb_chunks = 1ULL << nb_fixed;
+
+  // Probability of the worlds of a chunk where g holds
+  auto chunk_probability = [&](uint64_t chunk, std::vector<uint64_t> &values) {
+    values = initial;
+    for(unsigned i=nb_gray; i<nb_high; ++i)
+      if(chunk >> (i - nb_gray) & 1)
+        values[static_cast<std::underlying_type<gate_t>::type>(high[i])] = ~0ULL;
+
+    for(auto h: order)
+      if(getGateType(h) != BooleanGate::IN)
+        values[static_cast<std::underlying_type<gate_t>::type>(h)] = bitEvaluation(h, values);
+
+    // The weight of the high variables is computed again every 1024
+    // steps, rounding errors of the ratios not accumulating; worlds are
+    // summed by blocks of 1024 steps for the same reason
+    auto weight = [&]() {
+      double w = 1.;
+      for(unsigned i=0; i<nb_high; ++i) {
+        double p = getProb(high[i]);
+        w *= values[static_cast<std::underlying_type<gate_t>::type>(high[i])] ? p : 1 - p;
       }
-      ++j;
+      return w;
+    };
+    uint64_t last_r = 0;
+    double last_s = 0.;
+    auto sum_low = [&]() {
+      uint64_t r = values[static_cast<std::underlying_type<gate_t>::type>(g)];
+      if(r != last_r) {
+        last_r = r;
+        last_s = 0.;
+        for(unsigned j=0; j<8; ++j)
+          last_s += byte_weight[j][r >> (8*j) & 0xff];
+      }
+      return last_s;
+    };
+
+    double w = weight();
+    double total = 0., block = w * sum_low();
+
+    for(uint64_t step=1; step < (1ULL << nb_gray); ++step) {
+      unsigned i = __builtin_ctzll(step);
+      uint64_t &v = values[static_cast<std::underlying_type<gate_t>::type>(high[i])];
+
+      v = ~v;
+      for(auto h: cones[i])
+        values[static_cast<std::underlying_type<gate_t>::type>(h)] = bitEvaluation(h, values);
+
+      if(step % 1024 == 0) {
+        if(provsql_interrupted)
+          break;
+        total += block;
+        block = 0.;
+        w = weight();
+      } else if(v)
+        w *= ratio[i];
+      else
+        w *= inverse_ratio[i];
+
+      block += w * sum_low();
     }
 
-    if(evaluate(g, s))
-      totalp+=p;
-   
-    if(provsql_interrupted)
-      throw CircuitException("Interrupted");
-  }
+    return total + block;
+  };
+
+  // Chunks are summed in order, the result not depending on the number
+  // of threads
+  std::vector<double> probabilities(nb_chunks);
+  std::atomic<uint64_t> next_chunk{0};
+
+  nb_threads = std::max<uint64_t>(1, std::min<uint64_t>(available_threads(nb_threads), nb_chunks));
+
+  run_threads(nb_threads, [&](unsigned) {
+    std::vector<uint64_t> values;
+    for(uint64_t chunk = next_chunk++; chunk < nb_chunks && !provsql_interrupted; chunk = next_chunk++)
+      probabilities[chunk] = chunk_probability(chunk, values);
+  });
+
+  if(provsql_interrupted)
+    throw CircuitException("Interrupted");
+
+  double totalp = 0.;
+  for(auto p: probabilities)
+    totalp += p;
 
   return totalp;
 }
@@ -456,7 +996,10 @@ double BooleanCircuit::compilation(gate_t g, std::string compiler) const {
   } else
     elog(NOTICE, "Compiled d-DNNF in %s", outfilename.c_str());
 
-  return dnnf.dDNNFEvaluation(dnnf.getGate(new_d4?"1":std::to_string(i-1)));
+  auto root = dnnf.getGate(new_d4?"1":std::to_string(i-1));
+  dnnf.finalize();
+
+  return dnnf.dDNNFEvaluation(root);
 }
 
 double BooleanCircuit::WeightMC(gate_t g, std::string opt) const {
@@ -605,21 +1148,6 @@ double BooleanCircuit::independentEvaluation(gate_t g) const
   return independentEvaluationInternal(g, seen);
 }
 
-void BooleanCircuit::setInfo(gate_t g, unsigned int i)
-{
-  info[g] = i;
-}
-
-unsigned BooleanCircuit::getInfo(gate_t g) const
-{
-  auto it = info.find(g);
-
-  if(it==info.end())
-    return 0;
-  else
-    return it->second;
-}
-
 void BooleanCircuit::rewriteMultivaluedGatesRec(
     const std::vector<gate_t> &muls,
     const std::vector<double> &cumulated_probs,
@@ -628,7 +1156,7 @@ void BooleanCircuit::rewriteMultivaluedGatesRec(
     std::vector<gate_t> &prefix)
 {
   if(start==end) {
-    getWires(muls[start]) = prefix;
+    setWires(muls[start], prefix);
     return;
   }
 
@@ -638,7 +1166,7 @@ void BooleanCircuit::rewriteMultivaluedGatesRec(
       (cumulated_probs[mid+1] - cumulated_probs[start]) / 
       (cumulated_probs[end] - cumulated_probs[start]));
   auto not_g = setGate(BooleanGate::NOT);
-  getWires(not_g).push_back(g);
+  addWire(not_g, g);
 
   prefix.push_back(g);
   rewriteMultivaluedGatesRec(muls, cumulated_probs, start, mid, prefix);
@@ -674,7 +1202,7 @@ void BooleanCircuit::rewriteMultivaluedGates()
       cumulated_prob += getProb(muls[i]);
       cumulated_probs[i] = cumulated_prob;
       gates[static_cast<std::underlying_type<gate_t>::type>(muls[i])] = BooleanGate::AND;
-      getWires(muls[i]).clear();
+      setWires(muls[i], {});
     }
       
     std::vector<gate_t> prefix;
@@ -11,9 +11,28 @@
 
 enum class BooleanGate { UNDETERMINED, AND, OR, NOT, IN, MULIN, MULVAR };
 
+/* A Monte-Carlo estimate, with its confidence interval */
+struct MonteCarloEstimate {
+  double probability;
+  double low;
+  double high;
+  uint64_t samples;
+};
+
 class BooleanCircuit : public Circuit<BooleanGate> {
  private:
-  bool evaluate(gate_t g, const std::unordered_set<gate_t> &sampled) const;
+  std::vector<gate_t> topologicalOrder(gate_t g) const;
+  std::vector<gate_t> monteCarloOrder(gate_t g) const;
+  uint64_t bitEvaluation(gate_t h, const std::vector<uint64_t> &values) const;
+  uint64_t monteCarloBatches(
+    gate_t g,
+    const std::vector<gate_t> &order,
+    uint64_t first,
+    uint64_t last,
+    uint64_t samples,
+    uint64_t seed,
+    unsigned nb_threads) const;
+  std::vector<std::vector<gate_t>> monotoneDNF(gate_t g) const;
   std::string Tseytin(gate_t g, bool display_prob) const;
   double independentEvaluationInternal(gate_t g, std::set<gate_t> &seen) const;
   void rewriteMultivaluedGatesRec(
@@ -24,12 +43,14 @@ class BooleanCircuit : public Circuit<BooleanGate> {
     std::vector<gate_t> &prefix);
 
  protected:
-  std::set<gate_t> inputs;
-  std::set<gate_t> mulinputs;
+  std::vector<gate_t> inputs;
+  std::vector<gate_t> mulinputs;
   std::vector<double> prob;
-  std::map<gate_t, unsigned> info;
+  std::vector<unsigned> info; // index of MULIN gates among those of their variable
 
  public:
+  static constexpr unsigned MAX_DNF_CLAUSES = 100000;
+
   gate_t addGate() override;
   gate_t setGate(BooleanGate t) override;
   gate_t setGate(const uuid &u, BooleanGate t) override;
@@ -37,12 +58,14 @@ class BooleanCircuit : public Circuit<BooleanGate> {
   gate_t setGate(const uuid &u, BooleanGate t, double p);
   void setProb(gate_t g, double p) { prob[static_cast<std::underlying_type<gate_t>::type>(g)]=p; }
   double getProb(gate_t g) const { return prob[static_cast<std::underlying_type<gate_t>::type>(g)]; }
-  void setInfo(gate_t g, unsigned info);
-  unsigned getInfo(gate_t g) const;
+  void setInfo(gate_t g, unsigned i) { info[static_cast<std::underlying_type<gate_t>::type>(g)]=i; }
+  unsigned getInfo(gate_t g) const { return info[static_cast<std::underlying_type<gate_t>::type>(g)]; }
 
-  double possibleWorlds(gate_t g) const;
+  double possibleWorlds(gate_t g, unsigned nb_threads = 1) const;
   double compilation(gate_t g, std::string compiler) const;
-  double monteCarlo(gate_t g, unsigned samples) const;
+  double monteCarlo(gate_t g, unsigned samples, uint64_t seed, unsigned nb_threads = 1) const;
+  MonteCarloEstimate adaptiveMonteCarlo(gate_t g, double epsilon, double delta, uint64_t seed, unsigned nb_threads = 1) const;
+  double karpLubyMadras(gate_t g, double epsilon, double delta, uint64_t seed) const;
   double WeightMC(gate_t g, std::string opt) const;
   double independentEvaluation(gate_t g) const;
   void rewriteMultivaluedGates();
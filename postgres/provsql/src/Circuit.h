@@ -6,9 +6,23 @@
 #include <iostream>
 #include <set>
 #include <vector>
+#include <cstdint>
 #include <type_traits>
   
-enum class gate_t : size_t {};
+enum class gate_t : uint32_t {};
+
+/* The wires of a gate, contiguous in memory */
+class wire_range {
+  const gate_t *first, *last;
+
+ public:
+  wire_range(const gate_t *f, const gate_t *l) : first{f}, last{l} {}
+  const gate_t *begin() const { return first; }
+  const gate_t *end() const { return last; }
+  size_t size() const { return last - first; }
+  bool empty() const { return first == last; }
+  gate_t operator[](size_t i) const { return first[i]; }
+};
 
 template<class gateType>
 class Circuit {
@@ -19,25 +33,34 @@ class Circuit {
   std::unordered_map<uuid, gate_t> uuid2id;
 
   std::vector<gateType> gates;
+
+  // The wires of each gate are kept in their own vector while the
+  // circuit is built; finalize() moves them into compressed sparse row
+  // arrays, the wires of gate g being csr_wires[csr_offsets[g]] to
+  // csr_wires[csr_offsets[g+1]-1]. csr_offsets is empty as long as the
+  // circuit is not finalized, and modifying a finalized circuit brings
+  // back the per-gate vectors.
   std::vector<std::vector<gate_t>> wires;
+  std::vector<gate_t> csr_wires;
+  std::vector<uint32_t> csr_offsets;
 
  protected:
   virtual gate_t addGate();
+  void setWires(gate_t g, const std::vector<gate_t> &w);
+  void unfinalize();
     
  public:
   std::vector<gate_t>::size_type getNbGates() const { return gates.size(); }
   gate_t getGate(const uuid &u);
   gateType getGateType(gate_t g) const
     { return gates[static_cast<std::underlying_type<gate_t>::type>(g)]; }
-  std::vector<gate_t> &getWires(gate_t g)
-    { return wires[static_cast<std::underlying_type<gate_t>::type>(g)]; }
-  const std::vector<gate_t> &getWires(gate_t g) const
-    { return wires[static_cast<std::underlying_type<gate_t>::type>(g)]; }
+  wire_range getWires(gate_t g) const;
 
   virtual gate_t setGate(const uuid &u, gateType t);
   virtual gate_t setGate(gateType t);
   bool hasGate(const uuid &u) const;
   void addWire(gate_t f, gate_t t);
+  void finalize();
 
   virtual std::string toString(gate_t g) const = 0;
 };
@@ -21,7 +21,9 @@ gate_t Circuit<gateType>::getGate(const uuid &u)
 template<class gateType>
 gate_t Circuit<gateType>::addGate()
 {
-  gate_t id{gates.size()};
+  unfinalize();
+
+  gate_t id{static_cast<std::underlying_type<gate_t>::type>(gates.size())};
   gates.push_back(gateType());
   wires.push_back({});
   return id;
@@ -46,5 +48,59 @@ gate_t Circuit<gateType>::setGate(const uuid &u, gateType type)
 template<class gateType>
 void Circuit<gateType>::addWire(gate_t f, gate_t t)
 {
-  getWires(f).push_back(t);
+  unfinalize();
+  wires[static_cast<std::underlying_type<gate_t>::type>(f)].push_back(t);
+}
+
+template<class gateType>
+void Circuit<gateType>::setWires(gate_t g, const std::vector<gate_t> &w)
+{
+  unfinalize();
+  wires[static_cast<std::underlying_type<gate_t>::type>(g)] = w;
+}
+
+template<class gateType>
+wire_range Circuit<gateType>::getWires(gate_t g) const
+{
+  auto i = static_cast<std::underlying_type<gate_t>::type>(g);
+
+  if(csr_offsets.empty())
+    return wire_range(wires[i].data(), wires[i].data() + wires[i].size());
+  else
+    return wire_range(csr_wires.data() + csr_offsets[i], csr_wires.data() + csr_offsets[i+1]);
+}
+
+template<class gateType>
+void Circuit<gateType>::finalize()
+{
+  if(!csr_offsets.empty())
+    return;
+
+  size_t nb_wires = 0;
+  for(const auto &w: wires)
+    nb_wires += w.size();
+
+  csr_offsets.reserve(gates.size() + 1);
+  csr_wires.reserve(nb_wires);
+  for(const auto &w: wires) {
+    csr_offsets.push_back(csr_wires.size());
+    csr_wires.insert(csr_wires.end(), w.begin(), w.end());
+  }
+  csr_offsets.push_back(csr_wires.size());
+
+  std::vector<std::vector<gate_t>>().swap(wires);
+}
+
+template<class gateType>
+void Circuit<gateType>::unfinalize()
+{
+  if(csr_offsets.empty())
+    return;
+
+  wires.resize(gates.size());
+  for(size_t i=0; i<gates.size(); ++i)
+    wires[i].assign(csr_wires.begin() + csr_offsets[i], csr_wires.begin() + csr_offsets[i+1]);
+
+  std::vector<gate_t>().swap(csr_wires);
+  std::vector<uint32_t>().swap(csr_offsets);
 }
@@ -88,10 +88,10 @@ std::string DotCircuit::toString(gate_t) const
   }
 
   //looping through the gates and their wires
-  for(size_t i=0;i<wires.size();++i){
-    if(gates[i] != DotGate::OMINUSR && gates[i] != DotGate::OMINUSL){
+  for(gate_t i{0};i<gates.size();++i){
+    if(getGateType(i) != DotGate::OMINUSR && getGateType(i) != DotGate::OMINUSL){
       std::unordered_map<gate_t, unsigned> number_gates;
-      for(auto s: wires[i]){
+      for(auto s: getWires(i)){
         if(number_gates.find(s)!=number_gates.end()){
           number_gates[s] = number_gates[s]+1;
         }
@@ -104,7 +104,7 @@ std::string DotCircuit::toString(gate_t) const
       {
         if(getGateType(s) == DotGate::OMINUSR || getGateType(s) == DotGate::OMINUSL) {
           for(auto t: getWires(s)) {
-            result += std::to_string(i)+" -> "+to_string(t);
+            result += to_string(i)+" -> "+to_string(t);
             if(getGateType(s) == DotGate::OMINUSR)
               result += " [label=\"R\"];\n";
             else
@@ -112,7 +112,7 @@ std::string DotCircuit::toString(gate_t) const
           }
         }
         else {
-          result += std::to_string(i)+" -> "+to_string(s);
+          result += to_string(i)+" -> "+to_string(s);
           if(n==1) {
             result += ";\n";
           }
@@ -295,11 +295,11 @@ TreeDecomposition::TreeDecomposition(const BooleanCircuit &bc)
 
     Bag bag;
     for(auto n: neigh) {
-      bag.insert(gate_t{n});
+      bag.insert(static_cast<gate_t>(n));
     }
-    bag.insert(gate_t{node});
+    bag.insert(static_cast<gate_t>(node));
       
-    bag_ids[gate_t{node}] = bag_id++;
+    bag_ids[static_cast<gate_t>(node)] = bag_id++;
 
     bags.push_back(bag);
   }
@@ -310,7 +310,7 @@ TreeDecomposition::TreeDecomposition(const BooleanCircuit &bc)
   if(graph.number_nodes()>0) {
     Bag remaining_bag; 
     for(auto n: graph.get_nodes()) {
-      remaining_bag.insert(gate_t{n});
+      remaining_bag.insert(static_cast<gate_t>(n));
     }
     bags.push_back(remaining_bag);
   }
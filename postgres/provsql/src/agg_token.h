@@ -1,6 +1,8 @@
 #ifndef AGG_TOKEN_H
 #define AGG_TOKEN_H
 
+#include "fmgr.h"
+
 #include "provsql_utils.h"
 
 typedef struct agg_token{
@@ -8,4 +10,6 @@ typedef struct agg_token{
   unsigned char val[80];
 } agg_token;
 
+Datum agg_token_in(PG_FUNCTION_ARGS);
+
 #endif /* AGG_TOKEN_H */
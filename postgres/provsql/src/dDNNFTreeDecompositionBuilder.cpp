@@ -42,6 +42,8 @@ dDNNF&& dDNNFTreeDecompositionBuilder::build() && {
     }
   }
 
+  d.finalize();
+
   return std::move(d);
 }
 
@@ -61,11 +61,10 @@ class dDNNFTreeDecompositionBuilder
 public:
   dDNNFTreeDecompositionBuilder(
       const BooleanCircuit &circuit,
-      const BooleanCircuit::uuid &root,
-      TreeDecomposition &tree_decomposition) : c{circuit}, td{tree_decomposition}  
+      gate_t root,
+      TreeDecomposition &tree_decomposition) : c{circuit}, root_id{root}, td{tree_decomposition}  
   {
-    assert(c.hasGate(root));
-    root_id = const_cast<BooleanCircuit &>(c).getGate(root);
+    assert(root < c.getNbGates());
 
     for(gate_t i{0}; i<c.getNbGates(); ++i)
       for(auto g: c.getWires(i))
@@ -0,0 +1,254 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "catalog/pg_type.h"
+#include "commands/trigger.h"
+#include "executor/spi.h"
+#include "executor/tuptable.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/tuplestore.h"
+#include "utils/uuid.h"
+
+#include "provsql_shmem.h"
+#include "token8.h"
+
+/* Bulk creation of the input and mulinput gates of provenance tables:
+ * tokens are collected in batches of PROVSQL_INPUT_BATCH_SIZE, and each
+ * batch is created by provsql_create_gates, taking each partition lock
+ * once, instead of one create_gate call per row */
+#define PROVSQL_INPUT_BATCH_SIZE 10000
+
+PG_FUNCTION_INFO_V1(create_input_gates);
+PG_FUNCTION_INFO_V1(create_mulinput_gates);
+PG_FUNCTION_INFO_V1(add_gates_trigger);
+
+/* A batch of gates of the same type; mulinput gates have a key as
+ * child, a probability, and their index among the gates of the key as
+ * info1 */
+typedef struct input_batch
+{
+  gate_type type;
+  int nb;
+  pg_uuid_t tokens[PROVSQL_INPUT_BATCH_SIZE];
+  Datum datums[PROVSQL_INPUT_BATCH_SIZE];
+  int gtypes[PROVSQL_INPUT_BATCH_SIZE];
+  pg_uuid_t keys[PROVSQL_INPUT_BATCH_SIZE];
+  Datum key_datums[PROVSQL_INPUT_BATCH_SIZE];
+  bool key_nulls[PROVSQL_INPUT_BATCH_SIZE];
+  double probs[PROVSQL_INPUT_BATCH_SIZE];
+  unsigned infos[PROVSQL_INPUT_BATCH_SIZE];
+} input_batch;
+
+static input_batch *input_batch_new(gate_type type)
+{
+  input_batch *batch = palloc(sizeof(input_batch));
+
+  batch->type = type;
+  batch->nb = 0;
+  for(int i=0; i<PROVSQL_INPUT_BATCH_SIZE; ++i) {
+    batch->datums[i] = UUIDPGetDatum(&batch->tokens[i]);
+    batch->gtypes[i] = type;
+    batch->key_datums[i] = UUIDPGetDatum(&batch->keys[i]);
+    batch->key_nulls[i] = false;
+  }
+
+  return batch;
+}
+
+static void input_batch_flush(input_batch *batch)
+{
+  if(batch->nb == 0)
+    return;
+
+  if(batch->type == gate_mulinput)
+    provsql_create_gates(batch->nb, batch->datums, batch->gtypes, batch->key_datums, batch->key_nulls, 1,
+                         batch->probs, batch->infos);
+  else
+    provsql_create_gates(batch->nb, batch->datums, batch->gtypes, NULL, NULL, 0, NULL, NULL);
+
+  batch->nb = 0;
+}
+
+/* NULL tokens have no gate, and are skipped */
+static void input_batch_add(input_batch *batch, Datum token, bool isnull)
+{
+  if(isnull)
+    return;
+
+  batch->tokens[batch->nb++] = *DatumGetUUIDP(token);
+  if(batch->nb == PROVSQL_INPUT_BATCH_SIZE)
+    input_batch_flush(batch);
+}
+
+/* Creates the input gates of all tokens of the provsql column of a
+ * table, see add_provenance; compact tokens are read as their UUID */
+Datum create_input_gates(PG_FUNCTION_ARGS)
+{
+  Oid table = PG_GETARG_OID(0);
+  char *query = psprintf("SELECT provsql::uuid FROM %s",
+                         DatumGetCString(DirectFunctionCall1(regclassout, ObjectIdGetDatum(table))));
+  input_batch *batch = input_batch_new(gate_input);
+  Portal portal;
+
+  SPI_connect();
+
+  portal = SPI_cursor_open_with_args(NULL, query, 0, NULL, NULL, NULL, true, 0);
+
+  for(;;) {
+    SPI_cursor_fetch(portal, true, PROVSQL_INPUT_BATCH_SIZE);
+    if(SPI_processed == 0)
+      break;
+
+    if(SPI_tuptable->tupdesc->natts != 1 || SPI_gettypeid(SPI_tuptable->tupdesc, 1) != UUIDOID)
+      elog(ERROR, "Invalid provsql column in table %s", get_rel_name(table));
+
+    for(uint64 i=0; i<SPI_processed; ++i) {
+      bool isnull;
+      Datum token = SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1, &isnull);
+
+      input_batch_add(batch, token, isnull);
+    }
+
+    SPI_freetuptable(SPI_tuptable);
+  }
+
+  SPI_cursor_close(portal);
+
+  SPI_finish();
+
+  input_batch_flush(batch);
+  pfree(batch);
+
+  PG_RETURN_VOID();
+}
+
+/* Random (version 4) UUID */
+static void random_token(pg_uuid_t *token)
+{
+  if(!pg_strong_random(token->data, UUID_LEN))
+    elog(ERROR, "Cannot generate random token");
+
+  token->data[6] = (token->data[6] & 0x0f) | 0x40;
+  token->data[8] = (token->data[8] & 0x3f) | 0x80;
+}
+
+/* Creates the mulinput gates of repair_key: the tokens of column
+ * token_att of the rows of a table with the same value of the key
+ * key_att (all rows if key_att is empty) become mutually exclusive,
+ * each with probability 1/n for a key with n rows. Groups of rows are
+ * numbered by a window over the key, in a single sorted pass over the
+ * table. */
+Datum create_mulinput_gates(PG_FUNCTION_ARGS)
+{
+  Oid table = PG_GETARG_OID(0);
+  char *token_att = text_to_cstring(PG_GETARG_TEXT_PP(1));
+  char *key_att = text_to_cstring(PG_GETARG_TEXT_PP(2));
+  char *query = psprintf("SELECT %s, COUNT(*) OVER w, row_number() OVER w FROM %s WINDOW w AS (%s%s)",
+                         quote_identifier(token_att),
+                         DatumGetCString(DirectFunctionCall1(regclassout, ObjectIdGetDatum(table))),
+                         key_att[0] ? "PARTITION BY " : "", key_att);
+  input_batch *batch = input_batch_new(gate_mulinput);
+  pg_uuid_t key = {{0}};
+  Portal portal;
+
+  SPI_connect();
+
+  portal = SPI_cursor_open_with_args(NULL, query, 0, NULL, NULL, NULL, true, 0);
+
+  for(;;) {
+    SPI_cursor_fetch(portal, true, PROVSQL_INPUT_BATCH_SIZE);
+    if(SPI_processed == 0)
+      break;
+
+    if(SPI_gettypeid(SPI_tuptable->tupdesc, 1) != UUIDOID)
+      elog(ERROR, "Invalid column %s in table %s", token_att, get_rel_name(table));
+
+    for(uint64 i=0; i<SPI_processed; ++i) {
+      HeapTuple tuple = SPI_tuptable->vals[i];
+      TupleDesc tupdesc = SPI_tuptable->tupdesc;
+      bool token_isnull, isnull;
+      Datum token = SPI_getbinval(tuple, tupdesc, 1, &token_isnull);
+      int64 nb_rows = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+      int64 index = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 3, &isnull));
+
+      // Rows of the same key are consecutive, a new key token is drawn
+      // for the first one
+      if(index == 1)
+        random_token(&key);
+
+      if(token_isnull)
+        continue;
+
+      batch->tokens[batch->nb] = *DatumGetUUIDP(token);
+      batch->keys[batch->nb] = key;
+      batch->probs[batch->nb] = 1. / nb_rows;
+      batch->infos[batch->nb] = index;
+      if(++batch->nb == PROVSQL_INPUT_BATCH_SIZE)
+        input_batch_flush(batch);
+    }
+
+    SPI_freetuptable(SPI_tuptable);
+  }
+
+  SPI_cursor_close(portal);
+
+  SPI_finish();
+
+  input_batch_flush(batch);
+  pfree(batch);
+
+  PG_RETURN_VOID();
+}
+
+/* Statement-level AFTER INSERT trigger of provenance tables, creating
+ * the input gates of the rows inserted by the statement, read from its
+ * transition table */
+Datum add_gates_trigger(PG_FUNCTION_ARGS)
+{
+  TriggerData *trigdata = (TriggerData *) fcinfo->context;
+  TupleDesc tupdesc;
+  TupleTableSlot *slot;
+  input_batch *batch;
+  int attnum;
+  Oid type;
+  bool compact;
+
+  if(!CALLED_AS_TRIGGER(fcinfo) || !TRIGGER_FIRED_FOR_STATEMENT(trigdata->tg_event) ||
+     !TRIGGER_FIRED_BY_INSERT(trigdata->tg_event) || trigdata->tg_newtable == NULL)
+    elog(ERROR, "add_gates_trigger must be an AFTER INSERT statement trigger with a transition table");
+
+  tupdesc = RelationGetDescr(trigdata->tg_relation);
+  attnum = SPI_fnumber(tupdesc, "provsql");
+  type = attnum > 0 ? SPI_gettypeid(tupdesc, attnum) : InvalidOid;
+  compact = type != InvalidOid && type == initialize_constants(true).OID_TYPE_TOKEN8;
+  if(type != UUIDOID && !compact)
+    elog(ERROR, "Invalid provsql column in table %s", RelationGetRelationName(trigdata->tg_relation));
+
+#if PG_VERSION_NUM >= 120000
+  slot = MakeSingleTupleTableSlot(tupdesc, &TTSOpsMinimalTuple);
+#else
+  slot = MakeSingleTupleTableSlot(tupdesc);
+#endif
+  batch = input_batch_new(gate_input);
+
+  tuplestore_rescan(trigdata->tg_newtable);
+  while(tuplestore_gettupleslot(trigdata->tg_newtable, true, false, slot)) {
+    bool isnull;
+    Datum token = slot_getattr(slot, attnum, &isnull);
+
+    if(compact && !isnull) {
+      pg_uuid_t uuid;
+
+      token8_to_uuid(DatumGetInt64(token), &uuid);
+      input_batch_add(batch, UUIDPGetDatum(&uuid), false);
+    } else
+      input_batch_add(batch, token, isnull);
+  }
+
+  input_batch_flush(batch);
+  pfree(batch);
+  ExecDropSingleTupleTableSlot(slot);
+
+  return PointerGetDatum(NULL);
+}
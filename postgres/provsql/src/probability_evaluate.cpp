@@ -7,15 +7,21 @@ extern "C" {
 #include "provsql_shmem.h"
 #include "provsql_utils.h"
   
+#include "funcapi.h"
+#include "access/htup_details.h"
+  
   PG_FUNCTION_INFO_V1(probability_evaluate);
+  PG_FUNCTION_INFO_V1(probability_interval);
 }
 
-#include <set>
+#include <unordered_map>
+#include <vector>
+#include <cassert>
 #include <cmath>
+#include <sstream>
 #include <csignal>
 
 #include "BooleanCircuit.h"
-#include "provsql_utils_cpp.h"
 #include "dDNNFTreeDecompositionBuilder.h"
 
 using namespace std;
@@ -25,53 +31,85 @@ static void provsql_sigint_handler (int)
   provsql_interrupted = true;
 }
 
-bool operator<(const pg_uuid_t a, const pg_uuid_t b)
+/* Builds in c the Boolean circuit of a token, returns its root */
+static gate_t extract_circuit(pg_uuid_t token, BooleanCircuit &c)
 {
-  return memcmp(&a, &b, sizeof(pg_uuid_t))<0;
-}
+  // Gates are followed by their slot, without any lock, see
+  // provsql_read_gate. The store is only held while the reachable gates
+  // are copied out, in the order they are discovered, with their
+  // children renumbered in that order; the circuit is built once the
+  // store is released.
+  std::vector<provsqlGate> gates;
+  std::vector<uint32> wires;
+  bool found;
+
+  provsql_store_acquire();
+
+  uint32 root;
+  found = provsql_find_gate(&token, &root);
+  if(found) {
+    std::vector<uint32> slots;
+    std::unordered_map<uint32, uint32> slot_ids;
+
+    auto get_id = [&](uint32 slot) {
+      auto p = slot_ids.emplace(slot, slots.size());
+      if(p.second)
+        slots.push_back(slot);
+      return p.first->second;
+    };
+
+    get_id(root);
+
+    for(size_t i=0; i<slots.size(); ++i) {
+      gates.emplace_back();
+      provsqlGate &g = gates.back();
+
+      if(provsql_read_gate(slots[i], &g) == PROVSQL_GATE_UNDEFINED)
+        continue;
+
+      const uint32 *children = provsql_children(&g);
+      for(unsigned j=0; j<g.nb_children; ++j)
+        wires.push_back(get_id(children[j]));
+    }
+  }
 
-static Datum probability_evaluate_internal
-  (pg_uuid_t token, const string &method, const string &args)
-{
-  std::set<pg_uuid_t> to_process, processed;
-  to_process.insert(token);
-  
-  BooleanCircuit c;
+  provsql_store_release();
+
+  gate_t gate;
 
-  LWLockAcquire(provsql_shared_state->lock, LW_SHARED);
-  while(!to_process.empty()) {
-    pg_uuid_t uuid = *to_process.begin();
-    to_process.erase(to_process.begin());
-    processed.insert(uuid);
-    std::string f{uuid2string(uuid)};
+  if(!found)
+    gate = c.setGate(BooleanGate::MULVAR);
+  else {
+    // Gates of c are created in the order of gates, so that the
+    // children of a gate are known before their gates are created.
+    // Negations of monus gates are only added after all these gates.
+    std::vector<std::pair<gate_t, gate_t>> monus;
+    size_t w = 0;
 
-    bool found;
-    provsqlHashEntry *entry = (provsqlHashEntry *) hash_search(provsql_hash, &uuid, HASH_FIND, &found);
+    gate = gate_t{0};
 
-    gate_t id;
+    for(uint32 i=0; i<gates.size(); ++i) {
+      const provsqlGate &g = gates[i];
+      gate_t id;
+
+      switch(g.type) {
+        case PROVSQL_GATE_UNDEFINED:
+          id = c.setGate(BooleanGate::MULVAR);
+          break;
 
-    if(!found)
-      id = c.setGate(f, BooleanGate::MULVAR);
-    else {
-      switch(entry->type) {
         case gate_input:
-          if(isnan(entry->prob)) { 
-            LWLockRelease(provsql_shared_state->lock);
+          if(isnan(g.prob)) {
             elog(ERROR, "Missing probability for input token");
           }
-          id = c.setGate(f, BooleanGate::IN, entry->prob);
+          id = c.setGate(BooleanGate::IN, g.prob);
           break;
 
         case gate_mulinput:
-          if(isnan(entry->prob)) {
-            LWLockRelease(provsql_shared_state->lock);
+          if(isnan(g.prob)) {
             elog(ERROR, "Missing probability for input token");
           }
-          id = c.setGate(f, BooleanGate::MULIN, entry->prob);
-          c.addWire(
-              id, 
-              c.getGate(uuid2string(provsql_shared_state->wires[entry->children_idx])));
-          c.setInfo(id, entry->info1);
+          id = c.setGate(BooleanGate::MULIN, g.prob);
+          c.setInfo(id, g.info1);
           break;
 
         case gate_times:
@@ -79,52 +117,90 @@ static Datum probability_evaluate_internal
         case gate_eq:
         case gate_monus:
         case gate_one:
-          id = c.setGate(f, BooleanGate::AND);
+          id = c.setGate(BooleanGate::AND);
           break;
 
         case gate_plus:
         case gate_zero:
-          id = c.setGate(f, BooleanGate::OR);
+          id = c.setGate(BooleanGate::OR);
           break;
 
         default:
             elog(ERROR, "Wrong type of gate in circuit");
-        } 
-
-      if(entry->nb_children > 0) {
-        if(entry->type == gate_monus) {
-          auto id_not = c.setGate(BooleanGate::NOT);
-          auto child1 = provsql_shared_state->wires[entry->children_idx];
-          auto child2 = provsql_shared_state->wires[entry->children_idx+1];
-          c.addWire(
-              id,
-              c.getGate(uuid2string(child1)));
-          c.addWire(id, id_not);
-          c.addWire(
-              id_not,
-              c.getGate(uuid2string(child2)));
-          if(processed.find(child1)==processed.end())
-            to_process.insert(child1);
-          if(processed.find(child2)==processed.end())
-            to_process.insert(child2);
-        } else {
-          for(unsigned i=0;i<entry->nb_children;++i) {
-            auto child = provsql_shared_state->wires[entry->children_idx+i];
-
-            c.addWire(
-                id, 
-                c.getGate(uuid2string(child)));
-            if(processed.find(child)==processed.end())
-              to_process.insert(child);
-          }
-        }
       }
+
+      assert(id == gate_t{i});
+
+      if(g.type == PROVSQL_GATE_UNDEFINED)
+        continue;
+
+      if(g.type == gate_mulinput)
+        c.addWire(id, gate_t{wires[w]});
+      else if(g.type == gate_monus) {
+        c.addWire(id, gate_t{wires[w]});
+        monus.emplace_back(id, gate_t{wires[w+1]});
+      } else {
+        for(unsigned j=0; j<g.nb_children; ++j)
+          c.addWire(id, gate_t{wires[w+j]});
+      }
+      w += g.nb_children;
+    }
+
+    for(const auto &p: monus) {
+      auto id_not = c.setGate(BooleanGate::NOT);
+      c.addWire(p.first, id_not);
+      c.addWire(id_not, p.second);
     }
   }
-  LWLockRelease(provsql_shared_state->lock);
+
+  c.finalize();
+
+  return gate;
+}
+
+/* Options of the evaluation methods, of the form 'seed=N' when seed is
+ * not null, or 'threads=N' when nb_threads is not null, separated by
+ * ';'; no more threads than hardware threads are started, see
+ * BooleanCircuit.cpp */
+static void parse_method_options(std::istream &ssargs, const char *method, uint64_t *seed, int *nb_threads)
+{
+  std::string option;
+
+  if(seed)
+    *seed = static_cast<uint64_t>(rand()) << 32 | rand();
+  if(nb_threads)
+    *nb_threads = 1;
+
+  while(getline(ssargs, option, ';')) {
+    bool valid = false;
+
+    try {
+      if(seed && option.rfind("seed=", 0) == 0) {
+        *seed = stoull(option.substr(5));
+        valid = true;
+      } else if(nb_threads && option.rfind("threads=", 0) == 0) {
+        *nb_threads = stoi(option.substr(8));
+        valid = *nb_threads > 0;
+      }
+    } catch(std::logic_error &) {
+    }
+
+    if(!valid)
+      elog(ERROR, "Invalid option '%s' for method %s", option.c_str(), method);
+  }
+}
+
+static Datum probability_evaluate_internal
+  (pg_uuid_t token, const string &method, const string &args)
+{
+  BooleanCircuit c;
+  instr_time start;
+
+  INSTR_TIME_SET_CURRENT(start);
+
+  gate_t gate = extract_circuit(token, c);
 
   double result;
-  auto gate = c.getGate(uuid2string(token));
 
   // Display the circuit for debugging:
   // elog(WARNING, "%s", c.toString(gate).c_str());
@@ -153,24 +229,59 @@ static Datum probability_evaluate_internal
       // Other methods do not deal with multivalued input gates, they
       // need to be rewritten
       c.rewriteMultivaluedGates();
+      c.finalize();
 
       if(method=="monte-carlo") {
+        // args of the form 'samples[;seed=N][;threads=N]'
+        std::stringstream ssargs(args);
+        std::string samples_s;
         int samples=0;
+        int nb_threads;
+        uint64_t seed;
 
+        getline(ssargs, samples_s, ';');
         try {
-          samples = stoi(args);
+          samples = stoi(samples_s);
         } catch(std::invalid_argument &e) {
         }
 
         if(samples<=0)
-          elog(ERROR, "Invalid number of samples: '%s'", args.c_str());
-        
-        result = c.monteCarlo(gate, samples);
+          elog(ERROR, "Invalid number of samples: '%s'", samples_s.c_str());
+
+        parse_method_options(ssargs, "monte-carlo", &seed, &nb_threads);
+
+        result = c.monteCarlo(gate, samples, seed, nb_threads);
+      } else if(method=="fpras") {
+        // args of the form 'epsilon;delta[;seed=N]'
+        std::stringstream ssargs(args);
+        std::string epsilon_s, delta_s;
+        double epsilon=0., delta=0.;
+        uint64_t seed;
+
+        getline(ssargs, epsilon_s, ';');
+        getline(ssargs, delta_s, ';');
+        try {
+          epsilon = stod(epsilon_s);
+          delta = stod(delta_s);
+        } catch(std::logic_error &e) {
+        }
+
+        if(!(epsilon > 0. && epsilon < 1.))
+          elog(ERROR, "Invalid epsilon: '%s'", epsilon_s.c_str());
+        if(!(delta > 0. && delta < 1.))
+          elog(ERROR, "Invalid delta: '%s'", delta_s.c_str());
+
+        parse_method_options(ssargs, "fpras", &seed, nullptr);
+
+        result = c.karpLubyMadras(gate, epsilon, delta, seed);
       } else if(method=="possible-worlds") {
-        if(!args.empty())
-          elog(WARNING, "Argument '%s' ignored for method possible-worlds", args.c_str());
+        // args of the form '[threads=N]'
+        std::stringstream ssargs(args);
+        int nb_threads;
 
-        result = c.possibleWorlds(gate);
+        parse_method_options(ssargs, "possible-worlds", nullptr, &nb_threads);
+
+        result = c.possibleWorlds(gate, nb_threads);
       } else if(method=="compilation") {
         result = c.compilation(gate, args);
       } else if(method=="weightmc") {
@@ -181,7 +292,7 @@ static Datum probability_evaluate_internal
           auto dnnf{
             dDNNFTreeDecompositionBuilder{
               c,
-              uuid2string(token),
+              gate,
               td}.build()
           };
           result = dnnf.dDNNFEvaluation(dnnf.getGate("root"));
@@ -194,7 +305,7 @@ static Datum probability_evaluate_internal
           auto dnnf{
             dDNNFTreeDecompositionBuilder{
               c,
-              uuid2string(token),
+              gate,
               td}.build()
           };
           result = dnnf.dDNNFEvaluation(dnnf.getGate("root"));
@@ -218,6 +329,13 @@ static Datum probability_evaluate_internal
   else if(result<0.)
     result=0.;
 
+  // Only reached for valid methods
+  for(int i=0; i<nb_probability_methods; ++i)
+    if(method==(i==probability_method_default?"":probability_method_names[i])) {
+      provsql_count_evaluation(static_cast<probability_method>(i), start);
+      break;
+    }
+
   PG_RETURN_FLOAT8(result);
 }
 
@@ -250,3 +368,78 @@ Datum probability_evaluate(PG_FUNCTION_ARGS)
 
   PG_RETURN_NULL();
 }
+
+/* Adaptive Monte-Carlo estimation: samples until the probability is
+ * known within epsilon with probability at least 1-delta, and returns
+ * the estimate with its interval and the number of samples used */
+Datum probability_interval(PG_FUNCTION_ARGS)
+{
+  try {
+    if(PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2))
+      PG_RETURN_NULL();
+
+    pg_uuid_t token = *DatumGetUUIDP(PG_GETARG_DATUM(0));
+    double epsilon = PG_GETARG_FLOAT8(1);
+    double delta = PG_GETARG_FLOAT8(2);
+    std::stringstream ssargs;
+    int nb_threads;
+    uint64_t seed;
+
+    if(!(epsilon > 0. && epsilon < 1.))
+      elog(ERROR, "Invalid epsilon: %g", epsilon);
+    if(!(delta > 0. && delta < 1.))
+      elog(ERROR, "Invalid delta: %g", delta);
+
+    if(!PG_ARGISNULL(3)) {
+      text *t = PG_GETARG_TEXT_P(3);
+      ssargs.str(string(VARDATA(t),VARSIZE(t)-VARHDRSZ));
+    }
+    parse_method_options(ssargs, "monte-carlo", &seed, &nb_threads);
+
+    BooleanCircuit c;
+    instr_time start;
+
+    INSTR_TIME_SET_CURRENT(start);
+
+    gate_t gate = extract_circuit(token, c);
+    MonteCarloEstimate estimate{};
+
+    provsql_interrupted = false;
+
+    void (*prev_sigint_handler)(int);
+    prev_sigint_handler = signal(SIGINT, provsql_sigint_handler);
+
+    try {
+      c.rewriteMultivaluedGates();
+      c.finalize();
+      estimate = c.adaptiveMonteCarlo(gate, epsilon, delta, seed, nb_threads);
+    } catch(CircuitException &e) {
+      elog(ERROR, "%s", e.what());
+    }
+
+    provsql_interrupted = false;
+    signal (SIGINT, prev_sigint_handler);
+
+    provsql_count_evaluation(probability_method_monte_carlo, start);
+
+    TupleDesc tupdesc;
+    Datum values[4];
+    bool nulls[4] = {false, false, false, false};
+
+    get_call_result_type(fcinfo,NULL,&tupdesc);
+    tupdesc = BlessTupleDesc(tupdesc);
+
+    values[0] = Float8GetDatum(estimate.probability);
+    values[1] = Float8GetDatum(estimate.low);
+    values[2] = Float8GetDatum(estimate.high);
+    values[3] = Int64GetDatum(estimate.samples);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+  } catch(const std::exception &e) {
+    elog(ERROR, "probability_interval: %s", e.what());
+  } catch(...) {
+    elog(ERROR, "probability_interval: Unknown exception");
+  }
+
+  PG_RETURN_NULL();
+}
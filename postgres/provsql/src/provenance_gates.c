@@ -0,0 +1,528 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "catalog/pg_type.h"
+#include "parser/parse_coerce.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/uuid.h"
+
+#include "provsql_shmem.h"
+#include "agg_token.h"
+#include "uuid_v5.h"
+
+/* Constructors of the gates of the circuits built by the rewriting of
+ * queries, called once per tuple of the results. The token of a gate is
+ * a UUIDv5 derived from its type and children, with the exact same
+ * names as in the former PL/pgSQL versions of these functions (e.g.,
+ * concat('plus', array_to_string(children, ','))), so that existing
+ * circuits are still shared by new queries. */
+
+PG_FUNCTION_INFO_V1(provenance_times);
+PG_FUNCTION_INFO_V1(provenance_monus);
+PG_FUNCTION_INFO_V1(provenance_project);
+PG_FUNCTION_INFO_V1(provenance_eq);
+PG_FUNCTION_INFO_V1(provenance_plus);
+PG_FUNCTION_INFO_V1(provenance_delta);
+PG_FUNCTION_INFO_V1(provenance_aggregate);
+PG_FUNCTION_INFO_V1(provenance_semimod);
+PG_FUNCTION_INFO_V1(provenance_plus_agg_transfn);
+PG_FUNCTION_INFO_V1(provenance_plus_agg_combinefn);
+PG_FUNCTION_INFO_V1(provenance_plus_agg_serialfn);
+PG_FUNCTION_INFO_V1(provenance_plus_agg_deserialfn);
+PG_FUNCTION_INFO_V1(provenance_plus_agg_finalfn);
+
+/* Elements of an array of tokens, NULL elements being skipped, as well
+ * as elements equal to skip if not NULL; returns the number of
+ * elements of the array, NULL ones included */
+static int get_tokens(ArrayType *array, const pg_uuid_t *skip, pg_uuid_t **tokens, int *nb_tokens)
+{
+  Datum *elems;
+  bool *nulls;
+  int nb;
+
+  deconstruct_array(array, UUIDOID, UUID_LEN, false, 'c', &elems, &nulls, &nb);
+
+  *tokens = palloc(Max(nb, 1) * sizeof(pg_uuid_t));
+  *nb_tokens = 0;
+  for(int i=0; i<nb; ++i) {
+    pg_uuid_t *token = DatumGetUUIDP(elems[i]);
+
+    if(!nulls[i] && (skip == NULL || memcmp(token, skip, sizeof(pg_uuid_t))))
+      (*tokens)[(*nb_tokens)++] = *token;
+  }
+
+  pfree(elems);
+  pfree(nulls);
+
+  return nb;
+}
+
+/* Datum of a copy of a token, for tokens that are not allocated in
+ * the current memory context */
+static Datum copy_token(const pg_uuid_t *token)
+{
+  pg_uuid_t *result = palloc(sizeof(pg_uuid_t));
+
+  *result = *token;
+  return UUIDPGetDatum(result);
+}
+
+static int uuid_compare(const void *a, const void *b)
+{
+  return memcmp(a, b, sizeof(pg_uuid_t));
+}
+
+/* Text of CAST(val AS VARCHAR), for a value of type type */
+static char *cast_to_varchar(Datum val, Oid type)
+{
+  Oid funcid;
+
+  switch(find_coerce_pathway(VARCHAROID, type, COERCION_EXPLICIT, &funcid)) {
+    case COERCION_PATH_RELABELTYPE:
+      return TextDatumGetCString(val);
+    case COERCION_PATH_FUNC:
+      if(get_func_nargs(funcid) > 1)
+        return TextDatumGetCString(OidFunctionCall3(funcid, val, Int32GetDatum(-1), BoolGetDatum(true)));
+      else
+        return TextDatumGetCString(OidFunctionCall1(funcid, val));
+    case COERCION_PATH_COERCEVIAIO:
+    {
+      Oid output_function;
+      bool isvarlena;
+
+      getTypeOutputInfo(type, &output_function, &isvarlena);
+      return OidOutputFunctionCall(output_function, val);
+    }
+    default:
+      elog(ERROR, "Cannot cast a value of type %s to varchar", format_type_be(type));
+  }
+
+  return NULL;
+}
+
+Datum provenance_times(PG_FUNCTION_ARGS)
+{
+  pg_uuid_t *tokens, *result;
+  int nb_tokens = 0;
+  uuid_v5_state state;
+
+  if(!PG_ARGISNULL(0))
+    get_tokens(PG_GETARG_ARRAYTYPE_P(0), &uuid_gate_one, &tokens, &nb_tokens);
+
+  if(nb_tokens == 1)
+    PG_RETURN_UUID_P(&tokens[0]);
+
+  result = palloc(sizeof(pg_uuid_t));
+
+  // The name is that of the gate of the product of the tokens, where
+  // the product of a and b is the UUIDv5 of concat(a, b); an empty
+  // product is a times gate without children
+  if(nb_tokens > 0) {
+    *result = tokens[0];
+    for(int i=1; i<nb_tokens; ++i) {
+      uuid_v5_init(&state);
+      uuid_v5_update_uuid(&state, result);
+      uuid_v5_update_uuid(&state, &tokens[i]);
+      uuid_v5_final(&state, result);
+    }
+  }
+
+  uuid_v5_init(&state);
+  uuid_v5_update(&state, "times", 5);
+  if(nb_tokens > 0)
+    uuid_v5_update_uuid(&state, result);
+  uuid_v5_final(&state, result);
+
+  provsql_create_gate(result, gate_times, nb_tokens, tokens);
+
+  PG_RETURN_UUID_P(result);
+}
+
+Datum provenance_monus(PG_FUNCTION_ARGS)
+{
+  pg_uuid_t *token1, *token2, *result;
+  pg_uuid_t children[2];
+  uuid_v5_state state;
+
+  // Special semantics, because of a LEFT OUTER JOIN used by the
+  // difference operator: token2 NULL means there is no second argument
+  if(PG_ARGISNULL(1)) {
+    if(PG_ARGISNULL(0))
+      PG_RETURN_NULL();
+    PG_RETURN_UUID_P(PG_GETARG_UUID_P(0));
+  }
+
+  if(PG_ARGISNULL(0))
+    PG_RETURN_NULL();
+
+  token1 = PG_GETARG_UUID_P(0);
+  token2 = PG_GETARG_UUID_P(1);
+
+  // X-X=0, 0-X=0
+  if(!memcmp(token1, token2, sizeof(pg_uuid_t)) || !memcmp(token1, &uuid_gate_zero, sizeof(pg_uuid_t)))
+    PG_RETURN_DATUM(copy_token(&uuid_gate_zero));
+
+  // X-0=X
+  if(!memcmp(token2, &uuid_gate_zero, sizeof(pg_uuid_t)))
+    PG_RETURN_UUID_P(token1);
+
+  result = palloc(sizeof(pg_uuid_t));
+  uuid_v5_init(&state);
+  uuid_v5_update(&state, "monus", 5);
+  uuid_v5_update_uuid(&state, token1);
+  uuid_v5_update_uuid(&state, token2);
+  uuid_v5_final(&state, result);
+
+  children[0] = *token1;
+  children[1] = *token2;
+  provsql_create_gate(result, gate_monus, 2, children);
+
+  PG_RETURN_UUID_P(result);
+}
+
+Datum provenance_project(PG_FUNCTION_ARGS)
+{
+  pg_uuid_t *token = PG_GETARG_UUID_P(0);
+  ArrayType *positions = PG_GETARG_ARRAYTYPE_P(1);
+  pg_uuid_t *result = palloc(sizeof(pg_uuid_t));
+  Datum *elems;
+  bool *nulls;
+  int32 *infos;
+  int nb;
+  uuid_v5_state state;
+
+  deconstruct_array(positions, INT4OID, sizeof(int32), true, 'i', &elems, &nulls, &nb);
+
+  // Name is concat(token, positions)
+  uuid_v5_init(&state);
+  uuid_v5_update_uuid(&state, token);
+  uuid_v5_update(&state, "{", 1);
+  for(int i=0; i<nb; ++i) {
+    if(i > 0)
+      uuid_v5_update(&state, ",", 1);
+    if(nulls[i])
+      uuid_v5_update(&state, "NULL", 4);
+    else
+      uuid_v5_update_int(&state, DatumGetInt32(elems[i]));
+  }
+  uuid_v5_update(&state, "}", 1);
+  uuid_v5_final(&state, result);
+
+  // Positions are stored with the gate, 0 (or NULL) for columns that
+  // are not projected
+  infos = palloc(Max(nb, 1) * sizeof(int32));
+  for(int i=0; i<nb; ++i)
+    infos[i] = nulls[i] ? 0 : DatumGetInt32(elems[i]);
+
+  provsql_create_gate_extra(result, gate_project, 1, token, 0, 0, infos, nb * sizeof(int32));
+
+  PG_RETURN_UUID_P(result);
+}
+
+Datum provenance_eq(PG_FUNCTION_ARGS)
+{
+  pg_uuid_t *token = PG_GETARG_UUID_P(0);
+  int32 pos1 = PG_GETARG_INT32(1);
+  int32 pos2 = PG_GETARG_INT32(2);
+  pg_uuid_t *result = palloc(sizeof(pg_uuid_t));
+  uuid_v5_state state;
+
+  // Name is concat(token, pos1, pos2)
+  uuid_v5_init(&state);
+  uuid_v5_update_uuid(&state, token);
+  uuid_v5_update_int(&state, pos1);
+  uuid_v5_update_int(&state, pos2);
+  uuid_v5_final(&state, result);
+
+  provsql_create_gate_extra(result, gate_eq, 1, token, pos1, pos2, NULL, 0);
+
+  PG_RETURN_UUID_P(result);
+}
+
+/* Gate of the sum of tokens, none of them being NULL or zero; tokens
+ * are sorted in place */
+static pg_uuid_t *plus_gate(pg_uuid_t *tokens, int nb_tokens)
+{
+  pg_uuid_t *result = palloc(sizeof(pg_uuid_t));
+  uuid_v5_state state;
+
+  qsort(tokens, nb_tokens, sizeof(pg_uuid_t), uuid_compare);
+
+  uuid_v5_init(&state);
+  uuid_v5_update(&state, "plus", 4);
+  for(int i=0; i<nb_tokens; ++i) {
+    if(i > 0)
+      uuid_v5_update(&state, ",", 1);
+    uuid_v5_update_uuid(&state, &tokens[i]);
+  }
+  uuid_v5_final(&state, result);
+
+  provsql_create_gate(result, gate_plus, nb_tokens, tokens);
+
+  return result;
+}
+
+Datum provenance_plus(PG_FUNCTION_ARGS)
+{
+  ArrayType *array = PG_GETARG_ARRAYTYPE_P(0);
+  pg_uuid_t *tokens;
+  int nb, nb_tokens;
+
+  nb = get_tokens(array, &uuid_gate_zero, &tokens, &nb_tokens);
+
+  // The only element is returned as is, even if it is NULL or zero
+  if(nb == 1) {
+    if(array_contains_nulls(array))
+      PG_RETURN_NULL();
+    else if(nb_tokens == 0)
+      PG_RETURN_DATUM(copy_token(&uuid_gate_zero));
+    else
+      PG_RETURN_UUID_P(&tokens[0]);
+  }
+
+  PG_RETURN_UUID_P(plus_gate(tokens, nb_tokens));
+}
+
+Datum provenance_delta(PG_FUNCTION_ARGS)
+{
+  pg_uuid_t *token = PG_GETARG_UUID_P(0);
+  pg_uuid_t *result;
+  uuid_v5_state state;
+
+  if(!memcmp(token, &uuid_gate_zero, sizeof(pg_uuid_t)) || !memcmp(token, &uuid_gate_one, sizeof(pg_uuid_t)))
+    PG_RETURN_UUID_P(token);
+
+  result = palloc(sizeof(pg_uuid_t));
+  uuid_v5_init(&state);
+  uuid_v5_update(&state, "delta", 5);
+  uuid_v5_update_uuid(&state, token);
+  uuid_v5_final(&state, result);
+
+  provsql_create_gate(result, gate_delta, 1, token);
+
+  PG_RETURN_UUID_P(result);
+}
+
+Datum provenance_aggregate(PG_FUNCTION_ARGS)
+{
+  int32 aggfnoid = PG_GETARG_INT32(0);
+  int32 aggtype = PG_GETARG_INT32(1);
+  char *val = cast_to_varchar(PG_GETARG_DATUM(2), get_fn_expr_argtype(fcinfo->flinfo, 2));
+  pg_uuid_t *tokens, *children;
+  int nb_tokens, nb_children = 0;
+  pg_uuid_t token;
+  char token_text[37];
+  uuid_v5_state state;
+
+  // Children are not filtered for the name, which is
+  // concat('agg', array_to_string(tokens, ','))
+  get_tokens(PG_GETARG_ARRAYTYPE_P(3), NULL, &tokens, &nb_tokens);
+
+  uuid_v5_init(&state);
+  uuid_v5_update(&state, "agg", 3);
+  for(int i=0; i<nb_tokens; ++i) {
+    if(i > 0)
+      uuid_v5_update(&state, ",", 1);
+    uuid_v5_update_uuid(&state, &tokens[i]);
+  }
+  uuid_v5_final(&state, &token);
+
+  children = palloc(Max(nb_tokens, 1) * sizeof(pg_uuid_t));
+  for(int i=0; i<nb_tokens; ++i)
+    if(memcmp(&tokens[i], &uuid_gate_zero, sizeof(pg_uuid_t)))
+      children[nb_children++] = tokens[i];
+
+  // The aggregate function and its result type are the infos of the
+  // gate, its value, with its terminating null character, its extra
+  // data
+  provsql_create_gate_extra(&token, gate_agg, nb_children, children, aggfnoid, aggtype, val, strlen(val) + 1);
+
+  uuid_to_text(&token, token_text);
+  token_text[36] = '\0';
+
+  PG_RETURN_DATUM(DirectFunctionCall1(agg_token_in, CStringGetDatum(psprintf("( %s , %s )", token_text, val))));
+}
+
+Datum provenance_semimod(PG_FUNCTION_ARGS)
+{
+  char *val = PG_ARGISNULL(0) ? NULL : cast_to_varchar(PG_GETARG_DATUM(0), get_fn_expr_argtype(fcinfo->flinfo, 0));
+  pg_uuid_t *token;
+  pg_uuid_t value_token, *result;
+  pg_uuid_t children[2];
+  uuid_v5_state state;
+
+  if(PG_ARGISNULL(1))
+    PG_RETURN_NULL();
+
+  token = PG_GETARG_UUID_P(1);
+
+  uuid_v5_init(&state);
+  uuid_v5_update(&state, "value", 5);
+  if(val)
+    uuid_v5_update(&state, val, strlen(val));
+  uuid_v5_final(&state, &value_token);
+
+  result = palloc(sizeof(pg_uuid_t));
+  uuid_v5_init(&state);
+  uuid_v5_update(&state, "semimod", 7);
+  uuid_v5_update_uuid(&state, &value_token);
+  uuid_v5_update_uuid(&state, token);
+  uuid_v5_final(&state, result);
+
+  // No extra data stands for a NULL value
+  provsql_create_gate_extra(&value_token, gate_value, 0, NULL, 0, 0, val, val ? strlen(val) + 1 : 0);
+
+  children[0] = *token;
+  children[1] = value_token;
+  provsql_create_gate(result, gate_semimod, 2, children);
+
+  PG_RETURN_UUID_P(result);
+}
+
+/* State of the provenance_plus_agg aggregate, equivalent to
+ * provenance_plus(array_agg(token)): the tokens aggregated, except
+ * NULL and zero ones, which are only counted. Children of plus gates
+ * are sorted, so the token of the gate is only computed by the final
+ * function. */
+typedef struct plus_agg_state
+{
+  int64 nb_rows;
+  bool has_zero;
+  int32 nb_tokens;
+  int32 capacity;
+  pg_uuid_t *tokens;
+} plus_agg_state;
+
+static plus_agg_state *plus_agg_new(MemoryContext aggcontext, int32 capacity)
+{
+  plus_agg_state *state = MemoryContextAlloc(aggcontext, sizeof(plus_agg_state));
+
+  state->nb_rows = 0;
+  state->has_zero = false;
+  state->nb_tokens = 0;
+  state->capacity = Max(capacity, 8);
+  state->tokens = MemoryContextAllocHuge(aggcontext, (Size) state->capacity * sizeof(pg_uuid_t));
+
+  return state;
+}
+
+static void plus_agg_reserve(plus_agg_state *state, int32 nb)
+{
+  if(state->nb_tokens + nb > state->capacity) {
+    state->capacity = Max(2 * state->capacity, state->nb_tokens + nb);
+    state->tokens = repalloc_huge(state->tokens, (Size) state->capacity * sizeof(pg_uuid_t));
+  }
+}
+
+static MemoryContext plus_agg_context(FunctionCallInfo fcinfo)
+{
+  MemoryContext aggcontext;
+
+  if(!AggCheckCallContext(fcinfo, &aggcontext))
+    elog(ERROR, "provenance_plus_agg called in non-aggregate context");
+
+  return aggcontext;
+}
+
+Datum provenance_plus_agg_transfn(PG_FUNCTION_ARGS)
+{
+  MemoryContext aggcontext = plus_agg_context(fcinfo);
+  plus_agg_state *state = PG_ARGISNULL(0) ? plus_agg_new(aggcontext, 0) : (plus_agg_state *) PG_GETARG_POINTER(0);
+
+  ++state->nb_rows;
+
+  if(!PG_ARGISNULL(1)) {
+    pg_uuid_t *token = PG_GETARG_UUID_P(1);
+
+    if(memcmp(token, &uuid_gate_zero, sizeof(pg_uuid_t))) {
+      plus_agg_reserve(state, 1);
+      state->tokens[state->nb_tokens++] = *token;
+    } else
+      state->has_zero = true;
+  }
+
+  PG_RETURN_POINTER(state);
+}
+
+Datum provenance_plus_agg_combinefn(PG_FUNCTION_ARGS)
+{
+  MemoryContext aggcontext = plus_agg_context(fcinfo);
+  plus_agg_state *state1 = PG_ARGISNULL(0) ? NULL : (plus_agg_state *) PG_GETARG_POINTER(0);
+  plus_agg_state *state2 = PG_ARGISNULL(1) ? NULL : (plus_agg_state *) PG_GETARG_POINTER(1);
+
+  if(state2 == NULL) {
+    if(state1 == NULL)
+      PG_RETURN_NULL();
+    PG_RETURN_POINTER(state1);
+  }
+
+  if(state1 == NULL)
+    state1 = plus_agg_new(aggcontext, state2->nb_tokens);
+
+  plus_agg_reserve(state1, state2->nb_tokens);
+  memcpy(state1->tokens + state1->nb_tokens, state2->tokens, state2->nb_tokens * sizeof(pg_uuid_t));
+  state1->nb_tokens += state2->nb_tokens;
+  state1->nb_rows += state2->nb_rows;
+  state1->has_zero |= state2->has_zero;
+
+  PG_RETURN_POINTER(state1);
+}
+
+Datum provenance_plus_agg_serialfn(PG_FUNCTION_ARGS)
+{
+  plus_agg_state *state = (plus_agg_state *) PG_GETARG_POINTER(0);
+  Size size = sizeof(int64) + sizeof(bool) + state->nb_tokens * sizeof(pg_uuid_t);
+  bytea *result = palloc(VARHDRSZ + size);
+  char *p = VARDATA(result);
+
+  SET_VARSIZE(result, VARHDRSZ + size);
+  memcpy(p, &state->nb_rows, sizeof(int64));
+  p += sizeof(int64);
+  memcpy(p, &state->has_zero, sizeof(bool));
+  p += sizeof(bool);
+  memcpy(p, state->tokens, state->nb_tokens * sizeof(pg_uuid_t));
+
+  PG_RETURN_BYTEA_P(result);
+}
+
+Datum provenance_plus_agg_deserialfn(PG_FUNCTION_ARGS)
+{
+  MemoryContext aggcontext = plus_agg_context(fcinfo);
+  bytea *data = PG_GETARG_BYTEA_PP(0);
+  const char *p = VARDATA_ANY(data);
+  int32 nb_tokens = (VARSIZE_ANY_EXHDR(data) - sizeof(int64) - sizeof(bool)) / sizeof(pg_uuid_t);
+  plus_agg_state *state = plus_agg_new(aggcontext, nb_tokens);
+
+  memcpy(&state->nb_rows, p, sizeof(int64));
+  p += sizeof(int64);
+  memcpy(&state->has_zero, p, sizeof(bool));
+  p += sizeof(bool);
+  memcpy(state->tokens, p, nb_tokens * sizeof(pg_uuid_t));
+  state->nb_tokens = nb_tokens;
+
+  PG_RETURN_POINTER(state);
+}
+
+Datum provenance_plus_agg_finalfn(PG_FUNCTION_ARGS)
+{
+  plus_agg_state *state = PG_ARGISNULL(0) ? NULL : (plus_agg_state *) PG_GETARG_POINTER(0);
+
+  // No row: array_agg is NULL, and so is provenance_plus
+  if(state == NULL)
+    PG_RETURN_NULL();
+
+  // A single row is returned as is, even if it is NULL or zero
+  if(state->nb_rows == 1) {
+    if(state->nb_tokens == 1)
+      PG_RETURN_DATUM(copy_token(&state->tokens[0]));
+    else if(state->has_zero)
+      PG_RETURN_DATUM(copy_token(&uuid_gate_zero));
+    else
+      PG_RETURN_NULL();
+  }
+
+  // Sorting the tokens in place does not change the result of later
+  // calls on the same state
+  PG_RETURN_UUID_P(plus_gate(state->tokens, state->nb_tokens));
+}
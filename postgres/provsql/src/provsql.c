@@ -24,15 +24,15 @@
 #include "provsql_utils.h"
 #include "provsql_shmem.h"
 
-#if PG_VERSION_NUM < 90600
-#error "ProvSQL requires PostgreSQL version 9.6 or later"
+#if PG_VERSION_NUM < 110000
+#error "ProvSQL requires PostgreSQL version 11 or later"
 #endif
 
 #include "compatibility.h"
 
 PG_MODULE_MAGIC;
 
-bool provsql_interrupted = false;
+volatile bool provsql_interrupted = false;
 bool provsql_where_provenance = false;
 int provsql_verbose = 100;
 
@@ -47,7 +47,13 @@ static Query *process_query(
   const constants_t *constants,
   Query *q);
 
-static RelabelType *make_provenance_attribute(const constants_t *constants, RangeTblEntry *r, Index relid, AttrNumber attid) {
+/* Provenance attributes are UUIDs, or compact tokens (token8) that are
+ * converted to UUIDs when read */
+static bool is_provenance_type(const constants_t *constants, Oid type) {
+  return type == constants->OID_TYPE_UUID || type == constants->OID_TYPE_TOKEN8;
+}
+
+static RelabelType *make_provenance_attribute(const constants_t *constants, RangeTblEntry *r, Index relid, AttrNumber attid, Oid type) {
   RelabelType *re = makeNode(RelabelType);
   Var *v = makeNode(Var);
 
@@ -62,12 +68,23 @@ static RelabelType *make_provenance_attribute(const constants_t *constants, Rang
   v->varoattno = attid;
 #endif
 
-  v->vartype = constants->OID_TYPE_UUID;
+  v->vartype = type;
   v->varcollid = InvalidOid;
   v->vartypmod = -1;
   v->location = -1;
 
-  re->arg = (Expr *)v;
+  if(type == constants->OID_TYPE_TOKEN8) {
+    FuncExpr *conv = makeNode(FuncExpr);
+
+    conv->funcid = constants->OID_FUNCTION_TOKEN8_UUID;
+    conv->funcresulttype = constants->OID_TYPE_UUID;
+    conv->funcvariadic = false;
+    conv->funcformat = COERCE_IMPLICIT_CAST;
+    conv->args = list_make1(v);
+    conv->location = -1;
+    re->arg = (Expr *)conv;
+  } else
+    re->arg = (Expr *)v;
   re->resulttype = constants->OID_TYPE_UUID;
   re->resulttypmod = -1;
   re->resultcollid = InvalidOid;
@@ -145,9 +162,11 @@ static List *get_provenance_attributes(const constants_t *constants, Query *q)
       {
         const char *v = strVal(lfirst(lc));
 
-        if(!strcmp(v,PROVSQL_COLUMN_NAME) &&
-           get_atttype(r->relid,attid)==constants->OID_TYPE_UUID) {
-          prov_atts = lappend(prov_atts, make_provenance_attribute(constants, r, rteid, attid));
+        if(!strcmp(v,PROVSQL_COLUMN_NAME)) {
+          Oid type = get_atttype(r->relid,attid);
+
+          if(is_provenance_type(constants, type))
+            prov_atts = lappend(prov_atts, make_provenance_attribute(constants, r, rteid, attid, type));
         }
 
         ++attid;
@@ -157,7 +176,7 @@ static List *get_provenance_attributes(const constants_t *constants, Query *q)
       if(new_subquery != NULL) {
         r->subquery = new_subquery;
         r->eref->colnames = lappend(r->eref->colnames, makeString(pstrdup(PROVSQL_COLUMN_NAME)));
-        prov_atts=lappend(prov_atts,make_provenance_attribute(constants,r,rteid,new_subquery->targetList->length));
+        prov_atts=lappend(prov_atts,make_provenance_attribute(constants,r,rteid,new_subquery->targetList->length,constants->OID_TYPE_UUID));
         fix_type_of_aggregation_result(constants, q, rteid, r->subquery->targetList);
       }
     }
@@ -188,9 +207,9 @@ static List *get_provenance_attributes(const constants_t *constants, Query *q)
 
         if(func->funccolcount==1) {
           FuncExpr *expr = (FuncExpr *) func->funcexpr;
-          if(expr->funcresulttype == constants->OID_TYPE_UUID
+          if(is_provenance_type(constants, expr->funcresulttype)
              && !strcmp(get_rte_attribute_name(r,attid),PROVSQL_COLUMN_NAME)) {
-            prov_atts=lappend(prov_atts,make_provenance_attribute(constants,r,rteid,attid));
+            prov_atts=lappend(prov_atts,make_provenance_attribute(constants,r,rteid,attid,expr->funcresulttype));
           }
         }
         else
@@ -233,7 +252,7 @@ static Bitmapset *remove_provenance_attributes_select(
     {
       Var *v = (Var *)rt->expr;
 
-      if(v->vartype==constants->OID_TYPE_UUID) {
+      if(is_provenance_type(constants, v->vartype)) {
         const char *colname;
 
         if (rt->resname)
@@ -592,7 +611,6 @@ static Expr *make_provenance_expression(
     if (group_by_rewrite || aggregation)
     {
       Aggref *agg = makeNode(Aggref);
-      FuncExpr *plus = makeNode(FuncExpr);
       TargetEntry *te_inner = makeNode(TargetEntry);
 
       q->hasAggs = true;
@@ -600,20 +618,17 @@ static Expr *make_provenance_expression(
       te_inner->resno = 1;
       te_inner->expr = (Expr *)result;
 
-      agg->aggfnoid=constants->OID_FUNCTION_ARRAY_AGG;
-      agg->aggtype=constants->OID_TYPE_UUID_ARRAY;
+      // Same result as provenance_plus(array_agg(...)), without
+      // materializing an array, and with partial aggregation
+      agg->aggfnoid=constants->OID_FUNCTION_PROVENANCE_PLUS_AGG;
+      agg->aggtype=constants->OID_TYPE_UUID;
       agg->args=list_make1(te_inner);
       agg->aggkind=AGGKIND_NORMAL;
       agg->location=-1;
 
       agg->aggargtypes=list_make1_oid(constants->OID_TYPE_UUID);
 
-      plus->funcid=constants->OID_FUNCTION_PROVENANCE_PLUS;
-      plus->args=list_make1(agg);
-      plus->funcresulttype=constants->OID_TYPE_UUID;
-      plus->location=-1;
-
-      result=(Expr*)plus;
+      result=(Expr*)agg;
     }
 
     if (aggregation) {
@@ -1130,7 +1145,7 @@ static bool has_provenance_walker(
           const char *v = strVal(lfirst(lc));
 
           if(!strcmp(v,PROVSQL_COLUMN_NAME) &&
-             get_atttype(r->relid,attid)==constants->OID_TYPE_UUID) {
+             is_provenance_type(constants, get_atttype(r->relid,attid))) {
             return true;
           }
 
@@ -1148,7 +1163,7 @@ static bool has_provenance_walker(
 
           if(func->funccolcount==1) {
             FuncExpr *expr = (FuncExpr *) func->funcexpr;
-            if(expr->funcresulttype == constants->OID_TYPE_UUID
+            if(is_provenance_type(constants, expr->funcresulttype)
                && !strcmp(get_rte_attribute_name(r,attid),PROVSQL_COLUMN_NAME)) {
               return true;
             }
@@ -1195,7 +1210,7 @@ static bool transform_except_into_join(
 
     Var *v = (Var *)te->expr;
 
-    if(v->vartype != constants->OID_TYPE_UUID) {
+    if(!is_provenance_type(constants, v->vartype)) {
       OpExpr *oe = makeNode(OpExpr);
       Oid opno = find_equality_operator(v->vartype, v->vartype);
       Operator opInfo = SearchSysCache1(OPEROID, ObjectIdGetDatum(opno));
@@ -1595,36 +1610,12 @@ void _PG_init(void)
 
   DefineCustomIntVariable("provsql.max_nb_gates",
                           "Maximum number of gates kept in memory",
-                          NULL,
+                          "Memory for gates and wires is allocated as the circuit grows, up to this number of gates.",
                           &provsql_max_nb_gates,
                           30000000,
                           1000,
                           INT_MAX,
-                          PGC_POSTMASTER,
-                          0,
-                          NULL,
-                          NULL,
-                          NULL);
-  DefineCustomIntVariable("provsql.init_nb_gates",
-                          "Initial number of gates kept in memory",
-                          NULL,
-                          &provsql_init_nb_gates,
-                          1000,
-                          1000,
-                          INT_MAX,
-                          PGC_POSTMASTER,
-                          0,
-                          NULL,
-                          NULL,
-                          NULL);
-  DefineCustomIntVariable("provsql.avg_nb_wires",
-                          "Average number of wires per gate kept in memory",
-                          NULL,
-                          &provsql_avg_nb_wires,
-                          10,
-                          1,
-                          1000,
-                          PGC_POSTMASTER,
+                          PGC_SIGHUP,
                           0,
                           NULL,
                           NULL,
@@ -1644,6 +1635,8 @@ void _PG_init(void)
 
   planner_hook = provsql_planner;
   shmem_startup_hook = provsql_shmem_startup;
+
+  provsql_register_worker();
 }
 
 void _PG_fini(void)
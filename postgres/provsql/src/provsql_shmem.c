@@ -4,164 +4,1011 @@
 #include "fmgr.h"
 #include "funcapi.h"
 #include "miscadmin.h"
+#include "pgstat.h"
 #include "access/htup_details.h"
+#include "catalog/pg_type.h"
 #include "parser/parse_func.h"
+#include "postmaster/bgworker.h"
+#include "storage/latch.h"
 #include "storage/shmem.h"
 #include "storage/fd.h"
 #include "utils/array.h"
-#include "utils/hsearch.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
 #include "utils/uuid.h"
 
 #include "unistd.h"
 
 #include "provsql_shmem.h"
 
-#define PROVSQL_DUMP_FILE "provsql.tmp"
-
 shmem_startup_hook_type prev_shmem_startup = NULL;
 #if (PG_VERSION_NUM >= 150000)
 shmem_request_hook_type prev_shmem_request = NULL;
 #endif
-int provsql_init_nb_gates;
 int provsql_max_nb_gates;
-int provsql_avg_nb_wires;
-
-static void provsql_shmem_shutdown(int code, Datum arg);
 
 provsqlSharedState *provsql_shared_state = NULL;
-HTAB *provsql_hash = NULL;
-provsqlHashEntry *entry;
 
-static Size provsql_struct_size(void)
+dsa_area *provsql_area = NULL;
+dshash_table *provsql_hash = NULL;
+provsqlGate **provsql_gate_chunks = NULL;
+uint32 provsql_nb_gate_chunks = 0;
+
+const char *probability_method_names[nb_probability_methods] = {"default", "independent", "possible-worlds", "monte-carlo", "compilation", "weightmc", "tree-decomposition", "fpras"};
+
+PGDLLEXPORT void provsql_worker_main(Datum main_arg);
+
+/* The in-place part of provsql_area follows the shared state */
+static void *provsql_area_place(void)
 {
-  return add_size(offsetof(provsqlSharedState, wires),
-                  mul_size(sizeof(pg_uuid_t), provsql_max_nb_gates * provsql_avg_nb_wires));
+  return (char *) provsql_shared_state + MAXALIGN(sizeof(provsqlSharedState));
 }
 
 void provsql_shmem_startup(void)
 {
   bool found;
-  HASHCTL info;
 
   if(prev_shmem_startup)
     prev_shmem_startup();
 
   // Reset in case of restart
   provsql_shared_state = NULL;
-  provsql_hash = NULL;
-
 
   LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
 
   provsql_shared_state = ShmemInitStruct(
     "provsql",
-    provsql_struct_size(),
+    provsql_memsize(),
     &found);
 
   if(!found) {
-#if PG_VERSION_NUM >= 90600
-    /* Named lock tranches were added in version 9.6 of PostgreSQL */
-    provsql_shared_state->lock =&(GetNamedLWLockTranche("provsql"))->lock;
-#else
-    provsql_shared_state->lock =LWLockAssign();
-#endif /* PG_VERSION_NUM >= 90600 */
-    provsql_shared_state->nb_wires=0;
-  }
-
-  memset(&info, 0, sizeof(info));
-  info.keysize = sizeof(pg_uuid_t);
-  info.entrysize = sizeof(provsqlHashEntry);
-
-  provsql_hash = ShmemInitHash(
-    "provsql hash",
-    provsql_init_nb_gates,
-    provsql_max_nb_gates,
-    &info,
-    HASH_ELEM | HASH_BLOBS
-    );
+    LWLockPadded *locks = GetNamedLWLockTranche("provsql");
+
+    for(int i=0; i<PROVSQL_NUM_PARTITIONS; ++i) {
+      provsql_shared_state->partition_locks[i] = &locks[i].lock;
+      provsql_shared_state->access_locks[i] = &locks[PROVSQL_NUM_PARTITIONS + i].lock;
+    }
+    provsql_shared_state->store_lock = &locks[2 * PROVSQL_NUM_PARTITIONS].lock;
+    provsql_shared_state->area_tranche_id = LWLockNewTrancheId();
+    provsql_shared_state->initialized = false;
+    provsql_shared_state->loaded = false;
+    provsql_shared_state->hash_handle = InvalidDsaPointer;
+    pg_atomic_init_u32(&provsql_shared_state->nb_gates, 0);
+    pg_atomic_init_u64(&provsql_shared_state->wires, 0);
+    // Gates read from the dump get epoch 0, see provsql_deserialize
+    pg_atomic_init_u32(&provsql_shared_state->epoch, 1);
+    pg_atomic_init_u32(&provsql_shared_state->generation, 0);
+    pg_atomic_init_flag(&provsql_shared_state->vacuum_running);
+    provsql_shared_state->logged_gates = 0;
+    provsql_shared_state->checkpoint_needed = false;
+    provsql_shared_state->persistence_disabled = false;
+    provsql_shared_state->checkpoint = 0;
+    provsql_shared_state->snapshot_size = 0;
+    pg_atomic_init_u32(&provsql_shared_state->nb_changed, 0);
+    provsql_shared_state->base_index = InvalidDsaPointer;
+    provsql_shared_state->nb_base = 0;
+    pg_atomic_init_u64(&provsql_shared_state->stats.create_gate_hits, 0);
+    pg_atomic_init_u64(&provsql_shared_state->stats.create_gate_inserts, 0);
+    pg_atomic_init_u64(&provsql_shared_state->stats.lock_acquisitions, 0);
+    pg_atomic_init_u64(&provsql_shared_state->stats.lock_waits, 0);
+    pg_atomic_init_u64(&provsql_shared_state->stats.lock_wait_time, 0);
+    for(int i=0; i<nb_probability_methods; ++i) {
+      pg_atomic_init_u64(&provsql_shared_state->stats.evaluations[i], 0);
+      pg_atomic_init_u64(&provsql_shared_state->stats.evaluation_time[i], 0);
+    }
+    for(int i=0; i<=nb_gate_types; ++i)
+      pg_atomic_init_u64(&provsql_shared_state->stats.gates[i], 0);
+    pg_atomic_init_u64(&provsql_shared_state->stats.wires, 0);
+    for(int i=0; i<PROVSQL_MAX_GATE_CHUNKS; ++i)
+      provsql_shared_state->gate_chunks[i] = InvalidDsaPointer;
+    for(int i=0; i<PROVSQL_MAX_WIRE_CHUNKS; ++i) {
+      provsql_shared_state->wire_chunks[i].ptr = InvalidDsaPointer;
+      provsql_shared_state->wire_chunks[i].size = 0;
+    }
+  }
 
   LWLockRelease(AddinShmemInitLock);
 
-  // If we are in the main process, we set up a shutdown hook
-  if(!IsUnderPostmaster)
-    on_shmem_exit(provsql_shmem_shutdown, (Datum) 0);
+  // The circuit store itself cannot be created in the postmaster, which
+  // cannot create dynamic shared memory segments: it is created by the
+  // first process that accesses it, usually the provsql background
+  // worker, see provsql_store_attach
+}
 
-  // Already initialized
-  if(found)
+Size provsql_memsize(void)
+{
+  // Size of the shared state structure
+  Size size = MAXALIGN(sizeof(provsqlSharedState));
+  // Size of the part of provsql_area in the main shared memory segment
+  size = add_size(size, PROVSQL_AREA_INITIAL_SIZE);
+
+  return size;
+}
+
+/* Attaches the current process to the circuit store, creating it if
+ * needed; this must be called before any access to the store. The
+ * first process to attach also reads the dump of the circuit from the
+ * previous run; the others may return before it is read, but then wait
+ * for it on the access locks, see provsql_load. */
+void provsql_store_attach(void)
+{
+  MemoryContext oldcontext;
+  dshash_parameters params;
+  dsa_area *area;
+  void *place;
+  int result;
+
+  if(provsql_area)
     return;
 
+  place = provsql_area_place();
+
+  memset(&params, 0, sizeof(params));
+  params.key_size = sizeof(pg_uuid_t);
+  params.entry_size = sizeof(provsqlHashEntry);
+  params.compare_function = dshash_memcmp;
+  params.hash_function = dshash_memhash;
+#if PG_VERSION_NUM >= 170000
+  params.copy_function = dshash_memcpy;
+#endif
+  params.tranche_id = provsql_shared_state->area_tranche_id;
+
+  LWLockRegisterTranche(provsql_shared_state->area_tranche_id, "provsql_area");
+
+  // The area and its mappings live as long as the process
+  oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+  LWLockAcquire(provsql_shared_state->store_lock, LW_EXCLUSIVE);
+
+  if(!provsql_shared_state->initialized) {
+    area = dsa_create_in_place(place, PROVSQL_AREA_INITIAL_SIZE, provsql_shared_state->area_tranche_id, NULL);
+    dsa_pin_mapping(area);
+    // The area must survive periods where no process is attached
+    dsa_pin(area);
+    provsql_hash = dshash_create(area, &params, NULL);
+    provsql_shared_state->hash_handle = dshash_get_hash_table_handle(provsql_hash);
+    provsql_shared_state->initialized = true;
+  } else {
+    area = dsa_attach_in_place(place, NULL);
+    dsa_pin_mapping(area);
+    provsql_hash = dshash_attach(area, &params, provsql_shared_state->hash_handle, NULL);
+  }
+
+  LWLockRelease(provsql_shared_state->store_lock);
+
+  on_shmem_exit(dsa_on_shmem_exit_release_in_place, PointerGetDatum(place));
+
+  MemoryContextSwitchTo(oldcontext);
+
+  provsql_area = area;
+
+  if(provsql_shared_state->loaded)
+    return;
+
+  result = provsql_load();
+  if(result == 2)
+    elog(LOG, "Error while reading the file during deserialization");
+  else if(result == 3)
+    elog(LOG, "Error while closing the file during deserialization");
+}
+
+/* Chunks of gates may have been freed by vacuum_circuit since they were
+ * mapped by the current process */
+static void provsql_check_generation(void)
+{
+  static uint32 local_generation = 0;
+  uint32 generation = pg_atomic_read_u32(&provsql_shared_state->generation);
+
+  if(generation != local_generation) {
+    if(provsql_gate_chunks)
+      memset(provsql_gate_chunks, 0, provsql_nb_gate_chunks * sizeof(provsqlGate *));
+    local_generation = generation;
+  }
+}
+
+/* Acquires a lock of the store, keeping track of contention for the
+ * stat SQL function: the time spent waiting is only measured when the
+ * lock is not immediately available */
+void provsql_lock(LWLock *lock, LWLockMode mode)
+{
+  instr_time start, duration;
+
+  pg_atomic_fetch_add_u64(&provsql_shared_state->stats.lock_acquisitions, 1);
+
+  if(LWLockConditionalAcquire(lock, mode))
+    return;
+
+  INSTR_TIME_SET_CURRENT(start);
+  LWLockAcquire(lock, mode);
+  INSTR_TIME_SET_CURRENT(duration);
+  INSTR_TIME_SUBTRACT(duration, start);
+
+  pg_atomic_fetch_add_u64(&provsql_shared_state->stats.lock_waits, 1);
+  pg_atomic_fetch_add_u64(&provsql_shared_state->stats.lock_wait_time, INSTR_TIME_GET_MICROSEC(duration));
+}
+
+void provsql_count_evaluation(probability_method method, instr_time start)
+{
+  instr_time duration;
+
+  INSTR_TIME_SET_CURRENT(duration);
+  INSTR_TIME_SUBTRACT(duration, start);
+
+  provsql_store_attach();
+  pg_atomic_fetch_add_u64(&provsql_shared_state->stats.evaluations[method], 1);
+  pg_atomic_fetch_add_u64(&provsql_shared_state->stats.evaluation_time[method], INSTR_TIME_GET_MICROSEC(duration));
+}
+
+/* Every access to the gates of the store is done while holding one of
+ * the access locks in shared mode, the lock being chosen by process to
+ * avoid contention; vacuum_circuit, which moves gates around and frees
+ * memory, holds all of them exclusively. */
+void provsql_store_acquire(void)
+{
+  provsql_store_attach();
+
+  provsql_lock(provsql_shared_state->access_locks[MyProcPid % PROVSQL_NUM_PARTITIONS], LW_SHARED);
+  provsql_check_generation();
+}
+
+void provsql_store_release(void)
+{
+  LWLockRelease(provsql_shared_state->access_locks[MyProcPid % PROVSQL_NUM_PARTITIONS]);
+}
+
+void provsql_lock_all_access(void)
+{
+  provsql_store_attach();
+
+  for(int i=0; i<PROVSQL_NUM_PARTITIONS; ++i)
+    provsql_lock(provsql_shared_state->access_locks[i], LW_EXCLUSIVE);
+  provsql_check_generation();
+}
+
+void provsql_release_all_access(void)
+{
+  for(int i=PROVSQL_NUM_PARTITIONS-1; i>=0; --i)
+    LWLockRelease(provsql_shared_state->access_locks[i]);
+}
 
-  if( access( "provsql.tmp", F_OK ) == 0 ) {
-    switch (provsql_deserialize("provsql.tmp"))
-    {
-    case 1:
-      //elog(ERROR, "Error while opening the file during deserialization");
-      break;
+/* Maps a chunk of gates in the address space of the current process */
+provsqlGate *provsql_map_gate_chunk(uint32 chunk)
+{
+  dsa_pointer ptr = provsql_shared_state->gate_chunks[chunk];
 
-    case 2:
-      //elog(ERROR, "Error while reading the file during deserialization");
-      break;
+  Assert(ptr != InvalidDsaPointer);
 
-    case 3:
-      elog(ERROR, "Error while closing the file during deserialization");
-      break;
+  if(chunk >= provsql_nb_gate_chunks) {
+    uint32 nb = Max(chunk + 1, 2 * provsql_nb_gate_chunks);
+
+    if(provsql_gate_chunks == NULL)
+      provsql_gate_chunks = MemoryContextAllocZero(TopMemoryContext, nb * sizeof(provsqlGate *));
+    else {
+      provsql_gate_chunks = repalloc(provsql_gate_chunks, nb * sizeof(provsqlGate *));
+      memset(provsql_gate_chunks + provsql_nb_gate_chunks, 0, (nb - provsql_nb_gate_chunks) * sizeof(provsqlGate *));
     }
+    provsql_nb_gate_chunks = nb;
   }
 
+  provsql_gate_chunks[chunk] = (provsqlGate *) dsa_get_address(provsql_area, ptr);
+  return provsql_gate_chunks[chunk];
 }
 
-static void provsql_shmem_shutdown(int code, Datum arg)
+/* Whole-store operations (serialization, deserialization) lock all
+ * partitions, always in the same order to avoid deadlocks */
+void provsql_lock_all_partitions(LWLockMode mode)
 {
+  for(int i=0; i<PROVSQL_NUM_PARTITIONS; ++i)
+    provsql_lock(provsql_shared_state->partition_locks[i], mode);
+}
 
-  #if PG_VERSION_NUM >= 90600
-  // Named lock tranches were added in version 9.6 of PostgreSQL
-  provsql_shared_state->lock =&(GetNamedLWLockTranche("provsql"))->lock;
-  #else
-  provsql_shared_state->lock =LWLockAssign();
-  #endif // PG_VERSION_NUM >= 90600
+void provsql_release_all_partitions(void)
+{
+  for(int i=PROVSQL_NUM_PARTITIONS-1; i>=0; --i)
+    LWLockRelease(provsql_shared_state->partition_locks[i]);
+}
 
-  switch (provsql_serialize("provsql.tmp"))
-  {
-  case 1:
-    elog(INFO, "Error while opening the file during serialization");
-    break;
+/* Allocates a new chunk of wires with room for at least nb wires, unless
+ * another process did it concurrently; returns false if memory is
+ * exhausted */
+static bool provsql_new_wire_chunk(unsigned nb)
+{
+  uint64 current;
+  uint32 chunk;
+  provsqlWireChunk *c;
+  bool result = true;
+
+  LWLockAcquire(provsql_shared_state->store_lock, LW_EXCLUSIVE);
+
+  current = pg_atomic_read_u64(&provsql_shared_state->wires);
+  chunk = (uint32) (current >> 32);
+  c = &provsql_shared_state->wire_chunks[chunk];
+
+  if(c->ptr == InvalidDsaPointer || (uint64) (uint32) current + nb > c->size) {
+    if(c->ptr != InvalidDsaPointer)
+      ++chunk;
+
+    if(chunk >= PROVSQL_MAX_WIRE_CHUNKS)
+      result = false;
+    else {
+      uint32 size = Max(nb, PROVSQL_WIRES_PER_CHUNK);
+      dsa_pointer ptr = dsa_allocate_extended(provsql_area, (Size) size * sizeof(uint32), DSA_ALLOC_HUGE | DSA_ALLOC_NO_OOM);
+
+      if(ptr == InvalidDsaPointer)
+        result = false;
+      else {
+        provsql_shared_state->wire_chunks[chunk].ptr = ptr;
+        provsql_shared_state->wire_chunks[chunk].size = size;
+        // The chunk must be visible before it is made current; wires
+        // reserved concurrently in the previous chunk remain valid
+        pg_write_barrier();
+        pg_atomic_write_u64(&provsql_shared_state->wires, (uint64) chunk << 32);
+      }
+    }
+  }
 
-  case 2:
-    elog(INFO, "Error while writing to file during serialization");
-    break;
+  LWLockRelease(provsql_shared_state->store_lock);
 
-  case 3:
-    elog(INFO, "Error while closing the file during serialization");
-    break;
+  return result;
+}
+
+/* Reserves nb consecutive wires, without any lock in the common case:
+ * concurrent creators of gates in different partitions only contend on
+ * the cursor, and on the store lock when a new chunk is needed. Returns
+ * false if memory is exhausted. */
+bool provsql_reserve_wires(unsigned nb, dsa_pointer *start)
+{
+  uint64 current = pg_atomic_read_u64(&provsql_shared_state->wires);
+
+  for(;;) {
+    uint32 used = (uint32) current;
+    provsqlWireChunk *c = &provsql_shared_state->wire_chunks[current >> 32];
+
+    pg_read_barrier();
+
+    if(c->ptr != InvalidDsaPointer && (uint64) used + nb <= c->size) {
+      if(pg_atomic_compare_exchange_u64(&provsql_shared_state->wires, &current, current + nb)) {
+        *start = c->ptr + (dsa_pointer) used * sizeof(uint32);
+        return true;
+      }
+    } else {
+      if(!provsql_new_wire_chunk(nb))
+        return false;
+      current = pg_atomic_read_u64(&provsql_shared_state->wires);
+    }
   }
+}
 
-  LWLockRelease(provsql_shared_state->lock);
+/* Allocates a chunk of gates if needed; returns false if memory is
+ * exhausted */
+static bool provsql_ensure_gate_chunk(uint32 chunk)
+{
+  if(chunk >= PROVSQL_MAX_GATE_CHUNKS)
+    return false;
 
+  if(provsql_shared_state->gate_chunks[chunk] != InvalidDsaPointer)
+    return true;
 
-  // TODO (void) durable_rename(PROVSQL_DUMP_FILE ".tmp", PROVSQL_DUMP_FILE, LOG);
+  LWLockAcquire(provsql_shared_state->store_lock, LW_EXCLUSIVE);
+  if(provsql_shared_state->gate_chunks[chunk] == InvalidDsaPointer)
+    provsql_shared_state->gate_chunks[chunk] = dsa_allocate_extended(provsql_area, PROVSQL_GATES_PER_CHUNK * sizeof(provsqlGate), DSA_ALLOC_NO_OOM);
+  LWLockRelease(provsql_shared_state->store_lock);
 
+  return provsql_shared_state->gate_chunks[chunk] != InvalidDsaPointer;
 }
 
-Size provsql_memsize(void)
+/* Same for the slot of a new gate. Returns false if
+ * provsql.max_nb_gates is reached or memory is exhausted. */
+static bool provsql_reserve_gate(uint32 *slot)
 {
-  // Size of the shared state structure
-  Size size = MAXALIGN(provsql_struct_size());
-  // Size of the array of wire ends
-  size = add_size(size,
-                  hash_estimate_size(provsql_max_nb_gates, sizeof(provsqlHashEntry)));
+  uint32 current = pg_atomic_read_u32(&provsql_shared_state->nb_gates);
+
+  do {
+    if(current >= (uint32) provsql_max_nb_gates)
+      return false;
+    // Memory for a slot is allocated before it is reserved, so that all
+    // reserved slots are backed by memory
+    if(!provsql_ensure_gate_chunk(current / PROVSQL_GATES_PER_CHUNK))
+      return false;
+  } while(!pg_atomic_compare_exchange_u32(&provsql_shared_state->nb_gates, &current, current + 1));
+
+  *slot = current;
+  return true;
+}
 
-  return size;
+/* Looks up a token by binary search in the base index */
+static bool provsql_find_base(pg_uuid_t *token, uint32 *slot)
+{
+  provsqlBaseEntry *base;
+  uint32 low = 0, high = provsql_shared_state->nb_base;
+
+  if(high == 0)
+    return false;
+
+  base = (provsqlBaseEntry *) dsa_get_address(provsql_area, provsql_shared_state->base_index);
+
+  while(low < high) {
+    uint32 mid = low + (high - low) / 2;
+    int cmp = memcmp(&base[mid].token, token, sizeof(pg_uuid_t));
+
+    if(cmp == 0) {
+      *slot = base[mid].slot;
+      return true;
+    } else if(cmp < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return false;
+}
+
+/* Looks up the slot of the gate of a token; returns false if there is
+ * no such gate. Gates read from a snapshot into an empty store are
+ * found in the base index, which is never modified except by
+ * vacuum_circuit, and other gates in provsql_hash; a token is never in
+ * both. */
+bool provsql_find_gate(pg_uuid_t *token, uint32 *slot)
+{
+  provsqlHashEntry *entry;
+
+  entry = (provsqlHashEntry *) dshash_find(provsql_hash, token, false);
+  if(entry == NULL)
+    return provsql_find_base(token, slot);
+
+  *slot = entry->slot;
+  dshash_release_lock(provsql_hash, entry);
+
+  return true;
+}
+
+/* Inserts a new gate of undefined type for a token, whose partition
+ * lock is held exclusively; returns false if the store is full */
+static bool provsql_enter_gate(pg_uuid_t *token, uint32 *slot, bool *found)
+{
+  provsqlHashEntry *entry;
+  provsqlGate *gate;
+
+  if(provsql_find_base(token, slot)) {
+    *found = true;
+    return true;
+  }
+
+  entry = (provsqlHashEntry *) dshash_find_or_insert(provsql_hash, token, found);
+
+  if(*found) {
+    *slot = entry->slot;
+    dshash_release_lock(provsql_hash, entry);
+    return true;
+  }
+
+  if(!provsql_reserve_gate(slot)) {
+    dshash_delete_entry(provsql_hash, entry);
+    return false;
+  }
+
+  gate = provsql_gate(*slot);
+  gate->token = *token;
+  gate->type = PROVSQL_GATE_UNDEFINED;
+  gate->nb_children = 0;
+  gate->children = InvalidDsaPointer;
+  gate->prob = NAN;
+  gate->info1 = gate->info2 = 0;
+  gate->extra_len = 0;
+  gate->epoch = pg_atomic_read_u32(&provsql_shared_state->epoch);
+  gate->dbid = MyDatabaseId;
+  provsql_count_gates(PROVSQL_GATE_UNDEFINED, 1, 0);
+
+  entry->slot = *slot;
+  dshash_release_lock(provsql_hash, entry);
+
+  return true;
+}
+
+/* Records that a gate has been used by the current process, so that
+ * vacuum_circuit keeps it until its next run */
+static void provsql_touch_gate(provsqlGate *gate)
+{
+  gate->epoch = pg_atomic_read_u32(&provsql_shared_state->epoch);
+  if(gate->dbid != MyDatabaseId)
+    gate->dbid = InvalidOid;
+}
+
+/* Direct-mapped cache of tokens of gates this backend has recently
+ * created or found defined, so that create_gate can return without
+ * looking up the shared hash table. A gate can only disappear from the
+ * store through vacuum_circuit, which bumps the epoch before looking
+ * for gates to free, and the store generation when it frees them: the
+ * cache is emptied whenever either changes. Gates found in the cache
+ * thus do not need to be touched, they were stamped with the current
+ * epoch when entered in the cache. Deserialization only adds gates, or
+ * modifies the probability and infos of existing ones, and does not
+ * need to invalidate the cache. */
+static pg_uuid_t *gate_cache = NULL;
+static bool *gate_cache_valid = NULL;
+static uint32 gate_cache_epoch;
+static uint32 gate_cache_generation;
+uint64 provsql_gate_cache_hits = 0;
+uint64 provsql_gate_cache_misses = 0;
+/* Cache hits not yet added to the shared statistics, which are only
+ * updated every PROVSQL_GATE_CACHE_SIZE / 4 hits to avoid contention
+ * on the counter */
+static uint64 gate_cache_pending_hits = 0;
+
+static void provsql_gate_cache_flush_stats(void)
+{
+  if(gate_cache_pending_hits) {
+    pg_atomic_fetch_add_u64(&provsql_shared_state->stats.create_gate_hits, gate_cache_pending_hits);
+    gate_cache_pending_hits = 0;
+  }
+}
+
+/* Parallel workers are short-lived, their pending hits are added to
+ * the statistics when they exit */
+static void provsql_gate_cache_exit(int code, Datum arg)
+{
+  provsql_gate_cache_flush_stats();
+}
+
+static bool provsql_gate_cache_lookup(pg_uuid_t *token, uint32 hashcode)
+{
+  uint32 epoch = pg_atomic_read_u32(&provsql_shared_state->epoch);
+  uint32 generation = pg_atomic_read_u32(&provsql_shared_state->generation);
+  uint32 i = hashcode & (PROVSQL_GATE_CACHE_SIZE - 1);
+
+  if(gate_cache == NULL) {
+    gate_cache = MemoryContextAlloc(TopMemoryContext, PROVSQL_GATE_CACHE_SIZE * sizeof(pg_uuid_t));
+    gate_cache_valid = MemoryContextAllocZero(TopMemoryContext, PROVSQL_GATE_CACHE_SIZE * sizeof(bool));
+    before_shmem_exit(provsql_gate_cache_exit, (Datum) 0);
+    gate_cache_epoch = epoch;
+    gate_cache_generation = generation;
+  } else if(epoch != gate_cache_epoch || generation != gate_cache_generation) {
+    memset(gate_cache_valid, 0, PROVSQL_GATE_CACHE_SIZE * sizeof(bool));
+    gate_cache_epoch = epoch;
+    gate_cache_generation = generation;
+  }
+
+  if(gate_cache_valid[i] && memcmp(&gate_cache[i], token, sizeof(pg_uuid_t)) == 0) {
+    ++provsql_gate_cache_hits;
+    if(++gate_cache_pending_hits >= PROVSQL_GATE_CACHE_SIZE / 4)
+      provsql_gate_cache_flush_stats();
+    return true;
+  }
+
+  ++provsql_gate_cache_misses;
+  return false;
+}
+
+/* Records that the gate of a token is defined and has been touched
+ * since provsql_gate_cache_lookup was last called */
+static void provsql_gate_cache_insert(pg_uuid_t *token, uint32 hashcode)
+{
+  uint32 i = hashcode & (PROVSQL_GATE_CACHE_SIZE - 1);
+
+  gate_cache[i] = *token;
+  gate_cache_valid[i] = true;
+}
+
+/* Returns the slot of the gate of a token, inserting a gate of
+ * undefined type if there is none. If locked is true, the caller
+ * already holds all partition locks exclusively. */
+uint32 provsql_get_slot(pg_uuid_t *token, bool locked)
+{
+  LWLock *partition_lock = provsql_partition_lock(provsql_token_hash(token));
+  bool found, ok;
+  uint32 slot;
+
+  if(!locked && provsql_find_gate(token, &slot)) {
+    provsql_touch_gate(provsql_gate(slot));
+    return slot;
+  }
+
+  if(!locked)
+    provsql_lock(partition_lock, LW_EXCLUSIVE);
+  ok = provsql_enter_gate(token, &slot, &found);
+  if(!locked)
+    LWLockRelease(partition_lock);
+
+  if(!ok)
+    elog(ERROR, "Too many gates in in-memory circuit");
+
+  return slot;
+}
+
+/* Moves the gates marked in keep to the first slots, preserving their
+ * order, and their wires to a single new chunk, then frees all other
+ * gates and all memory not used anymore. Returns the number of gates
+ * freed. The caller holds all access locks exclusively. */
+uint32 provsql_compact_store(const bits8 *keep)
+{
+  uint32 nb_gates = pg_atomic_read_u32(&provsql_shared_state->nb_gates);
+  uint64 current = pg_atomic_read_u64(&provsql_shared_state->wires);
+  uint32 nb_wire_chunks = (uint32) (current >> 32) + 1;
+  uint32 nb_old_gate_chunks = (nb_gates + PROVSQL_GATES_PER_CHUNK - 1) / PROVSQL_GATES_PER_CHUNK;
+  uint32 nb_new_gate_chunks;
+  uint32 *new_slot;
+  uint32 nb_kept = 0;
+  uint64 nb_wires = 0;
+  uint64 count[nb_gate_types + 1] = {0};
+  uint64 nb_children = 0;
+  uint32 wires_size;
+  dsa_pointer wires_ptr;
+  uint32 *wires;
+
+  // New slots, and number of wires of the gates kept, with their extra
+  // data
+  new_slot = palloc_extended(Max(nb_gates, 1) * sizeof(uint32), MCXT_ALLOC_HUGE);
+  for(uint32 s=0; s<nb_gates; ++s) {
+    if(keep[s / BITS_PER_BYTE] & (1 << (s % BITS_PER_BYTE))) {
+      provsqlGate *gate = provsql_gate(s);
+
+      new_slot[s] = nb_kept++;
+      nb_wires += provsql_nb_words(gate->nb_children, gate->extra_len);
+      ++count[gate->type];
+      nb_children += gate->nb_children;
+    }
+  }
+
+  if(nb_wires > PG_UINT32_MAX)
+    elog(ERROR, "Too many wires in in-memory circuit");
+
+  // All memory is allocated before the store is modified, so that the
+  // compaction cannot fail halfway
+  wires_size = Max((uint32) nb_wires, PROVSQL_WIRES_PER_CHUNK);
+  wires_ptr = dsa_allocate_extended(provsql_area, (Size) wires_size * sizeof(uint32), DSA_ALLOC_HUGE | DSA_ALLOC_NO_OOM);
+  if(wires_ptr == InvalidDsaPointer)
+    elog(ERROR, "Cannot allocate memory for compacting the in-memory circuit");
+  wires = (uint32 *) dsa_get_address(provsql_area, wires_ptr);
+
+  // Gates only move towards lower slots, so a gate has not been
+  // overwritten yet when it is processed
+  nb_wires = 0;
+  for(uint32 s=0; s<nb_gates; ++s) {
+    provsqlGate gate = *provsql_gate(s);
+
+    if(!(keep[s / BITS_PER_BYTE] & (1 << (s % BITS_PER_BYTE)))) {
+      dshash_delete_key(provsql_hash, &gate.token);
+      continue;
+    }
+
+    if(gate.nb_children > 0 || gate.extra_len > 0) {
+      uint32 *children = (uint32 *) dsa_get_address(provsql_area, gate.children);
+      uint32 nb_words = provsql_nb_words(gate.nb_children, gate.extra_len);
+
+      for(unsigned i=0; i<gate.nb_children; ++i)
+        wires[nb_wires + i] = new_slot[children[i]];
+      memcpy(&wires[nb_wires + gate.nb_children], &children[gate.nb_children],
+             (nb_words - gate.nb_children) * sizeof(uint32));
+      gate.children = wires_ptr + nb_wires * sizeof(uint32);
+      nb_wires += nb_words;
+    }
+
+    if(new_slot[s] != s) {
+      provsqlHashEntry *entry = (provsqlHashEntry *) dshash_find(provsql_hash, &gate.token, true);
+
+      // Gates of the base index are handled below
+      if(entry) {
+        entry->slot = new_slot[s];
+        dshash_release_lock(provsql_hash, entry);
+      }
+    }
+
+    *provsql_gate(new_slot[s]) = gate;
+  }
+
+  // The base index remains sorted when freed gates are removed from it
+  if(provsql_shared_state->nb_base > 0) {
+    provsqlBaseEntry *base = (provsqlBaseEntry *) dsa_get_address(provsql_area, provsql_shared_state->base_index);
+    uint32 nb_base = 0;
+
+    for(uint32 i=0; i<provsql_shared_state->nb_base; ++i) {
+      uint32 s = base[i].slot;
+
+      if(keep[s / BITS_PER_BYTE] & (1 << (s % BITS_PER_BYTE))) {
+        base[nb_base].token = base[i].token;
+        base[nb_base].slot = new_slot[s];
+        ++nb_base;
+      }
+    }
+    provsql_shared_state->nb_base = nb_base;
+  }
+
+  // Old wires are freed, the new chunk becomes the current one
+  for(uint32 i=0; i<nb_wire_chunks; ++i) {
+    if(provsql_shared_state->wire_chunks[i].ptr != InvalidDsaPointer)
+      dsa_free(provsql_area, provsql_shared_state->wire_chunks[i].ptr);
+    provsql_shared_state->wire_chunks[i].ptr = InvalidDsaPointer;
+    provsql_shared_state->wire_chunks[i].size = 0;
+  }
+  provsql_shared_state->wire_chunks[0].ptr = wires_ptr;
+  provsql_shared_state->wire_chunks[0].size = wires_size;
+  pg_atomic_write_u64(&provsql_shared_state->wires, nb_wires);
+
+  // So are chunks of gates that are not needed anymore
+  nb_new_gate_chunks = (nb_kept + PROVSQL_GATES_PER_CHUNK - 1) / PROVSQL_GATES_PER_CHUNK;
+  for(uint32 i=nb_new_gate_chunks; i<nb_old_gate_chunks; ++i) {
+    dsa_free(provsql_area, provsql_shared_state->gate_chunks[i]);
+    provsql_shared_state->gate_chunks[i] = InvalidDsaPointer;
+  }
+  pg_atomic_write_u32(&provsql_shared_state->nb_gates, nb_kept);
+  for(int i=0; i<=nb_gate_types; ++i)
+    pg_atomic_write_u64(&provsql_shared_state->stats.gates[i], count[i]);
+  pg_atomic_write_u64(&provsql_shared_state->stats.wires, nb_children);
+
+  // The log refers to freed gates, a new snapshot is needed
+  provsql_shared_state->logged_gates = 0;
+  provsql_shared_state->checkpoint_needed = true;
+
+  // Other processes must map chunks of gates again
+  pg_atomic_fetch_add_u32(&provsql_shared_state->generation, 1);
+  provsql_nb_gate_chunks = 0;
+  if(provsql_gate_chunks) {
+    pfree(provsql_gate_chunks);
+    provsql_gate_chunks = NULL;
+  }
+
+  dsa_trim(provsql_area);
+
+  pfree(new_slot);
+
+  return nb_gates - nb_kept;
+}
+
+/* Index of a provenance_gate enum value in gate_type, -1 if none */
+static int provsql_gate_type_index(const constants_t *constants, Oid type)
+{
+  for(int i=0; i<nb_gate_types; ++i)
+    if(constants->GATE_TYPE_TO_OID[i]==type)
+      return i;
+
+  return -1;
+}
+
+/* Defines the gate of a token, entering it if needed, unless it is
+ * already defined, in which case it is left untouched. The probability
+ * of zero and one gates is always 0 and 1, the one given (NAN for none)
+ * is used for other gates. The caller holds the partition lock of the
+ * token exclusively. Returns an error message if the store is full,
+ * NULL otherwise. */
+static const char *provsql_define_gate(pg_uuid_t *token, int gtype, int nb_children, const uint32 *children_slots,
+                                       double prob, unsigned info1, unsigned info2, const void *extra, unsigned extra_len)
+{
+  provsqlGate *gate;
+  uint32 slot;
+  bool found;
+
+  if(!provsql_enter_gate(token, &slot, &found))
+    return "Too many gates in in-memory circuit";
+
+  gate = provsql_gate(slot);
+
+  if(gate->type == PROVSQL_GATE_UNDEFINED) {
+    uint32 nb_words = provsql_nb_words(nb_children, extra_len);
+
+    gate->nb_children = nb_children;
+    gate->children = InvalidDsaPointer;
+    gate->extra_len = 0;
+
+    if(nb_words) {
+      uint32 *words;
+
+      if(!provsql_reserve_wires(nb_words, &gate->children)) {
+        gate->nb_children = 0;
+        return "Too many wires in in-memory circuit";
+      }
+
+      words = (uint32 *) dsa_get_address(provsql_area, gate->children);
+      if(nb_children)
+        memcpy(words, children_slots, nb_children * sizeof(uint32));
+      if(extra_len) {
+        // The last word is padded with zeros
+        words[nb_words - 1] = 0;
+        memcpy(&words[nb_children], extra, extra_len);
+        gate->extra_len = extra_len;
+      }
+    }
+
+    if(gtype == gate_zero)
+      gate->prob = 0.;
+    else if(gtype == gate_one)
+      gate->prob = 1.;
+    else
+      gate->prob = prob;
+
+    gate->info1 = info1;
+    gate->info2 = info2;
+
+    // Publish the gate to lock-free readers
+    pg_write_barrier();
+    gate->type = gtype;
+
+    provsql_count_gates(PROVSQL_GATE_UNDEFINED, -1, 0);
+    provsql_count_gates(gtype, 1, nb_children);
+    provsql_log_change(slot);
+    pg_atomic_fetch_add_u64(&provsql_shared_state->stats.create_gate_inserts, 1);
+  } else {
+    provsql_touch_gate(gate);
+    pg_atomic_fetch_add_u64(&provsql_shared_state->stats.create_gate_hits, 1);
+  }
+
+  return NULL;
+}
+
+/* Orders the elements of a batch of tokens by partition, given the
+ * hash values of the tokens, so that each partition lock is taken once
+ * per batch; elements of partition p are order[start[p]] to
+ * order[start[p+1]-1] */
+static int *provsql_order_by_partition(const uint32 *hashcodes, const bool *skip, int nb, int start[PROVSQL_NUM_PARTITIONS + 1])
+{
+  int *order = palloc(Max(nb, 1) * sizeof(int));
+  int next[PROVSQL_NUM_PARTITIONS];
+
+  memset(start, 0, (PROVSQL_NUM_PARTITIONS + 1) * sizeof(int));
+  for(int i=0; i<nb; ++i)
+    if(!skip[i])
+      ++start[hashcodes[i] % PROVSQL_NUM_PARTITIONS + 1];
+
+  for(int p=0; p<PROVSQL_NUM_PARTITIONS; ++p) {
+    start[p + 1] += start[p];
+    next[p] = start[p];
+  }
+
+  for(int i=0; i<nb; ++i)
+    if(!skip[i])
+      order[next[hashcodes[i] % PROVSQL_NUM_PARTITIONS]++] = i;
+
+  return order;
+}
+
+/* Allocates the memory for the gates of a snapshot read into an empty
+ * store: the gate chunks of the first nb_gates slots, the base index,
+ * and a chunk of wires. The caller holds all partition locks
+ * exclusively. Returns false if the store is too small. */
+bool provsql_allocate_base(uint32 nb_gates, uint32 nb_wires, dsa_pointer *index, dsa_pointer *wires)
+{
+  Assert(pg_atomic_read_u32(&provsql_shared_state->nb_gates) == 0);
+
+  if(nb_gates > (uint32) provsql_max_nb_gates)
+    return false;
+
+  for(uint32 chunk=0; chunk<(nb_gates + PROVSQL_GATES_PER_CHUNK - 1) / PROVSQL_GATES_PER_CHUNK; ++chunk)
+    if(!provsql_ensure_gate_chunk(chunk))
+      return false;
+
+  *index = dsa_allocate_extended(provsql_area, Max(nb_gates, 1) * sizeof(provsqlBaseEntry), DSA_ALLOC_HUGE | DSA_ALLOC_NO_OOM);
+  if(*index == InvalidDsaPointer)
+    return false;
+
+  *wires = dsa_allocate_extended(provsql_area, (Size) Max(nb_wires, PROVSQL_WIRES_PER_CHUNK) * sizeof(uint32), DSA_ALLOC_HUGE | DSA_ALLOC_NO_OOM);
+  if(*wires == InvalidDsaPointer) {
+    dsa_free(provsql_area, *index);
+    return false;
+  }
+
+  return true;
+}
+
+/* Makes the gates of a snapshot, filled in the memory allocated by
+ * provsql_allocate_base, part of the store. The base index and wires
+ * it replaces may be in use by provsql_find_base in other processes:
+ * all access locks must be held exclusively. */
+void provsql_install_base(uint32 nb_gates, uint32 nb_wires, dsa_pointer index, dsa_pointer wires)
+{
+  uint64 current = pg_atomic_read_u64(&provsql_shared_state->wires);
+
+  // An empty store has at most one chunk of wires, with no wire used
+  if(provsql_shared_state->wire_chunks[current >> 32].ptr != InvalidDsaPointer)
+    dsa_free(provsql_area, provsql_shared_state->wire_chunks[current >> 32].ptr);
+
+  provsql_shared_state->wire_chunks[0].ptr = wires;
+  provsql_shared_state->wire_chunks[0].size = Max(nb_wires, PROVSQL_WIRES_PER_CHUNK);
+  pg_atomic_write_u64(&provsql_shared_state->wires, nb_wires);
+
+  // The base index of a store emptied by vacuum_circuit is replaced
+  if(provsql_shared_state->base_index != InvalidDsaPointer)
+    dsa_free(provsql_area, provsql_shared_state->base_index);
+  provsql_shared_state->base_index = index;
+  provsql_shared_state->nb_base = nb_gates;
+
+  pg_write_barrier();
+  pg_atomic_write_u32(&provsql_shared_state->nb_gates, nb_gates);
+}
+
+/* Fast paths of gate creation: gates are immutable once created, and
+ * most calls come from provenance_times/plus/... re-deriving tokens
+ * that already exist, often several times in the same query, so the
+ * local cache, or else a shared lookup, is enough to find out there is
+ * nothing to do. Returns true if the gate of the token is defined. */
+static bool provsql_gate_defined(pg_uuid_t *token, uint32 hashcode)
+{
+  uint32 slot;
+  bool result = false;
+
+  if(provsql_gate_cache_lookup(token, hashcode))
+    return true;
+
+  provsql_store_acquire();
+
+  if(provsql_find_gate(token, &slot) && provsql_gate(slot)->type != PROVSQL_GATE_UNDEFINED) {
+    provsql_touch_gate(provsql_gate(slot));
+    provsql_gate_cache_insert(token, hashcode);
+    result = true;
+  }
+
+  provsql_store_release();
+
+  return result;
+}
+
+/* Slow path of gate creation, see provsql_create_gate */
+static void provsql_create_gate_internal(pg_uuid_t *token, uint32 hashcode, gate_type gtype, int nb_children, const pg_uuid_t *children,
+                                         unsigned info1, unsigned info2, const void *extra, unsigned extra_len)
+{
+  uint32 *children_slots = NULL;
+  LWLock *partition_lock;
+  const char *error;
+
+  provsql_store_acquire();
+
+  // Children are looked up (and inserted if needed) one by one, each
+  // under its own partition lock, so that at most one partition lock is
+  // held at any time
+  if(nb_children) {
+    children_slots = palloc(nb_children * sizeof(uint32));
+    for(int i=0; i<nb_children; ++i)
+      children_slots[i] = provsql_get_slot((pg_uuid_t *) &children[i], false);
+  }
+
+  partition_lock = provsql_partition_lock(hashcode);
+  provsql_lock(partition_lock, LW_EXCLUSIVE);
+
+  // Another backend may have created the gate in the meantime, in
+  // which case it is left untouched
+  error = provsql_define_gate(token, gtype, nb_children, children_slots, NAN, info1, info2, extra, extra_len);
+
+  LWLockRelease(partition_lock);
+
+  if(error)
+    elog(ERROR, "%s", error);
+
+  provsql_gate_cache_insert(token, hashcode);
+
+  provsql_store_release();
+
+  if(children_slots)
+    pfree(children_slots);
+}
+
+/* Creates the gate of a token, of type gtype and with the given
+ * children, unless it is already defined; this is the entry point for
+ * gate creation from C code, see provenance_gates.c */
+void provsql_create_gate(pg_uuid_t *token, gate_type gtype, int nb_children, const pg_uuid_t *children)
+{
+  provsql_create_gate_extra(token, gtype, nb_children, children, 0, 0, NULL, 0);
+}
+
+/* Same, with the infos and the extra data of the gate, set atomically
+ * with its creation: these are part of the gate, as are its children,
+ * and readers of a defined gate always find them */
+void provsql_create_gate_extra(pg_uuid_t *token, gate_type gtype, int nb_children, const pg_uuid_t *children,
+                               unsigned info1, unsigned info2, const void *extra, unsigned extra_len)
+{
+  uint32 hashcode = provsql_token_hash(token);
+
+  if(!provsql_gate_defined(token, hashcode))
+    provsql_create_gate_internal(token, hashcode, gtype, nb_children, children, info1, info2, extra, extra_len);
 }
 
 PG_FUNCTION_INFO_V1(create_gate);
 Datum create_gate(PG_FUNCTION_ARGS)
 {
   pg_uuid_t *token = DatumGetUUIDP(PG_GETARG_DATUM(0));
-  gate_type type = (gate_type) PG_GETARG_INT32(1);
+  Oid type = PG_GETARG_OID(1);
   ArrayType *children = PG_ARGISNULL(2)?NULL:PG_GETARG_ARRAYTYPE_P(2);
   int nb_children = 0;
-  provsqlHashEntry *entry;
-  bool found;
+  uint32 hashcode;
+  constants_t constants;
+  int gtype;
 
   if(PG_ARGISNULL(0) || PG_ARGISNULL(1))
     elog(ERROR, "Invalid NULL value passed to create_gate");
@@ -173,57 +1020,159 @@ Datum create_gate(PG_FUNCTION_ARGS)
       nb_children = *ARR_DIMS(children);
   }
 
-  LWLockAcquire(provsql_shared_state->lock, LW_EXCLUSIVE);
+  hashcode = provsql_token_hash(token);
+  if(provsql_gate_defined(token, hashcode))
+    PG_RETURN_VOID();
 
-  if(hash_get_num_entries(provsql_hash) == provsql_max_nb_gates) {
-    LWLockRelease(provsql_shared_state->lock);
-    elog(ERROR, "Too many gates in in-memory circuit");
+  // Resolve the gate type only now, since this requires catalog lookups
+  constants=initialize_constants(true);
+  gtype = provsql_gate_type_index(&constants, type);
+  if(gtype == -1)
+    elog(ERROR, "Invalid gate type");
+
+  provsql_create_gate_internal(token, hashcode, gtype, nb_children,
+                               nb_children ? (pg_uuid_t *) ARR_DATA_PTR(children) : NULL, 0, 0, NULL, 0);
+
+  PG_RETURN_VOID();
+}
+
+/* Creates a batch of gates: the gate of tokens[i] has type gtypes[i],
+ * and its children are the non-NULL elements of
+ * children[i*width..(i+1)*width-1]; its probability and info1 are
+ * probs[i] and infos[i], unless these arrays are NULL. The store is
+ * acquired once, and each partition lock is taken once for the whole
+ * batch. */
+void provsql_create_gates(int nb_gates, Datum *tokens, const int *gtypes, Datum *children, const bool *children_nulls, int width,
+                          const double *probs, const unsigned *infos)
+{
+  uint32 *hashcodes;
+  bool *skip;
+  uint32 *children_slots;
+  int *nb_children_slots;
+  int *order;
+  int start[PROVSQL_NUM_PARTITIONS + 1];
+  const char *error = NULL;
+
+  hashcodes = palloc(Max(nb_gates, 1) * sizeof(uint32));
+  skip = palloc0(Max(nb_gates, 1) * sizeof(bool));
+  for(int i=0; i<nb_gates; ++i) {
+    hashcodes[i] = provsql_token_hash(DatumGetUUIDP(tokens[i]));
+    skip[i] = provsql_gate_cache_lookup(DatumGetUUIDP(tokens[i]), hashcodes[i]);
   }
 
-  entry = (provsqlHashEntry *) hash_search(provsql_hash, token, HASH_ENTER, &found);
+  nb_children_slots = palloc0(Max(nb_gates, 1) * sizeof(int));
+  children_slots = palloc(Max(nb_gates * width, 1) * sizeof(uint32));
 
-  if(!found) {
-    constants_t constants=initialize_constants(true);
+  provsql_store_acquire();
 
-    if(nb_children && provsql_shared_state->nb_wires + nb_children > provsql_max_nb_gates * provsql_avg_nb_wires) {
-      LWLockRelease(provsql_shared_state->lock);
-      elog(ERROR, "Too many wires in in-memory circuit");
-    }
+  // As in create_gate, gates already defined are skipped under the
+  // shared lock only, and children are entered one by one before any
+  // gate of the batch is defined
+  for(int i=0; i<nb_gates; ++i) {
+    uint32 slot;
 
-    entry->type = -1;
-    for(int i=0; i<nb_gate_types; ++i) {
-      if(constants.GATE_TYPE_TO_OID[i]==type) {
-        entry->type = i;
-        break;
-      }
+    if(skip[i])
+      continue;
+
+    if(provsql_find_gate(DatumGetUUIDP(tokens[i]), &slot) && provsql_gate(slot)->type != PROVSQL_GATE_UNDEFINED) {
+      provsql_touch_gate(provsql_gate(slot));
+      provsql_gate_cache_insert(DatumGetUUIDP(tokens[i]), hashcodes[i]);
+      skip[i] = true;
+      continue;
     }
-    if(entry->type == -1)
-      elog(ERROR, "Invalid gate type");
 
-    entry->nb_children = nb_children;
-    entry->children_idx = provsql_shared_state->nb_wires;
+    for(int j=0; j<width; ++j)
+      if(!children_nulls[i * width + j])
+        children_slots[i * width + nb_children_slots[i]++] =
+          provsql_get_slot(DatumGetUUIDP(children[i * width + j]), false);
+  }
 
-    if(nb_children) {
-      pg_uuid_t *data = (pg_uuid_t*) ARR_DATA_PTR(children);
+  order = provsql_order_by_partition(hashcodes, skip, nb_gates, start);
 
-      for(int i=0; i<nb_children; ++i) {
-        provsql_shared_state->wires[entry->children_idx + i] = data[i];
-      }
+  for(int p=0; p<PROVSQL_NUM_PARTITIONS && !error; ++p) {
+    LWLock *partition_lock = provsql_shared_state->partition_locks[p];
+
+    if(start[p] == start[p + 1])
+      continue;
 
-      provsql_shared_state->nb_wires += nb_children;
+    provsql_lock(partition_lock, LW_EXCLUSIVE);
+    for(int k=start[p]; k<start[p + 1] && !error; ++k) {
+      int i = order[k];
+
+      error = provsql_define_gate(DatumGetUUIDP(tokens[i]), gtypes[i], nb_children_slots[i],
+                                  children_slots + i * width,
+                                  probs ? probs[i] : NAN, infos ? infos[i] : 0, 0, NULL, 0);
+      if(!error)
+        provsql_gate_cache_insert(DatumGetUUIDP(tokens[i]), hashcodes[i]);
     }
+    LWLockRelease(partition_lock);
+  }
 
-    if(entry->type == gate_zero)
-      entry->prob = 0.;
-    else if(entry->type == gate_one)
-      entry->prob = 1.;
-    else
-      entry->prob = NAN;
+  if(error)
+    elog(ERROR, "%s", error);
+
+  provsql_store_release();
+
+  pfree(order);
+  pfree(children_slots);
+  pfree(nb_children_slots);
+  pfree(skip);
+  pfree(hashcodes);
+}
+
+/* Batched version of create_gate: creates the gates tokens[i] of types
+ * types[i], whose children are the non-NULL elements of the i-th row of
+ * the two-dimensional array children (NULL if no gate has children).
+ * Type OIDs are resolved once for the whole batch. */
+PG_FUNCTION_INFO_V1(create_gates);
+Datum create_gates(PG_FUNCTION_ARGS)
+{
+  Datum *tokens, *types, *children = NULL;
+  bool *tokens_nulls, *types_nulls, *children_nulls = NULL;
+  int nb_gates, nb_types, nb_children = 0, width = 0;
+  int *gtypes;
+  constants_t constants;
+
+  if(PG_ARGISNULL(0) || PG_ARGISNULL(1))
+    elog(ERROR, "Invalid NULL value passed to create_gates");
+
+  constants=initialize_constants(true);
+
+  deconstruct_array(PG_GETARG_ARRAYTYPE_P(0), constants.OID_TYPE_UUID, UUID_LEN, false, 'c',
+                    &tokens, &tokens_nulls, &nb_gates);
+  deconstruct_array(PG_GETARG_ARRAYTYPE_P(1), constants.OID_TYPE_GATE_TYPE, sizeof(Oid), true, 'i',
+                    &types, &types_nulls, &nb_types);
+
+  if(nb_types != nb_gates)
+    elog(ERROR, "Arrays of different lengths passed to create_gates");
+
+  if(!PG_ARGISNULL(2)) {
+    ArrayType *children_array = PG_GETARG_ARRAYTYPE_P(2);
 
-    entry->info1 = entry->info2 = 0;
+    if(ARR_NDIM(children_array) == 2) {
+      if(ARR_DIMS(children_array)[0] != nb_gates)
+        elog(ERROR, "Arrays of different lengths passed to create_gates");
+      width = ARR_DIMS(children_array)[1];
+    } else if(ARR_NDIM(children_array) != 0)
+      elog(ERROR, "Invalid children array passed to create_gates");
+
+    deconstruct_array(children_array, constants.OID_TYPE_UUID, UUID_LEN, false, 'c',
+                      &children, &children_nulls, &nb_children);
+  }
+
+  gtypes = palloc(Max(nb_gates, 1) * sizeof(int));
+  for(int i=0; i<nb_gates; ++i) {
+    if(tokens_nulls[i] || types_nulls[i])
+      elog(ERROR, "Invalid NULL value passed to create_gates");
+
+    gtypes[i] = provsql_gate_type_index(&constants, DatumGetObjectId(types[i]));
+    if(gtypes[i] == -1)
+      elog(ERROR, "Invalid gate type");
   }
 
-  LWLockRelease(provsql_shared_state->lock);
+  provsql_create_gates(nb_gates, tokens, gtypes, children, children_nulls, width, NULL, NULL);
+
+  pfree(gtypes);
 
   PG_RETURN_VOID();
 }
@@ -233,71 +1182,172 @@ Datum set_prob(PG_FUNCTION_ARGS)
 {
   pg_uuid_t *token = DatumGetUUIDP(PG_GETARG_DATUM(0));
   double prob = PG_GETARG_FLOAT8(1);
-  provsqlHashEntry *entry;
-  bool found;
+  provsqlGate *gate;
+  uint32 slot;
+  LWLock *partition_lock;
 
   if(PG_ARGISNULL(0) || PG_ARGISNULL(1))
     elog(ERROR, "Invalid NULL value passed to set_prob");
 
-  LWLockAcquire(provsql_shared_state->lock, LW_EXCLUSIVE);
+  provsql_store_acquire();
 
-  entry = (provsqlHashEntry *) hash_search(provsql_hash, token, HASH_ENTER, &found);
+  partition_lock = provsql_partition_lock(provsql_token_hash(token));
 
-  if(!found) {
-    hash_search(provsql_hash, token, HASH_REMOVE, &found);
-    LWLockRelease(provsql_shared_state->lock);
+  provsql_lock(partition_lock, LW_EXCLUSIVE);
+
+  if(!provsql_find_gate(token, &slot) || provsql_gate(slot)->type == PROVSQL_GATE_UNDEFINED) {
+    LWLockRelease(partition_lock);
     elog(ERROR, "Unknown gate");
   }
 
-  if(entry->type != gate_input && entry->type != gate_mulinput) {
-    LWLockRelease(provsql_shared_state->lock);
+  gate = provsql_gate(slot);
+
+  if(gate->type != gate_input && gate->type != gate_mulinput) {
+    LWLockRelease(partition_lock);
     elog(ERROR, "Probability can only be assigned to input token");
   }
 
-  entry->prob = prob;
+  gate->prob = prob;
+  provsql_log_change(slot);
+
+  LWLockRelease(partition_lock);
 
-  LWLockRelease(provsql_shared_state->lock);
+  provsql_store_release();
 
   PG_RETURN_VOID();
 }
 
-PG_FUNCTION_INFO_V1(set_infos);
-Datum set_infos(PG_FUNCTION_ARGS)
+/* Batched version of set_prob, taking each partition lock once. All
+ * tokens are checked before any probability is modified. */
+PG_FUNCTION_INFO_V1(set_probs);
+Datum set_probs(PG_FUNCTION_ARGS)
 {
-  pg_uuid_t *token = DatumGetUUIDP(PG_GETARG_DATUM(0));
-  unsigned info1 = PG_GETARG_INT32(1);
-  unsigned info2 = PG_GETARG_INT32(2);
-  provsqlHashEntry *entry;
-  bool found;
+  Datum *tokens, *probs;
+  bool *tokens_nulls, *probs_nulls;
+  int nb_tokens, nb_probs;
+  uint32 *hashcodes;
+  int *order;
+  int start[PROVSQL_NUM_PARTITIONS + 1];
+  constants_t constants;
+  const char *error = NULL;
 
   if(PG_ARGISNULL(0) || PG_ARGISNULL(1))
-    elog(ERROR, "Invalid NULL value passed to set_infos");
+    elog(ERROR, "Invalid NULL value passed to set_probs");
 
-  LWLockAcquire(provsql_shared_state->lock, LW_EXCLUSIVE);
+  constants=initialize_constants(true);
 
-  entry = (provsqlHashEntry *) hash_search(provsql_hash, token, HASH_ENTER, &found);
+  deconstruct_array(PG_GETARG_ARRAYTYPE_P(0), constants.OID_TYPE_UUID, UUID_LEN, false, 'c',
+                    &tokens, &tokens_nulls, &nb_tokens);
+  deconstruct_array(PG_GETARG_ARRAYTYPE_P(1), constants.OID_TYPE_FLOAT, sizeof(float8), FLOAT8PASSBYVAL, 'd',
+                    &probs, &probs_nulls, &nb_probs);
 
-  if(!found) {
-    hash_search(provsql_hash, token, HASH_REMOVE, &found);
-    LWLockRelease(provsql_shared_state->lock);
+  if(nb_probs != nb_tokens)
+    elog(ERROR, "Arrays of different lengths passed to set_probs");
+
+  hashcodes = palloc(Max(nb_tokens, 1) * sizeof(uint32));
+  for(int i=0; i<nb_tokens; ++i) {
+    if(tokens_nulls[i] || probs_nulls[i])
+      elog(ERROR, "Invalid NULL value passed to set_probs");
+    hashcodes[i] = provsql_token_hash(DatumGetUUIDP(tokens[i]));
+  }
+
+  provsql_store_acquire();
+
+  order = provsql_order_by_partition(hashcodes, tokens_nulls, nb_tokens, start);
+
+  // Gates are checked under the shared lock: they cannot disappear or
+  // change type before the store is released
+  for(int i=0; i<nb_tokens && !error; ++i) {
+    uint32 slot;
+    gate_type type;
+
+    if(!provsql_find_gate(DatumGetUUIDP(tokens[i]), &slot) ||
+       (type = provsql_gate(slot)->type) == PROVSQL_GATE_UNDEFINED)
+      error = "Unknown gate";
+    else if(type != gate_input && type != gate_mulinput)
+      error = "Probability can only be assigned to input token";
+  }
+
+  if(error) {
+    provsql_store_release();
+    elog(ERROR, "%s", error);
+  }
+
+  for(int p=0; p<PROVSQL_NUM_PARTITIONS; ++p) {
+    LWLock *partition_lock = provsql_shared_state->partition_locks[p];
+
+    if(start[p] == start[p + 1])
+      continue;
+
+    provsql_lock(partition_lock, LW_EXCLUSIVE);
+    for(int k=start[p]; k<start[p + 1]; ++k) {
+      int i = order[k];
+      uint32 slot;
+
+      provsql_find_gate(DatumGetUUIDP(tokens[i]), &slot);
+      provsql_gate(slot)->prob = DatumGetFloat8(probs[i]);
+      provsql_log_change(slot);
+    }
+    LWLockRelease(partition_lock);
+  }
+
+  provsql_store_release();
+
+  pfree(order);
+  pfree(hashcodes);
+
+  PG_RETURN_VOID();
+}
+
+/* Sets the infos of an eq or mulinput gate; info2, only used by eq
+ * gates, cannot be missing for them */
+void provsql_set_infos(pg_uuid_t *token, unsigned info1, unsigned info2, bool info2_missing)
+{
+  provsqlGate *gate;
+  uint32 slot;
+  LWLock *partition_lock;
+
+  provsql_store_acquire();
+
+  partition_lock = provsql_partition_lock(provsql_token_hash(token));
+
+  provsql_lock(partition_lock, LW_EXCLUSIVE);
+
+  if(!provsql_find_gate(token, &slot) || provsql_gate(slot)->type == PROVSQL_GATE_UNDEFINED) {
+    LWLockRelease(partition_lock);
     elog(ERROR, "Unknown gate");
   }
 
-  if(entry->type == gate_eq && PG_ARGISNULL(2)) {
-    LWLockRelease(provsql_shared_state->lock);
+  gate = provsql_gate(slot);
+
+  if(gate->type == gate_eq && info2_missing) {
+    LWLockRelease(partition_lock);
     elog(ERROR, "Invalid NULL value passed to set_infos");
   }
 
-  if(entry->type != gate_eq && entry->type != gate_mulinput) {
-    LWLockRelease(provsql_shared_state->lock);
+  if(gate->type != gate_eq && gate->type != gate_mulinput) {
+    LWLockRelease(partition_lock);
     elog(ERROR, "Infos cannot be assigned to this gate type");
   }
 
-  entry->info1 = info1;
-  if(entry->type == gate_eq)
-    entry->info2 = info2;
+  gate->info1 = info1;
+  if(gate->type == gate_eq)
+    gate->info2 = info2;
+  provsql_log_change(slot);
+
+  LWLockRelease(partition_lock);
+
+  provsql_store_release();
+}
+
+PG_FUNCTION_INFO_V1(set_infos);
+Datum set_infos(PG_FUNCTION_ARGS)
+{
+  if(PG_ARGISNULL(0) || PG_ARGISNULL(1))
+    elog(ERROR, "Invalid NULL value passed to set_infos");
 
-  LWLockRelease(provsql_shared_state->lock);
+  provsql_set_infos(DatumGetUUIDP(PG_GETARG_DATUM(0)), PG_GETARG_INT32(1),
+                    PG_ARGISNULL(2) ? 0 : PG_GETARG_INT32(2), PG_ARGISNULL(2));
 
   PG_RETURN_VOID();
 }
@@ -306,22 +1356,22 @@ PG_FUNCTION_INFO_V1(get_gate_type);
 Datum get_gate_type(PG_FUNCTION_ARGS)
 {
   pg_uuid_t *token = DatumGetUUIDP(PG_GETARG_DATUM(0));
-  provsqlHashEntry *entry;
-  bool found;
-  gate_type result = -1;
+  uint32 slot;
+  gate_type result;
 
   if(PG_ARGISNULL(0))
     PG_RETURN_NULL();
 
-  LWLockAcquire(provsql_shared_state->lock, LW_SHARED);
+  provsql_store_acquire();
 
-  entry = (provsqlHashEntry *) hash_search(provsql_hash, token, HASH_FIND, &found);
-  if(found)
-    result = entry->type;
+  if(provsql_find_gate(token, &slot))
+    result = provsql_gate(slot)->type;
+  else
+    result = PROVSQL_GATE_UNDEFINED;
 
-  LWLockRelease(provsql_shared_state->lock);
+  provsql_store_release();
 
-  if(!found)
+  if(result == PROVSQL_GATE_UNDEFINED)
     PG_RETURN_NULL();
   else {
     constants_t constants=initialize_constants(true);
@@ -333,58 +1383,71 @@ PG_FUNCTION_INFO_V1(get_children);
 Datum get_children(PG_FUNCTION_ARGS)
 {
   pg_uuid_t *token = DatumGetUUIDP(PG_GETARG_DATUM(0));
-  provsqlHashEntry *entry;
-  bool found;
+  uint32 slot;
+  provsqlGate gate;
   ArrayType *result = NULL;
+  Datum *children_ptr;
+  uint32 *children;
+  constants_t constants;
 
   if(PG_ARGISNULL(0))
     PG_RETURN_NULL();
 
-  LWLockAcquire(provsql_shared_state->lock, LW_SHARED);
+  constants=initialize_constants(true);
 
-  entry = (provsqlHashEntry *) hash_search(provsql_hash, token, HASH_FIND, &found);
-  if(found) {
-    Datum *children_ptr = palloc(entry->nb_children * sizeof(Datum));
-    constants_t constants=initialize_constants(true);
-    for(int i=0; i<entry->nb_children; ++i) {
-      children_ptr[i] = UUIDPGetDatum(&provsql_shared_state->wires[entry->children_idx + i]);
-    }
-    result = construct_array(
-      children_ptr,
-      entry->nb_children,
-      constants.OID_TYPE_UUID,
-      16,
-      false,
-      'c');
-    pfree(children_ptr);
+  provsql_store_acquire();
+
+  if(!provsql_find_gate(token, &slot) ||
+     provsql_read_gate(slot, &gate) == PROVSQL_GATE_UNDEFINED) {
+    provsql_store_release();
+    PG_RETURN_NULL();
   }
 
-  LWLockRelease(provsql_shared_state->lock);
+  // Children are followed by their slot, no further hash lookup needed
+  children = provsql_children(&gate);
+  children_ptr = palloc(gate.nb_children * sizeof(Datum));
+  for(int i=0; i<gate.nb_children; ++i) {
+    children_ptr[i] = UUIDPGetDatum(&provsql_gate(children[i])->token);
+  }
 
-  if(!found)
-    PG_RETURN_NULL();
-  else
-    PG_RETURN_ARRAYTYPE_P(result);
+  // Tokens are copied out of the store before it is released
+  result = construct_array(
+    children_ptr,
+    gate.nb_children,
+    constants.OID_TYPE_UUID,
+    16,
+    false,
+    'c');
+
+  provsql_store_release();
+
+  pfree(children_ptr);
+  PG_RETURN_ARRAYTYPE_P(result);
 }
 
 PG_FUNCTION_INFO_V1(get_prob);
 Datum get_prob(PG_FUNCTION_ARGS)
 {
   pg_uuid_t *token = DatumGetUUIDP(PG_GETARG_DATUM(0));
-  provsqlHashEntry *entry;
-  bool found;
+  uint32 slot;
+  LWLock *partition_lock;
   double result = NAN;
 
   if(PG_ARGISNULL(0))
     PG_RETURN_NULL();
 
-  LWLockAcquire(provsql_shared_state->lock, LW_SHARED);
+  provsql_store_acquire();
+
+  partition_lock = provsql_partition_lock(provsql_token_hash(token));
 
-  entry = (provsqlHashEntry *) hash_search(provsql_hash, token, HASH_FIND, &found);
-  if(found)
-    result = entry->prob;
+  provsql_lock(partition_lock, LW_SHARED);
 
-  LWLockRelease(provsql_shared_state->lock);
+  if(provsql_find_gate(token, &slot))
+    result = provsql_gate(slot)->prob;
+
+  LWLockRelease(partition_lock);
+
+  provsql_store_release();
 
   if(isnan(result))
     PG_RETURN_NULL();
@@ -396,22 +1459,30 @@ PG_FUNCTION_INFO_V1(get_infos);
 Datum get_infos(PG_FUNCTION_ARGS)
 {
   pg_uuid_t *token = DatumGetUUIDP(PG_GETARG_DATUM(0));
-  provsqlHashEntry *entry;
-  bool found;
+  uint32 slot;
+  LWLock *partition_lock;
   unsigned info1 =0, info2 = 0;
+  gate_type type = -1;
 
   if(PG_ARGISNULL(0))
     PG_RETURN_NULL();
 
-  LWLockAcquire(provsql_shared_state->lock, LW_SHARED);
+  provsql_store_acquire();
 
-  entry = (provsqlHashEntry *) hash_search(provsql_hash, token, HASH_FIND, &found);
-  if(found) {
-    info1 = entry->info1;
-    info2 = entry->info2;
+  partition_lock = provsql_partition_lock(provsql_token_hash(token));
+
+  provsql_lock(partition_lock, LW_SHARED);
+
+  if(provsql_find_gate(token, &slot)) {
+    provsqlGate *gate = provsql_gate(slot);
+    info1 = gate->info1;
+    info2 = gate->info2;
+    type = gate->type;
   }
 
-  LWLockRelease(provsql_shared_state->lock);
+  LWLockRelease(partition_lock);
+
+  provsql_store_release();
 
   if(info1 == 0)
     PG_RETURN_NULL();
@@ -425,15 +1496,222 @@ Datum get_infos(PG_FUNCTION_ARGS)
 
     nulls[0] = false;
     values[0] = Int32GetDatum(info1);
-    if(entry->type == gate_eq) {
+    if(type == gate_eq || type == gate_agg) {
       nulls[1] = false;
       values[1] = Int32GetDatum(info2);
     } else
-      nulls[1] = (entry->type != gate_eq);
+      nulls[1] = true;
 
     PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
   }
 }
+
+/* Reads the gate of a token, whose type is PROVSQL_GATE_UNDEFINED if
+ * there is none, and returns a copy of its extra data, NULL if it has
+ * none */
+static char *provsql_read_extra(pg_uuid_t *token, provsqlGate *gate)
+{
+  uint32 slot;
+  char *result = NULL;
+
+  provsql_store_acquire();
+
+  if(!provsql_find_gate(token, &slot))
+    gate->type = PROVSQL_GATE_UNDEFINED;
+  else if(provsql_read_gate(slot, gate) != PROVSQL_GATE_UNDEFINED && gate->extra_len > 0) {
+    result = palloc(gate->extra_len);
+    memcpy(result, provsql_extra(gate), gate->extra_len);
+  }
+
+  provsql_store_release();
+
+  return result;
+}
+
+/* Value of an agg or value gate, stored as a null-terminated string,
+ * the extra data being empty for a NULL value */
+PG_FUNCTION_INFO_V1(get_extra);
+Datum get_extra(PG_FUNCTION_ARGS)
+{
+  provsqlGate gate;
+  char *extra;
+
+  if(PG_ARGISNULL(0))
+    PG_RETURN_NULL();
+
+  extra = provsql_read_extra(DatumGetUUIDP(PG_GETARG_DATUM(0)), &gate);
+  if(extra == NULL || (gate.type != gate_agg && gate.type != gate_value))
+    PG_RETURN_NULL();
+
+  PG_RETURN_TEXT_P(cstring_to_text_with_len(extra, gate.extra_len - 1));
+}
+
+/* Infos of a project or eq gate, as an array of pairs of integers: the
+ * positions of the columns of a projection with their index, the
+ * position being NULL for columns that are not projected, or the two
+ * positions of an equality */
+PG_FUNCTION_INFO_V1(get_extra_infos);
+Datum get_extra_infos(PG_FUNCTION_ARGS)
+{
+  provsqlGate gate;
+  int32 *positions;
+  Datum *values;
+  bool *nulls;
+  int dims[2], lbs[2] = {1, 1};
+  int nb;
+
+  if(PG_ARGISNULL(0))
+    PG_RETURN_NULL();
+
+  positions = (int32 *) provsql_read_extra(DatumGetUUIDP(PG_GETARG_DATUM(0)), &gate);
+
+  if(gate.type == gate_project && positions) {
+    nb = gate.extra_len / sizeof(int32);
+    values = palloc(2 * nb * sizeof(Datum));
+    nulls = palloc(2 * nb * sizeof(bool));
+    for(int i=0; i<nb; ++i) {
+      values[2*i] = Int32GetDatum(positions[i]);
+      nulls[2*i] = (positions[i] == 0);
+      values[2*i+1] = Int32GetDatum(i+1);
+      nulls[2*i+1] = false;
+    }
+  } else if(gate.type == gate_eq) {
+    nb = 1;
+    values = palloc(2 * sizeof(Datum));
+    nulls = palloc0(2 * sizeof(bool));
+    values[0] = Int32GetDatum(gate.info1);
+    values[1] = Int32GetDatum(gate.info2);
+  } else
+    PG_RETURN_NULL();
+
+  dims[0] = nb;
+  dims[1] = 2;
+
+  PG_RETURN_ARRAYTYPE_P(construct_md_array(values, nulls, 2, dims, lbs, INT4OID, sizeof(int32), true, 'i'));
+}
+
+PG_FUNCTION_INFO_V1(gate_cache_stats);
+Datum gate_cache_stats(PG_FUNCTION_ARGS)
+{
+  TupleDesc tupdesc;
+  Datum values[2];
+  bool nulls[2] = {false, false};
+
+  get_call_result_type(fcinfo,NULL,&tupdesc);
+  tupdesc = BlessTupleDesc(tupdesc);
+
+  values[0] = Int64GetDatum(provsql_gate_cache_hits);
+  values[1] = Int64GetDatum(provsql_gate_cache_misses);
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+typedef struct provsqlStatRows
+{
+  int nb;
+  const char *names[2 * nb_probability_methods + nb_gate_types + 32];
+  double values[2 * nb_probability_methods + nb_gate_types + 32];
+} provsqlStatRows;
+
+static void provsql_stat_add(provsqlStatRows *rows, const char *name, double value)
+{
+  Assert(rows->nb < lengthof(rows->names));
+  rows->names[rows->nb] = name;
+  rows->values[rows->nb] = value;
+  ++rows->nb;
+}
+
+/* Size and contents of the store, and cumulative statistics since the
+ * server started, as (name, value) pairs; exposed as the
+ * pg_stat_provsql view. dshash does not expose its number of buckets,
+ * so the fill factor reported is that of the store of gates. */
+static void provsql_stat_collect(provsqlStatRows *rows)
+{
+  constants_t constants = initialize_constants(true);
+  provsqlStats *stats = &provsql_shared_state->stats;
+  uint64 wires_capacity = 0;
+  uint32 nb_gates, nb_base;
+  uint64 hits, inserts;
+
+  provsql_gate_cache_flush_stats();
+
+  // Only counters are read, the store is not scanned, so that the view
+  // can be polled cheaply
+  provsql_store_attach();
+
+  nb_gates = pg_atomic_read_u32(&provsql_shared_state->nb_gates);
+  nb_base = provsql_shared_state->nb_base;
+
+  LWLockAcquire(provsql_shared_state->store_lock, LW_SHARED);
+  for(int i=0; i<PROVSQL_MAX_WIRE_CHUNKS && provsql_shared_state->wire_chunks[i].ptr != InvalidDsaPointer; ++i)
+    wires_capacity += provsql_shared_state->wire_chunks[i].size;
+  LWLockRelease(provsql_shared_state->store_lock);
+
+  provsql_stat_add(rows, "gates", nb_gates);
+  provsql_stat_add(rows, "gates_max", provsql_max_nb_gates);
+  provsql_stat_add(rows, "store_fill_factor", provsql_max_nb_gates ? (double) nb_gates / provsql_max_nb_gates : 0.);
+  for(int i=0; i<nb_gate_types; ++i)
+    provsql_stat_add(rows, psprintf("gates_%s", DatumGetCString(DirectFunctionCall1(enum_out, ObjectIdGetDatum(constants.GATE_TYPE_TO_OID[i])))), pg_atomic_read_u64(&stats->gates[i]));
+  provsql_stat_add(rows, "gates_undefined", pg_atomic_read_u64(&stats->gates[PROVSQL_GATE_UNDEFINED]));
+  provsql_stat_add(rows, "wires", pg_atomic_read_u64(&stats->wires));
+  provsql_stat_add(rows, "wires_capacity", wires_capacity);
+  provsql_stat_add(rows, "hash_entries", nb_gates - nb_base);
+  provsql_stat_add(rows, "base_index_entries", nb_base);
+
+  hits = pg_atomic_read_u64(&stats->create_gate_hits);
+  inserts = pg_atomic_read_u64(&stats->create_gate_inserts);
+  provsql_stat_add(rows, "create_gate_calls", hits + inserts);
+  provsql_stat_add(rows, "create_gate_hits", hits);
+  provsql_stat_add(rows, "create_gate_inserts", inserts);
+  provsql_stat_add(rows, "lock_acquisitions", pg_atomic_read_u64(&stats->lock_acquisitions));
+  provsql_stat_add(rows, "lock_waits", pg_atomic_read_u64(&stats->lock_waits));
+  provsql_stat_add(rows, "lock_wait_time_ms", pg_atomic_read_u64(&stats->lock_wait_time) / 1000.);
+
+  for(int i=0; i<nb_probability_methods; ++i) {
+    provsql_stat_add(rows, psprintf("evaluations_%s", probability_method_names[i]), pg_atomic_read_u64(&stats->evaluations[i]));
+    provsql_stat_add(rows, psprintf("evaluation_time_ms_%s", probability_method_names[i]), pg_atomic_read_u64(&stats->evaluation_time[i]) / 1000.);
+  }
+}
+
+PG_FUNCTION_INFO_V1(stat);
+Datum stat(PG_FUNCTION_ARGS)
+{
+  FuncCallContext *funcctx;
+  provsqlStatRows *rows;
+
+  if(SRF_IS_FIRSTCALL()) {
+    MemoryContext oldcontext;
+    TupleDesc tupdesc;
+
+    funcctx = SRF_FIRSTCALL_INIT();
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+    get_call_result_type(fcinfo, NULL, &tupdesc);
+    funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+    rows = palloc0(sizeof(provsqlStatRows));
+    provsql_stat_collect(rows);
+    funcctx->user_fctx = rows;
+    funcctx->max_calls = rows->nb;
+
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  rows = funcctx->user_fctx;
+
+  if(funcctx->call_cntr < funcctx->max_calls) {
+    Datum values[2];
+    bool nulls[2] = {false, false};
+
+    values[0] = CStringGetTextDatum(rows->names[funcctx->call_cntr]);
+    values[1] = Float8GetDatum(rows->values[funcctx->call_cntr]);
+
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+  } else
+    SRF_RETURN_DONE(funcctx);
+}
+
 void provsql_shmem_request(void)
 {
 #if (PG_VERSION_NUM >= 150000)
@@ -443,10 +1721,79 @@ void provsql_shmem_request(void)
 
   RequestAddinShmemSpace(provsql_memsize());
 
-#if PG_VERSION_NUM >= 90600
-  /* Named lock tranches were added in version 9.6 of PostgreSQL */
-  RequestNamedLWLockTranche("provsql", 1);
-#else
-  RequestAddinLWLocks(1);
-#endif /* PG_VERSION_NUM >= 90600 */
+  // Partition locks, access locks, and the store lock
+  RequestNamedLWLockTranche("provsql", 2 * PROVSQL_NUM_PARTITIONS + 1);
+}
+
+static volatile sig_atomic_t provsql_got_sigterm = false;
+
+static void provsql_worker_sigterm(SIGNAL_ARGS)
+{
+  int save_errno = errno;
+
+  provsql_got_sigterm = true;
+  SetLatch(MyLatch);
+
+  errno = save_errno;
+}
+
+static void provsql_report_flush(int result)
+{
+  switch (result)
+  {
+  case 1:
+    elog(LOG, "Error while opening the file during serialization");
+    break;
+
+  case 2:
+    elog(LOG, "Error while writing to file during serialization");
+    break;
+
+  case 3:
+  case 4:
+    elog(LOG, "Error while closing the file during serialization");
+    break;
+  }
+}
+
+/* The background worker loads the circuit at startup, then regularly
+ * appends the gates created or modified to the log, and does so a last
+ * time when the server shuts down; the circuit is thus persisted up to
+ * the last PROVSQL_LOG_FLUSH_INTERVAL milliseconds in case of crash */
+void provsql_worker_main(Datum main_arg)
+{
+  pqsignal(SIGTERM, provsql_worker_sigterm);
+  BackgroundWorkerUnblockSignals();
+
+  provsql_store_attach();
+
+  while(!provsql_got_sigterm) {
+    int rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, PROVSQL_LOG_FLUSH_INTERVAL, PG_WAIT_EXTENSION);
+
+    ResetLatch(MyLatch);
+
+    if(rc & WL_POSTMASTER_DEATH)
+      proc_exit(1);
+
+    provsql_report_flush(provsql_log_flush());
+  }
+
+  provsql_report_flush(provsql_log_flush());
+
+  proc_exit(0);
+}
+
+void provsql_register_worker(void)
+{
+  BackgroundWorker worker;
+
+  memset(&worker, 0, sizeof(worker));
+  worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+  worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+  worker.bgw_restart_time = 1;
+  snprintf(worker.bgw_library_name, BGW_MAXLEN, "provsql");
+  snprintf(worker.bgw_function_name, BGW_MAXLEN, "provsql_worker_main");
+  snprintf(worker.bgw_name, BGW_MAXLEN, "provsql circuit store");
+  snprintf(worker.bgw_type, BGW_MAXLEN, "provsql circuit store");
+  RegisterBackgroundWorker(&worker);
 }
@@ -4,8 +4,11 @@
 #include "postgres.h"
 #include "miscadmin.h"
 #include "storage/ipc.h"
+#include "port/atomics.h"
 #include "storage/lwlock.h"
-#include "utils/hsearch.h"
+#include "lib/dshash.h"
+#include "utils/dsa.h"
+#include "portability/instr_time.h"
 
 #include "provsql_utils.h"
 
@@ -13,35 +16,277 @@ extern shmem_startup_hook_type prev_shmem_startup;
 #if (PG_VERSION_NUM >= 150000)
 extern shmem_request_hook_type prev_shmem_request;
 #endif
-extern int provsql_init_nb_gates;
 extern int provsql_max_nb_gates;
-extern int provsql_avg_nb_wires;
 
 void provsql_shmem_startup(void);
 Size provsql_memsize(void);
 void provsql_shmem_request(void);
+void provsql_register_worker(void);
+
+/* Number of partitions of the circuit store, each protected by its own
+ * LWLock; must be a power of 2 */
+#define PROVSQL_NUM_PARTITIONS 16
+
+/* Gates are stored in chunks of PROVSQL_GATES_PER_CHUNK gates, and
+ * wires in chunks of at least PROVSQL_WIRES_PER_CHUNK wires, allocated
+ * in provsql_area as the circuit grows */
+#define PROVSQL_GATES_PER_CHUNK (1 << 16)
+#define PROVSQL_MAX_GATE_CHUNKS (1 << 16)
+#define PROVSQL_WIRES_PER_CHUNK (1 << 20)
+#define PROVSQL_MAX_WIRE_CHUNKS (1 << 14)
+
+/* Number of entries of the backend-local cache of tokens of defined
+ * gates, see provsql_gate_cache_lookup; must be a power of 2 */
+#define PROVSQL_GATE_CACHE_SIZE (1 << 12)
+
+/* Size of the beginning of provsql_area, which is placed in the main
+ * shared memory segment; further segments are created on demand */
+#define PROVSQL_AREA_INITIAL_SIZE (1 << 20)
+
+/* Files in which the circuit is persisted: a snapshot of the whole
+ * store, written at each checkpoint, and a log of the gates created or
+ * modified since then, see provsql_log_flush */
+#define PROVSQL_DUMP_FILE "provsql.tmp"
+#define PROVSQL_LOG_FILE "provsql.log"
+
+/* Maximal number of gates modified between two flushes of the log
+ * before a checkpoint is needed, and interval between two flushes */
+#define PROVSQL_LOG_MAX_CHANGES (1 << 16)
+#define PROVSQL_LOG_FLUSH_INTERVAL 1000L
+
+/* The log is replaced by a new snapshot once it is larger than both
+ * this size and the previous snapshot */
+#define PROVSQL_LOG_CHECKPOINT_SIZE (1 << 26)
+
+/* Methods of probability_evaluate, for statistics */
+typedef enum probability_method {
+  probability_method_default, probability_method_independent, probability_method_possible_worlds, probability_method_monte_carlo, probability_method_compilation, probability_method_weightmc, probability_method_tree_decomposition, probability_method_fpras, nb_probability_methods
+} probability_method;
+
+extern const char *probability_method_names[nb_probability_methods];
+
+/* Cumulative statistics of the store, see the stat SQL function; times
+ * are in microseconds */
+typedef struct provsqlStats
+{
+  pg_atomic_uint64 create_gate_hits; // gate already defined
+  pg_atomic_uint64 create_gate_inserts; // gate defined by the call
+  pg_atomic_uint64 lock_acquisitions;
+  pg_atomic_uint64 lock_waits;
+  pg_atomic_uint64 lock_wait_time;
+  pg_atomic_uint64 evaluations[nb_probability_methods];
+  pg_atomic_uint64 evaluation_time[nb_probability_methods];
+  pg_atomic_uint64 gates[nb_gate_types + 1]; // gates in the store by type, the last one being undefined gates, see provsql_count_gates
+  pg_atomic_uint64 wires; // children of the gates in the store
+} provsqlStats;
+
+typedef struct provsqlWireChunk
+{
+  dsa_pointer ptr;
+  uint32 size;
+} provsqlWireChunk;
 
 typedef struct provsqlSharedState
 {
-  LWLock *lock; // protect access to the shared data
-  unsigned nb_wires;
-  pg_uuid_t wires[FLEXIBLE_ARRAY_MEMBER];
+  LWLock *partition_locks[PROVSQL_NUM_PARTITIONS]; // protect each partition of the circuit store
+  LWLock *access_locks[PROVSQL_NUM_PARTITIONS]; // see provsql_store_acquire
+  LWLock *store_lock; // protects initialization of the store and allocation of chunks
+  int area_tranche_id;
+  bool initialized; // provsql_area and provsql_hash have been created
+  bool loaded; // the dump of the circuit has been, or is being, read, see provsql_load
+  dshash_table_handle hash_handle;
+  pg_atomic_uint32 nb_gates; // reserved by compare-and-swap, see provsql_reserve_gate
+  pg_atomic_uint64 wires; // current wire chunk (high 32 bits) and number of wires used in it (low 32 bits), see provsql_reserve_wires
+  pg_atomic_uint32 epoch; // incremented by each run of vacuum_circuit
+  pg_atomic_uint32 generation; // incremented each time gates are moved by vacuum_circuit
+  pg_atomic_flag vacuum_running;
+  uint32 logged_gates; // gates in slots below are persisted, unless listed in changed; modified while holding all partition locks
+  bool checkpoint_needed; // the log cannot be used anymore, see provsql_log_flush
+  bool persistence_disabled; // an unreadable snapshot could not be moved aside, see provsql_load
+  uint64 checkpoint; // number of the last checkpoint, written in the snapshot and the log
+  uint64 snapshot_size; // size of the last snapshot
+  pg_atomic_uint32 nb_changed;
+  uint32 changed[PROVSQL_LOG_MAX_CHANGES]; // slots below logged_gates modified since the last flush
+  dsa_pointer base_index; // tokens of the gates read from a snapshot, see provsql_find_gate
+  uint32 nb_base;
+  provsqlStats stats;
+  dsa_pointer gate_chunks[PROVSQL_MAX_GATE_CHUNKS];
+  provsqlWireChunk wire_chunks[PROVSQL_MAX_WIRE_CHUNKS];
 } provsqlSharedState;
 extern provsqlSharedState *provsql_shared_state;
 
-typedef struct provsqlHashEntry
+/* Type of a gate that has been referenced as a child of another gate,
+ * but not created yet (e.g., the key of a repair_key mulinput) */
+#define PROVSQL_GATE_UNDEFINED nb_gate_types
+
+/* A gate of the circuit, stored at a fixed slot. The wires of a gate
+ * are the slots of its children, stored contiguously in provsql_area,
+ * and followed by its extra data, if any: the positions of a project
+ * gate, or the value of an agg or value gate, see provsql_extra. */
+typedef struct provsqlGate
 {
-  pg_uuid_t key;
+  pg_uuid_t token;
   gate_type type;
   unsigned nb_children;
-  unsigned children_idx;
+  dsa_pointer children;
   double prob;
   unsigned info1;
   unsigned info2;
+  unsigned extra_len; // in bytes
+  uint32 epoch; // epoch of the last creation or use of the gate
+  Oid dbid; // database of the gate, InvalidOid if used by several databases
+} provsqlGate;
+
+/* Maps a token to the slot of its gate */
+typedef struct provsqlHashEntry
+{
+  pg_uuid_t key;
+  uint32 slot;
 } provsqlHashEntry;
-extern HTAB *provsql_hash;
+
+/* Maps a token to the slot of its gate in the base index, an array
+ * sorted by token read as is from a snapshot */
+typedef struct provsqlBaseEntry
+{
+  pg_uuid_t token;
+  uint32 slot;
+} provsqlBaseEntry;
+
+/* Backend-local handles on the store, see provsql_store_attach */
+extern dsa_area *provsql_area;
+extern dshash_table *provsql_hash;
+extern provsqlGate **provsql_gate_chunks;
+extern uint32 provsql_nb_gate_chunks;
+
+/* Statistics of the backend-local cache of gate tokens */
+extern uint64 provsql_gate_cache_hits;
+extern uint64 provsql_gate_cache_misses;
+
+void provsql_store_attach(void);
+void provsql_store_acquire(void);
+void provsql_store_release(void);
+void provsql_lock_all_access(void);
+void provsql_release_all_access(void);
+provsqlGate *provsql_map_gate_chunk(uint32 chunk);
+
+/* A gate is found in provsql_hash through its token, whose hash value
+ * also determines the partition lock to hold while creating or
+ * modifying its gate.
+ *
+ * The token of a gate is set before its slot is published in
+ * provsql_hash. The children of a gate are written before its type
+ * is set (from PROVSQL_GATE_UNDEFINED, when the gate was first
+ * referenced as a child), and never modified afterwards: once the slot
+ * of a gate is known, its type and children can therefore be read
+ * without any other lock than the one of provsql_store_acquire, see
+ * provsql_read_gate. */
+static inline uint32 provsql_token_hash(pg_uuid_t *token)
+{
+  return dshash_memhash(token, sizeof(pg_uuid_t), NULL);
+}
+
+static inline LWLock *provsql_partition_lock(uint32 hashcode)
+{
+  return provsql_shared_state->partition_locks[hashcode % PROVSQL_NUM_PARTITIONS];
+}
+
+static inline provsqlGate *provsql_gate(uint32 slot)
+{
+  uint32 chunk = slot / PROVSQL_GATES_PER_CHUNK;
+  provsqlGate *gates;
+
+  if(chunk < provsql_nb_gate_chunks && provsql_gate_chunks[chunk])
+    gates = provsql_gate_chunks[chunk];
+  else
+    gates = provsql_map_gate_chunk(chunk);
+
+  return &gates[slot % PROVSQL_GATES_PER_CHUNK];
+}
+
+static inline uint32 *provsql_children(const provsqlGate *gate)
+{
+  if(gate->nb_children == 0)
+    return NULL;
+  return (uint32 *) dsa_get_address(provsql_area, gate->children);
+}
+
+/* Number of words of provsql_area taken by the wires of a gate and its
+ * extra data */
+static inline uint32 provsql_nb_words(unsigned nb_children, unsigned extra_len)
+{
+  return nb_children + (extra_len + sizeof(uint32) - 1) / sizeof(uint32);
+}
+
+/* Extra data of a gate, written with its children and never modified
+ * afterwards */
+static inline const char *provsql_extra(const provsqlGate *gate)
+{
+  if(gate->extra_len == 0)
+    return NULL;
+  return (const char *) ((uint32 *) dsa_get_address(provsql_area, gate->children) + gate->nb_children);
+}
+
+/* Copies the gate at a given slot, returns its type */
+static inline gate_type provsql_read_gate(uint32 slot, provsqlGate *gate)
+{
+  provsqlGate *g = provsql_gate(slot);
+  gate_type type = g->type;
+
+  pg_read_barrier();
+  *gate = *g;
+  gate->type = type;
+
+  return type;
+}
+
+bool provsql_find_gate(pg_uuid_t *token, uint32 *slot);
+uint32 provsql_get_slot(pg_uuid_t *token, bool locked);
+bool provsql_reserve_wires(unsigned nb, dsa_pointer *start);
+
+void provsql_create_gate(pg_uuid_t *token, gate_type gtype, int nb_children, const pg_uuid_t *children);
+void provsql_create_gate_extra(pg_uuid_t *token, gate_type gtype, int nb_children, const pg_uuid_t *children,
+                               unsigned info1, unsigned info2, const void *extra, unsigned extra_len);
+void provsql_create_gates(int nb_gates, Datum *tokens, const int *gtypes, Datum *children, const bool *children_nulls, int width,
+                          const double *probs, const unsigned *infos);
+void provsql_set_infos(pg_uuid_t *token, unsigned info1, unsigned info2, bool info2_missing);
+
+void provsql_lock(LWLock *lock, LWLockMode mode);
+void provsql_count_evaluation(probability_method method, instr_time start);
+
+void provsql_lock_all_partitions(LWLockMode mode);
+void provsql_release_all_partitions(void);
+
+uint32 provsql_compact_store(const bits8 *keep);
+
+bool provsql_allocate_base(uint32 nb_gates, uint32 nb_wires, dsa_pointer *index, dsa_pointer *wires);
+void provsql_install_base(uint32 nb_gates, uint32 nb_wires, dsa_pointer index, dsa_pointer wires);
+
+/* Keeps the counts of pg_stat_provsql up to date: nb gates of a given
+ * type, with nb_wires children in all, enter (or, if negative, leave)
+ * the store */
+static inline void provsql_count_gates(int type, int64 nb, int64 nb_wires)
+{
+  pg_atomic_fetch_add_u64(&provsql_shared_state->stats.gates[type], nb);
+  if(nb_wires)
+    pg_atomic_fetch_add_u64(&provsql_shared_state->stats.wires, nb_wires);
+}
+
+/* Records that the gate at a given slot has been defined or modified,
+ * so that it is written to the log; the caller holds the partition lock
+ * of the gate exclusively */
+static inline void provsql_log_change(uint32 slot)
+{
+  if(slot < provsql_shared_state->logged_gates) {
+    uint32 i = pg_atomic_fetch_add_u32(&provsql_shared_state->nb_changed, 1);
+
+    if(i < PROVSQL_LOG_MAX_CHANGES)
+      provsql_shared_state->changed[i] = slot;
+  }
+}
 
 int provsql_serialize(const char*);
 int provsql_deserialize(const char*);
+int provsql_load(void);
+int provsql_log_flush(void);
 
 #endif /* ifndef PROVSQL_SHMEM_H */
@@ -221,6 +221,16 @@ constants_t initialize_constants(bool failure_if_not_possible)
   );
   CheckOid(OID_TYPE_AGG_TOKEN);
 
+  constants.OID_TYPE_TOKEN8 = GetSysCacheOid2(
+      TYPENAMENSP,
+#if PG_VERSION_NUM >= 120000
+      Anum_pg_type_oid,
+#endif
+      CStringGetDatum("token8"),
+      ObjectIdGetDatum(constants.OID_SCHEMA_PROVSQL)
+  );
+  CheckOid(OID_TYPE_TOKEN8);
+
   constants.OID_TYPE_UUID = TypenameGetTypid("uuid");
   CheckOid(OID_TYPE_UUID);
 
@@ -242,6 +252,9 @@ constants_t initialize_constants(bool failure_if_not_possible)
   constants.OID_FUNCTION_PROVENANCE_PLUS = get_provsql_func_oid("provenance_plus");
   CheckOid(OID_FUNCTION_PROVENANCE_PLUS);
 
+  constants.OID_FUNCTION_PROVENANCE_PLUS_AGG = get_provsql_func_oid("provenance_plus_agg");
+  CheckOid(OID_FUNCTION_PROVENANCE_PLUS_AGG);
+
   constants.OID_FUNCTION_PROVENANCE_TIMES = get_provsql_func_oid("provenance_times");
   CheckOid(OID_FUNCTION_PROVENANCE_TIMES);
 
@@ -269,6 +282,9 @@ constants_t initialize_constants(bool failure_if_not_possible)
   constants.OID_FUNCTION_GATE_ZERO = get_provsql_func_oid("gate_zero");
   CheckOid(OID_FUNCTION_GATE_ZERO);
 
+  constants.OID_FUNCTION_TOKEN8_UUID = get_provsql_func_oid("token8_uuid");
+  CheckOid(OID_FUNCTION_TOKEN8_UUID);
+
   OperatorGet("<>", PG_CATALOG_NAMESPACE, constants.OID_TYPE_UUID, constants.OID_TYPE_UUID, &constants.OID_OPERATOR_NOT_EQUAL_UUID, &constants.OID_FUNCTION_NOT_EQUAL_UUID);
   CheckOid(OID_OPERATOR_NOT_EQUAL_UUID);
   CheckOid(OID_FUNCTION_NOT_EQUAL_UUID);
@@ -30,12 +30,14 @@ typedef struct constants_t {
   Oid OID_TYPE_AGG_TOKEN;
   Oid OID_TYPE_UUID;
   Oid OID_TYPE_UUID_ARRAY;
+  Oid OID_TYPE_TOKEN8;
   Oid OID_TYPE_INT;
   Oid OID_TYPE_INT_ARRAY;
   Oid OID_TYPE_FLOAT;
   Oid OID_TYPE_VARCHAR;
   Oid OID_FUNCTION_ARRAY_AGG;
   Oid OID_FUNCTION_PROVENANCE_PLUS;
+  Oid OID_FUNCTION_PROVENANCE_PLUS_AGG;
   Oid OID_FUNCTION_PROVENANCE_TIMES;
   Oid OID_FUNCTION_PROVENANCE_MONUS;
   Oid OID_FUNCTION_PROVENANCE_PROJECT;
@@ -46,6 +48,7 @@ typedef struct constants_t {
   Oid OID_FUNCTION_PROVENANCE_AGGREGATE;
   Oid OID_FUNCTION_PROVENANCE_SEMIMOD;
   Oid OID_FUNCTION_GATE_ZERO;
+  Oid OID_FUNCTION_TOKEN8_UUID;
   Oid OID_OPERATOR_NOT_EQUAL_UUID;
   Oid OID_FUNCTION_NOT_EQUAL_UUID;
   bool ok;
@@ -53,7 +56,7 @@ typedef struct constants_t {
 
 Oid find_equality_operator(Oid ltypeId, Oid rtypeId);
 
-extern bool provsql_interrupted;
+extern volatile bool provsql_interrupted;
 extern bool provsql_where_provenance;
 extern int provsql_verbose;
 
@@ -12,92 +12,205 @@ extern "C"
   PG_FUNCTION_INFO_V1(dump_data);
 }
 
+#include <algorithm>
+#include <new>
+#include <cmath>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
+#include <unistd.h>
 
-char* print_shared_state_constants(constants_t &constants, char* buffer)
+/* Dumps are laid out so that they can be read into an empty store
+ * without looking up any token: a header, the base index (tokens of all
+ * gates, with their slots, sorted by token), the gates in slot order,
+ * and the wires, which refer to gates by their slot, each gate's wires
+ * being followed by its extra data as in the store. The checkpoint is
+ * the number of the checkpoint the dump was written at, 0 for dumps
+ * written by dump_data. */
+#define PROVSQL_DUMP_MAGIC "PROVSQL"
+#define PROVSQL_DUMP_VERSION 3
+
+struct provsqlDumpHeader
+{
+  char magic[8];
+  uint32 version;
+  uint32 nb_gates;
+  uint64 checkpoint;
+  uint64 nb_wires;
+};
+
+/* A gate as stored in a dump, children_idx being the position of its
+ * children in the array of wires */
+struct provsqlDumpGate
+{
+  pg_uuid_t token;
+  gate_type type;
+  unsigned nb_children;
+  unsigned children_idx;
+  double prob;
+  unsigned info1;
+  unsigned info2;
+  unsigned extra_len;
+  Oid dbid;
+};
+
+/* A gate as stored in the log, followed by the tokens of its children
+ * and by its extra data */
+struct provsqlLogGate
 {
-  sprintf(buffer, "Constants :\n OID_SCHEMA_PROVSQL = %d \n"
-  "OID_TYPE_GATE_TYPE = %d\n"
-  "OID_TYPE_AGG_TOKEN = %d\n"
-  "OID_TYPE_UUID = %d\n"
-  "OID_TYPE_UUID_ARRAY = %d\n"
-  "OID_TYPE_INT = %d\n"
-  "OID_TYPE_INT_ARRAY = %d\n"
-  "OID_TYPE_VARCHAR = %d\n"
-  "OID_FUNCTION_ARRAY_AGG = %d\n"
-  "OID_FUNCTION_PROVENANCE_PLUS = %d\n"
-  "OID_FUNCTION_PROVENANCE_TIMES = %d\n"
-  "OID_FUNCTION_PROVENANCE_MONUS = %d\n"
-  "OID_FUNCTION_PROVENANCE_PROJECT = %d\n"
-  "OID_FUNCTION_PROVENANCE_EQ = %d\n"
-  "OID_FUNCTION_PROVENANCE = %d\n"
-  "GATE_TYPE_TO_OID[nb_gate_types] = %p\n"
-  "OID_FUNCTION_PROVENANCE_DELTA = %d\n"
-  "OID_FUNCTION_PROVENANCE_AGGREGATE = %d\n"
-  "OID_FUNCTION_PROVENANCE_SEMIMOD = %d\n"
-  "OID_FUNCTION_GATE_ZERO = %d \n"
-  "OID_OPERATOR_NOT_EQUAL_UUID = %d \n"
-  "OID_FUNCTION_NOT_EQUAL_UUID = %d"
-  ,
-  constants.OID_SCHEMA_PROVSQL,
-  constants.OID_TYPE_GATE_TYPE,
-  constants.OID_TYPE_AGG_TOKEN,
-  constants.OID_TYPE_UUID,
-  constants.OID_TYPE_UUID_ARRAY,
-  constants.OID_TYPE_INT,
-  constants.OID_TYPE_INT_ARRAY,
-  constants.OID_TYPE_VARCHAR,
-  constants.OID_FUNCTION_ARRAY_AGG,
-  constants.OID_FUNCTION_PROVENANCE_PLUS,
-  constants.OID_FUNCTION_PROVENANCE_TIMES,
-  constants.OID_FUNCTION_PROVENANCE_MONUS,
-  constants.OID_FUNCTION_PROVENANCE_PROJECT,
-  constants.OID_FUNCTION_PROVENANCE_EQ,
-  constants.OID_FUNCTION_PROVENANCE,
-  constants.GATE_TYPE_TO_OID,
-  constants.OID_FUNCTION_PROVENANCE_DELTA,
-  constants.OID_FUNCTION_PROVENANCE_AGGREGATE,
-  constants.OID_FUNCTION_PROVENANCE_SEMIMOD,
-  constants.OID_FUNCTION_GATE_ZERO,
-  constants.OID_OPERATOR_NOT_EQUAL_UUID,
-  constants.OID_FUNCTION_NOT_EQUAL_UUID
-
-  );
-
-  return buffer;
+  pg_uuid_t token;
+  gate_type type;
+  unsigned nb_children;
+  double prob;
+  unsigned info1;
+  unsigned info2;
+  unsigned extra_len;
+  Oid dbid;
+};
+
+/* A gate as stored in dumps written before the format was versioned:
+ * a count of gates, the gates, a count of wires, and the wires, which
+ * are the tokens of the children; there was no extra data */
+struct provsqlLegacyGate
+{
+  pg_uuid_t token;
+  gate_type type;
+  unsigned nb_children;
+  unsigned children_idx;
+  double prob;
+  unsigned info1;
+  unsigned info2;
+};
+
+/* Checks that the wires of the gates of a dump are within the array of
+ * wires and refer to gates of the dump */
+static bool provsql_check_wires(const provsqlDumpGate &g, const uint32 *wires, uint64 nb_wires, uint32 nb_gates)
+{
+  if ((uint64) g.children_idx + provsql_nb_words(g.nb_children, g.extra_len) > nb_wires)
+    return false;
+
+  if (wires)
+  {
+    for (unsigned i = 0; i < g.nb_children; i++)
+      if (wires[g.children_idx + i] >= nb_gates)
+        return false;
+  }
+
+  return true;
 }
 
+static uint64 provsql_dump_size(const provsqlDumpHeader &header)
+{
+  return sizeof(provsqlDumpHeader) +
+    (uint64) header.nb_gates * (sizeof(provsqlBaseEntry) + sizeof(provsqlDumpGate)) +
+    header.nb_wires * sizeof(uint32);
+}
 
-char* print_hash_entry(provsqlHashEntry* hash, char* buffer)
+/* A copy of the gates and wires of the store, taken while the
+ * partitions are locked, so that it can be sorted and written once they
+ * are released */
+struct provsqlSnapshot
 {
-  sprintf(buffer, "Hash :\n"
-  //"Key = %16u \n"
-  "Type = %d \n"
-  "nb_children = %u \n"
-  "children_idx = %u \n"
-  "prob = %f\n"
-  "info1 = %u\n"
-  "info2 = %u\n"
-  ,
-  //&hash->key,
-  *&hash->type,
-  *&hash->nb_children,
-  *&hash->children_idx,
-  *&hash->prob,
-  *&hash->info1,
-  *&hash->info2
-  );
-
-  return buffer;
+  std::vector<provsqlBaseEntry> index;
+  std::vector<provsqlDumpGate> gates;
+  std::vector<uint32> wires;
+};
+
+/* Copies the store into snapshot; the caller holds all partition locks */
+static int provsql_copy_store(provsqlSnapshot &snapshot)
+{
+  uint32 nb_gates = pg_atomic_read_u32(&provsql_shared_state->nb_gates);
+  uint64 nb_wires = 0;
+
+  for (uint32 i = 0; i < nb_gates; i++)
+  {
+    provsqlGate *gate = provsql_gate(i);
+    nb_wires += provsql_nb_words(gate->nb_children, gate->extra_len);
+  }
+
+  if (nb_wires > PG_UINT32_MAX)
+    return 2;
+
+  try
+  {
+    snapshot.index.resize(nb_gates);
+    snapshot.gates.resize(nb_gates);
+    snapshot.wires.resize(nb_wires);
+  }
+  catch (const std::bad_alloc &)
+  {
+    return 2;
+  }
+
+  nb_wires = 0;
+  for (uint32 i = 0; i < nb_gates; i++)
+  {
+    provsqlGate *gate = provsql_gate(i);
+    provsqlDumpGate &tmp = snapshot.gates[i];
+    uint32 nb_words = provsql_nb_words(gate->nb_children, gate->extra_len);
+
+    snapshot.index[i].token = gate->token;
+    snapshot.index[i].slot = i;
+
+    tmp.token = gate->token;
+    tmp.type = gate->type;
+    tmp.nb_children = gate->nb_children;
+    tmp.children_idx = nb_wires;
+    tmp.prob = gate->prob;
+    tmp.info1 = gate->info1;
+    tmp.info2 = gate->info2;
+    tmp.extra_len = gate->extra_len;
+    tmp.dbid = gate->dbid;
+
+    if (nb_words > 0)
+      memcpy(&snapshot.wires[nb_wires], dsa_get_address(provsql_area, gate->children), sizeof(uint32) * (unsigned long int) nb_words);
+
+    nb_wires += nb_words;
+  }
+
+  return 0;
 }
 
+/* Writes a copy of the store as a dump; the base index is sorted here,
+ * no lock being needed */
+static int provsql_write_snapshot(FILE *file, provsqlSnapshot &snapshot, uint64 checkpoint)
+{
+  provsqlDumpHeader header;
+  uint32 nb_gates = snapshot.gates.size();
+  uint64 nb_wires = snapshot.wires.size();
+
+  std::sort(snapshot.index.begin(), snapshot.index.end(), [](const provsqlBaseEntry &a, const provsqlBaseEntry &b) {
+    return memcmp(&a.token, &b.token, sizeof(pg_uuid_t)) < 0;
+  });
+
+  memset(&header, 0, sizeof(provsqlDumpHeader));
+  memcpy(header.magic, PROVSQL_DUMP_MAGIC, sizeof(PROVSQL_DUMP_MAGIC));
+  header.version = PROVSQL_DUMP_VERSION;
+  header.nb_gates = nb_gates;
+  header.checkpoint = checkpoint;
+  header.nb_wires = nb_wires;
+
+  if (!fwrite(&header, sizeof(provsqlDumpHeader), 1, file))
+    return 2;
+
+  if (nb_gates > 0 && fwrite(snapshot.index.data(), sizeof(provsqlBaseEntry), nb_gates, file) != nb_gates)
+    return 2;
+
+  if (nb_gates > 0 && fwrite(snapshot.gates.data(), sizeof(provsqlDumpGate), nb_gates, file) != nb_gates)
+    return 2;
+
+  if (nb_wires > 0 && fwrite(snapshot.wires.data(), sizeof(uint32), nb_wires, file) != nb_wires)
+    return 2;
+
+  return 0;
+}
 
 int provsql_serialize(const char* filename)
 {
   FILE *file;
-  int32 num_entries;
-  provsqlHashEntry *entry;
-  HASH_SEQ_STATUS hash_seq;
+  provsqlSnapshot snapshot;
+  int result;
 
   file = AllocateFile(filename, PG_BINARY_W);
   if (file == NULL)
@@ -105,56 +218,361 @@ int provsql_serialize(const char* filename)
     return 1;
   }
 
-  num_entries = hash_get_num_entries(provsql_hash);
-  hash_seq_init(&hash_seq, provsql_hash);  
+  // No gate can be added while the store is being copied
+  provsql_lock_all_partitions(LW_SHARED);
+  result = provsql_copy_store(snapshot);
+  provsql_release_all_partitions();
+
+  if (!result)
+    result = provsql_write_snapshot(file, snapshot, 0);
+
+  if (FreeFile(file))
+  {
+    file = NULL;
+    return result?4:3;
+  }
+
+  return result;
+}
+
+/* Reads the gates and wires of a dump, after its header, for merging
+ * them into a non-empty store */
+static int provsql_deserialize_read(FILE *file, const provsqlDumpHeader &header, std::vector<provsqlDumpGate> &gates, std::vector<uint32> &wires)
+{
+  uint32 nb_gates = header.nb_gates;
+
+  if (header.nb_wires > PG_UINT32_MAX)
+    return 2;
+
+  // The base index is only needed when the store is empty
+  if (fseek(file, (long) nb_gates * sizeof(provsqlBaseEntry), SEEK_CUR))
+    return 2;
 
+  gates.resize(nb_gates);
+  if (nb_gates > 0) {
+    if (fread(gates.data(), sizeof(provsqlDumpGate), nb_gates, file) != nb_gates)
+    {
+      return 2;
+    }
+  }
 
-  if(! fwrite(&num_entries, sizeof(int32), 1, file)){
-    if (FreeFile(file))
+  wires.resize(header.nb_wires);
+  if (header.nb_wires > 0) {
+    if (fread(wires.data(), sizeof(uint32), header.nb_wires, file) != header.nb_wires)
     {
-      file = NULL;
-      return 4;
+      return 2;
     }
+  }
+
+  for (const auto &g : gates)
+  {
+    if (!provsql_check_wires(g, wires.data(), header.nb_wires, nb_gates))
+      return 2;
+  }
+
+  return 0;
+}
+
+/* Reads the gates of a dump, after its header, into an empty store:
+ * gates are copied to their slots and the base index and wires to
+ * their final location in the store, without looking up any token, so
+ * that reading is bounded by I/O. The caller holds all partition locks
+ * exclusively. */
+static int provsql_deserialize_base(FILE *file, const provsqlDumpHeader &header)
+{
+  uint32 nb_gates = header.nb_gates;
+  uint32 nb_wires;
+  dsa_pointer index_ptr, wires_ptr;
+  provsqlBaseEntry *index;
+  uint32 *wires;
+  std::vector<provsqlDumpGate> buffer;
+  int result = 0;
+
+  if (header.nb_wires > PG_UINT32_MAX)
+    return 2;
+  nb_wires = header.nb_wires;
+
+  if (!provsql_allocate_base(nb_gates, nb_wires, &index_ptr, &wires_ptr))
     return 2;
+  index = (provsqlBaseEntry *) dsa_get_address(provsql_area, index_ptr);
+  wires = (uint32 *) dsa_get_address(provsql_area, wires_ptr);
+
+  if (nb_gates > 0 && fread(index, sizeof(provsqlBaseEntry), nb_gates, file) != nb_gates)
+    result = 2;
+  for (uint32 i = 0; !result && i < nb_gates; i++)
+  {
+    if (index[i].slot >= nb_gates ||
+        (i > 0 && memcmp(&index[i-1].token, &index[i].token, sizeof(pg_uuid_t)) >= 0))
+      result = 2;
   }
 
-  while ( (entry = (provsqlHashEntry*)hash_seq_search(&hash_seq) )  != NULL )
+  buffer.resize(std::min<uint32>(nb_gates, PROVSQL_GATES_PER_CHUNK));
+  for (uint32 start = 0; !result && start < nb_gates; start += buffer.size())
   {
-    if (!fwrite(entry, sizeof(provsqlHashEntry), 1, file))
+    uint32 n = std::min<uint32>(buffer.size(), nb_gates - start);
+
+    if (fread(buffer.data(), sizeof(provsqlDumpGate), n, file) != n)
     {
-      if (FreeFile(file))
+      result = 2;
+      break;
+    }
+
+    for (uint32 j = 0; j < n; j++)
+    {
+      const provsqlDumpGate &tmp = buffer[j];
+      provsqlGate *gate = provsql_gate(start + j);
+
+      // Wires are checked once read
+      if (!provsql_check_wires(tmp, NULL, nb_wires, nb_gates) ||
+          tmp.type > PROVSQL_GATE_UNDEFINED)
       {
-       file = NULL;
-       return 4;
+        result = 2;
+        break;
       }
-      return 2;
+
+      gate->token = tmp.token;
+      gate->type = tmp.type;
+      gate->nb_children = tmp.nb_children;
+      gate->children = provsql_nb_words(tmp.nb_children, tmp.extra_len) > 0 ?
+        wires_ptr + (dsa_pointer) tmp.children_idx * sizeof(uint32) :
+        InvalidDsaPointer;
+      gate->prob = tmp.prob;
+      gate->info1 = tmp.info1;
+      gate->info2 = tmp.info2;
+      gate->extra_len = tmp.extra_len;
+      // Gates read from a dump are not protected by vacuum_circuit
+      gate->epoch = 0;
+      gate->dbid = tmp.dbid;
     }
-    
   }
 
-  
-  if ( !fwrite( &(provsql_shared_state->nb_wires), sizeof(unsigned int), 1, file ))
+  if (!result && nb_wires > 0 && fread(wires, sizeof(uint32), nb_wires, file) != nb_wires)
+    result = 2;
+  for (uint32 i = 0; !result && i < nb_gates; i++)
+  {
+    provsqlGate *gate = provsql_gate(i);
+    uint32 *children = provsql_children(gate);
+
+    for (unsigned j = 0; j < gate->nb_children; j++)
+      if (children[j] >= nb_gates)
+      {
+        result = 2;
+        break;
+      }
+  }
+
+  if (result)
+  {
+    dsa_free(provsql_area, index_ptr);
+    dsa_free(provsql_area, wires_ptr);
+    return result;
+  }
+
+  provsql_install_base(nb_gates, nb_wires, index_ptr, wires_ptr);
+
+  // The store was empty, all its counts were 0
+  std::vector<uint64> count(nb_gate_types + 1);
+  uint64 nb_children = 0;
+
+  for (uint32 i = 0; i < nb_gates; i++)
   {
-    if (FreeFile(file))
+    provsqlGate *gate = provsql_gate(i);
+
+    ++count[gate->type];
+    nb_children += gate->nb_children;
+  }
+  for (int t = 0; t <= nb_gate_types; t++)
+    provsql_count_gates(t, count[t], 0);
+  provsql_count_gates(PROVSQL_GATE_UNDEFINED, 0, nb_children);
+
+  return 0;
+}
+
+/* Gates of the dump are merged into the current store, slots of the
+ * dump being mapped to slots of the store */
+static int provsql_deserialize_internal(const std::vector<provsqlDumpGate> &gates, const std::vector<uint32> &wires)
+{
+  std::vector<uint32> slots(gates.size());
+
+  for (size_t i = 0; i < gates.size(); i++)
+  {
+    pg_uuid_t token = gates[i].token;
+    slots[i] = provsql_get_slot(&token, true);
+  }
+
+  for (size_t i = 0; i < gates.size(); i++)
+  {
+    const provsqlDumpGate &tmp = gates[i];
+    provsqlGate *gate = provsql_gate(slots[i]);
+
+    if (tmp.type == PROVSQL_GATE_UNDEFINED)
+      continue;
+
+    // The children of a gate are never modified once it is defined
+    // (they are determined by its token anyway), only its probability
+    // and infos are restored
+    if (gate->type != PROVSQL_GATE_UNDEFINED)
+    {
+      gate->prob = tmp.prob;
+      gate->info1 = tmp.info1;
+      gate->info2 = tmp.info2;
+      continue;
+    }
+
+    uint32 nb_words = provsql_nb_words(tmp.nb_children, tmp.extra_len);
+
+    gate->nb_children = tmp.nb_children;
+    gate->children = InvalidDsaPointer;
+    if (nb_words > 0)
     {
-      file = NULL;
-      return 4;
+      if (!provsql_reserve_wires(nb_words, &gate->children))
+      {
+        gate->nb_children = 0;
+        return 2;
+      }
+      uint32 *words = (uint32 *) dsa_get_address(provsql_area, gate->children);
+      for (unsigned j = 0; j < tmp.nb_children; j++)
+        words[j] = slots[wires[tmp.children_idx + j]];
+      for (unsigned j = tmp.nb_children; j < nb_words; j++)
+        words[j] = wires[tmp.children_idx + j];
     }
+    gate->extra_len = tmp.extra_len;
+    gate->prob = tmp.prob;
+    gate->info1 = tmp.info1;
+    gate->info2 = tmp.info2;
+    // Gates read from a dump are not protected by vacuum_circuit
+    gate->epoch = 0;
+    gate->dbid = tmp.dbid;
+
+    pg_write_barrier();
+    gate->type = tmp.type;
+
+    provsql_count_gates(PROVSQL_GATE_UNDEFINED, -1, 0);
+    provsql_count_gates(tmp.type, 1, tmp.nb_children);
+  }
+
+  return 0;
+}
+
+/* Position of a token among the gates of a dump read from a file that
+ * refers to gates by their token, a gate of undefined type being added
+ * the first time it is met */
+static uint32 provsql_dump_index(std::unordered_map<std::string, uint32> &index, std::vector<provsqlDumpGate> &gates, const pg_uuid_t &token)
+{
+  std::string key(reinterpret_cast<const char *>(token.data), UUID_LEN);
+  auto it = index.find(key);
+
+  if (it != index.end())
+    return it->second;
+
+  provsqlDumpGate g;
+  g.token = token;
+  g.type = PROVSQL_GATE_UNDEFINED;
+  g.nb_children = 0;
+  g.children_idx = 0;
+  g.prob = NAN;
+  g.info1 = g.info2 = 0;
+  g.extra_len = 0;
+  g.dbid = InvalidOid;
+  gates.push_back(g);
+
+  return index[key] = gates.size() - 1;
+}
+
+/* Reads a dump written before the format was versioned as a dump of the
+ * current format; its size must match exactly the counts it contains.
+ * The database of its gates is unknown. */
+static int provsql_read_legacy_dump(FILE *file, std::vector<provsqlDumpGate> &gates, std::vector<uint32> &wires)
+{
+  long file_size;
+  int32 nb_gates;
+  uint32 nb_wires;
+  std::unordered_map<std::string, uint32> index;
+  std::vector<provsqlLegacyGate> legacy;
+  std::vector<pg_uuid_t> tokens;
+
+  if (fseek(file, 0, SEEK_END) || (file_size = ftell(file)) < 0 ||
+      fseek(file, 0, SEEK_SET) ||
+      !fread(&nb_gates, sizeof(int32), 1, file) || nb_gates < 0 ||
+      (uint64) file_size < sizeof(int32) + (uint64) nb_gates * sizeof(provsqlLegacyGate) + sizeof(uint32))
+    return 2;
+
+  legacy.resize(nb_gates);
+  if (nb_gates > 0 &&
+      fread(legacy.data(), sizeof(provsqlLegacyGate), nb_gates, file) != (size_t) nb_gates)
+    return 2;
+
+  if (!fread(&nb_wires, sizeof(uint32), 1, file) ||
+      (uint64) file_size != sizeof(int32) + (uint64) nb_gates * sizeof(provsqlLegacyGate) +
+      sizeof(uint32) + (uint64) nb_wires * sizeof(pg_uuid_t))
+    return 2;
+
+  tokens.resize(nb_wires);
+  if (nb_wires > 0 &&
+      fread(tokens.data(), sizeof(pg_uuid_t), nb_wires, file) != nb_wires)
+    return 2;
+
+  for (const auto &l : legacy)
+    if ((unsigned) l.type >= nb_gate_types ||
+        (uint64) l.children_idx + l.nb_children > nb_wires)
+      return 2;
+
+  for (const auto &l : legacy)
+  {
+    uint32 i = provsql_dump_index(index, gates, l.token);
+
+    gates[i].type = l.type;
+    gates[i].nb_children = l.nb_children;
+    gates[i].children_idx = wires.size();
+    gates[i].prob = l.prob;
+    gates[i].info1 = l.info1;
+    gates[i].info2 = l.info2;
+    for (unsigned j = 0; j < l.nb_children; j++)
+      wires.push_back(provsql_dump_index(index, gates, tokens[l.children_idx + j]));
+  }
+
+  return 0;
+}
+
+/* Reads a dump into the store, directly if the store is empty, merging
+ * its gates into the store otherwise. A dump written before the format
+ * was versioned is always merged, and header.version is then 0. The
+ * caller holds all access and partition locks exclusively. */
+static int provsql_read_dump(const char* filename, provsqlDumpHeader &header)
+{
+  FILE *file;
+  int result;
+
+  file = AllocateFile(filename, PG_BINARY_R);
+  if (file == NULL)
+  {
     return 1;
   }
-  if (provsql_shared_state->nb_wires  > 0)
+
+  if (!fread(&header, sizeof(provsqlDumpHeader), 1, file) ||
+      memcmp(header.magic, PROVSQL_DUMP_MAGIC, sizeof(PROVSQL_DUMP_MAGIC)))
   {
-    
-    if (!fwrite( &(provsql_shared_state->wires), sizeof(pg_uuid_t)*  (unsigned long int)(provsql_shared_state->nb_wires), 1, file))
-    {
-     if (FreeFile(file))
-     {
-       file = NULL;
-       return 4;
-     }
-     return 2;
-    } 
+    std::vector<provsqlDumpGate> gates;
+    std::vector<uint32> wires;
 
+    memset(&header, 0, sizeof(provsqlDumpHeader));
+    result = provsql_read_legacy_dump(file, gates, wires);
+    if (!result)
+      result = provsql_deserialize_internal(gates, wires);
+  }
+  else if (header.version != PROVSQL_DUMP_VERSION)
+    result = 2;
+  else if (pg_atomic_read_u32(&provsql_shared_state->nb_gates) == 0 &&
+           provsql_shared_state->nb_base == 0)
+    result = provsql_deserialize_base(file, header);
+  else
+  {
+    std::vector<provsqlDumpGate> gates;
+    std::vector<uint32> wires;
+
+    result = provsql_deserialize_read(file, header, gates, wires);
+    if (!result)
+      result = provsql_deserialize_internal(gates, wires);
   }
 
   if (FreeFile(file))
@@ -163,80 +581,429 @@ int provsql_serialize(const char* filename)
     return 3;
   }
 
-  //TODO locks
+  return result;
+}
 
-  return 0;
+int provsql_deserialize(const char* filename)
+{
+  provsqlDumpHeader header;
+  int result;
 
-}
+  provsql_lock_all_partitions(LW_EXCLUSIVE);
+  result = provsql_read_dump(filename, header);
+  // Gates of the dump are not in the log
+  if (result != 1)
+    provsql_shared_state->checkpoint_needed = true;
+  provsql_release_all_partitions();
 
+  return result;
+}
 
-int provsql_deserialize(const char* filename)
+/* Reads the log of a given checkpoint as a dump: gates defined in the
+ * log appear once, with their last probability and infos, and children
+ * not defined in the log appear as gates of undefined type. An
+ * incomplete or invalid record, written when the server crashed, ends
+ * the log. Returns 4 if the log is not the one of the checkpoint. */
+static int provsql_read_log(uint64 checkpoint, std::vector<provsqlDumpGate> &gates, std::vector<uint32> &wires)
 {
   FILE *file;
-  int32 num;
-  provsqlHashEntry tmp;
-  provsqlHashEntry *entry;
-  bool found;
+  long log_size, position;
+  uint64 log_checkpoint;
+  std::unordered_map<std::string, uint32> index;
+  provsqlLogGate record;
+  std::vector<pg_uuid_t> children;
+  std::vector<uint32> extra;
 
-  file = AllocateFile(filename, PG_BINARY_R);
+  file = AllocateFile(PROVSQL_LOG_FILE, PG_BINARY_R);
   if (file == NULL)
   {
     return 1;
   }
 
-
-  if (!fread(&num, sizeof(int32),1,file))
+  if (fseek(file, 0, SEEK_END) || (log_size = ftell(file)) < 0 ||
+      fseek(file, 0, SEEK_SET))
   {
+    FreeFile(file);
     return 2;
   }
 
-  for (int i = 0; i < num; i++)
+  if (!fread(&log_checkpoint, sizeof(uint64), 1, file) || log_checkpoint != checkpoint)
+  {
+    FreeFile(file);
+    return 4;
+  }
+
+  while (fread(&record, sizeof(provsqlLogGate), 1, file))
   {
-    if (!fread(&tmp, sizeof(provsqlHashEntry), 1, file))
+    // A record of an unknown type, or whose children and extra data go
+    // past the end of the log, is garbage
+    if ((position = ftell(file)) < 0 ||
+        (unsigned) record.type >= nb_gate_types ||
+        (uint64) record.nb_children * sizeof(pg_uuid_t) + record.extra_len >
+        (uint64) (log_size - position))
+      break;
+
+    children.resize(record.nb_children);
+    if (record.nb_children > 0 &&
+        fread(children.data(), sizeof(pg_uuid_t), record.nb_children, file) != record.nb_children)
+      break;
+
+    // Extra data is padded with zeros to whole wires
+    extra.assign(provsql_nb_words(0, record.extra_len), 0);
+    if (record.extra_len > 0 &&
+        fread(extra.data(), record.extra_len, 1, file) != 1)
+      break;
+
+    uint32 i = provsql_dump_index(index, gates, record.token);
+
+    if (gates[i].type == PROVSQL_GATE_UNDEFINED)
     {
-      return 2;
+      gates[i].type = record.type;
+      gates[i].nb_children = record.nb_children;
+      gates[i].extra_len = record.extra_len;
+      gates[i].children_idx = wires.size();
+      for (const auto &c : children)
+        wires.push_back(provsql_dump_index(index, gates, c));
+      wires.insert(wires.end(), extra.begin(), extra.end());
+    }
+    gates[i].prob = record.prob;
+    gates[i].info1 = record.info1;
+    gates[i].info2 = record.info2;
+    gates[i].dbid = record.dbid;
+  }
+
+  if (FreeFile(file))
+  {
+    file = NULL;
+    return 3;
+  }
+
+  return 0;
+}
+
+/* Reads the snapshot of the circuit, then the log of the gates created
+ * or modified after it, into the store, unless another process already
+ * did it; this is done at most once, whatever the outcome. All access
+ * locks are held exclusively until the store is complete: processes
+ * that see it as loaded before then wait for it when accessing it. */
+int provsql_load(void)
+{
+  provsqlDumpHeader header;
+  int result = 0, log_result = 1;
+
+  provsql_lock_all_access();
+  provsql_lock_all_partitions(LW_EXCLUSIVE);
+  if (!provsql_shared_state->loaded)
+  {
+    provsql_shared_state->loaded = true;
+
+    // Exceptions must not go through the C frames of the caller
+    try
+    {
+      result = provsql_read_dump(PROVSQL_DUMP_FILE, header);
+    }
+    catch (const std::exception &e)
+    {
+      ereport(WARNING,
+              (errmsg("error while reading \"%s\": %s", PROVSQL_DUMP_FILE, e.what())));
+      result = 2;
+    }
+    if (result)
+    {
+      header.checkpoint = 0;
+      header.nb_gates = 0;
+      header.nb_wires = 0;
+    }
+
+    // A snapshot written before the format was versioned is replaced
+    // by a snapshot of the current format at the next checkpoint
+    if (result == 0 && header.version != PROVSQL_DUMP_VERSION)
+      ereport(LOG,
+              (errmsg("provenance circuit read from \"%s\" in the format of a previous version, converting it",
+                      PROVSQL_DUMP_FILE)));
+
+    // A snapshot that cannot be read, e.g., a truncated or a more recent
+    // one, would be replaced by the next checkpoint: it
+    // is moved aside with its log, and if that fails, the circuit is
+    // not persisted anymore, until the administrator removes the file
+    if (result == 2)
+    {
+      ereport(WARNING,
+              (errmsg("cannot read the provenance circuit from \"%s\", moving it to \"%s\"",
+                      PROVSQL_DUMP_FILE, PROVSQL_DUMP_FILE ".bad")));
+
+      if (durable_rename(PROVSQL_DUMP_FILE, PROVSQL_DUMP_FILE ".bad", WARNING) ||
+          (access(PROVSQL_LOG_FILE, F_OK) == 0 &&
+           durable_rename(PROVSQL_LOG_FILE, PROVSQL_LOG_FILE ".bad", WARNING)))
+      {
+        provsql_shared_state->persistence_disabled = true;
+        ereport(WARNING,
+                (errmsg("the provenance circuit will not be persisted"),
+                 errhint("Move \"%s\" and \"%s\" out of the data directory and restart the server.",
+                         PROVSQL_DUMP_FILE, PROVSQL_LOG_FILE)));
+      }
     }
 
-    // Deleting the entry if it already exists is important, otherwhise the HASH_ENTER will just ignore it and we will be stuck with the curent value, even if the serialized one was different.
-    hash_search(provsql_hash, &(tmp.key), HASH_REMOVE, &found);
-    entry = (provsqlHashEntry *) hash_search(provsql_hash, &(tmp.key), HASH_ENTER, &found);
+    if (result == 0 || result == 1)
+    {
+      std::vector<provsqlDumpGate> gates;
+      std::vector<uint32> wires;
+
+      try
+      {
+        log_result = provsql_read_log(header.checkpoint, gates, wires);
+        if (!log_result)
+          log_result = provsql_deserialize_internal(gates, wires);
+      }
+      catch (const std::exception &e)
+      {
+        ereport(WARNING,
+                (errmsg("error while reading \"%s\": %s", PROVSQL_LOG_FILE, e.what())));
+        log_result = 2;
+      }
+    }
 
-    if (!found)
+    // Gates of a log that could not be read would be lost by the next
+    // checkpoint, the log is moved aside as well
+    if (log_result == 2)
     {
-      *entry = tmp;
+      ereport(WARNING,
+              (errmsg("cannot read the provenance log \"%s\", moving it to \"%s\"",
+                      PROVSQL_LOG_FILE, PROVSQL_LOG_FILE ".bad")));
+
+      if (durable_rename(PROVSQL_LOG_FILE, PROVSQL_LOG_FILE ".bad", WARNING))
+      {
+        provsql_shared_state->persistence_disabled = true;
+        ereport(WARNING,
+                (errmsg("the provenance circuit will not be persisted"),
+                 errhint("Move \"%s\" out of the data directory and restart the server.",
+                         PROVSQL_LOG_FILE)));
+      }
     }
-    
-    
+
+    provsql_shared_state->checkpoint = header.checkpoint;
+    provsql_shared_state->snapshot_size = provsql_dump_size(header);
+    provsql_shared_state->logged_gates = pg_atomic_read_u32(&provsql_shared_state->nb_gates);
+    pg_atomic_write_u32(&provsql_shared_state->nb_changed, 0);
+    // A log that could not be read, or that belongs to a more recent
+    // snapshot than the one read, cannot be appended to, and a snapshot
+    // of a previous version is converted
+    provsql_shared_state->checkpoint_needed = (result != 0 && result != 1) || (log_result != 0 && log_result != 1) ||
+      (result == 0 && header.version != PROVSQL_DUMP_VERSION);
   }
+  provsql_release_all_partitions();
+  provsql_release_all_access();
+
+  if (result == 0 || result == 1)
+    result = log_result == 4 ? 0 : log_result;
+
+  return result;
+}
+
+/* Writes a copy of the store as a new snapshot and starts a new log,
+ * without holding any lock. The snapshot is only used once it has been
+ * renamed, and the previous log is ignored from then on, since it
+ * belongs to the previous checkpoint. */
+static int provsql_checkpoint(provsqlSnapshot &snapshot, uint64 checkpoint)
+{
+  FILE *file;
+  long snapshot_size;
+  int result;
 
-  if (! fread(&provsql_shared_state->nb_wires, sizeof(unsigned int), 1, file ))
+  file = AllocateFile(PROVSQL_DUMP_FILE ".new", PG_BINARY_W);
+  if (file == NULL)
+    return 1;
+
+  result = provsql_write_snapshot(file, snapshot, checkpoint);
+  if (!result && (fflush(file) || pg_fsync(fileno(file)) || (snapshot_size = ftell(file)) < 0))
+    result = 2;
+
+  if (FreeFile(file))
+    return result?4:3;
+  if (result)
+    return result;
+
+  if (durable_rename(PROVSQL_DUMP_FILE ".new", PROVSQL_DUMP_FILE, LOG))
+    return 2;
+
+  file = AllocateFile(PROVSQL_LOG_FILE, PG_BINARY_W);
+  if (file == NULL)
+    return 1;
+
+  if (!fwrite(&checkpoint, sizeof(uint64), 1, file) || fflush(file) || pg_fsync(fileno(file)))
+    result = 2;
+
+  if (FreeFile(file))
+    return result?4:3;
+  if (result)
+    return result;
+
+  provsql_store_acquire();
+  provsql_shared_state->checkpoint = checkpoint;
+  provsql_shared_state->snapshot_size = snapshot_size;
+  provsql_store_release();
+
+  return 0;
+}
+
+static void provsql_log_gate(std::vector<char> &buffer, uint32 slot)
+{
+  provsqlGate *gate = provsql_gate(slot);
+  provsqlLogGate record;
+
+  // Gates of undefined type are logged once defined
+  if (gate->type == PROVSQL_GATE_UNDEFINED)
+    return;
+
+  record.token = gate->token;
+  record.type = gate->type;
+  record.nb_children = gate->nb_children;
+  record.prob = gate->prob;
+  record.info1 = gate->info1;
+  record.info2 = gate->info2;
+  record.extra_len = gate->extra_len;
+  record.dbid = gate->dbid;
+
+  const char *p = reinterpret_cast<const char *>(&record);
+  buffer.insert(buffer.end(), p, p + sizeof(provsqlLogGate));
+
+  uint32 *children = provsql_children(gate);
+  for (unsigned i = 0; i < gate->nb_children; i++)
   {
+    p = reinterpret_cast<const char *>(&provsql_gate(children[i])->token);
+    buffer.insert(buffer.end(), p, p + sizeof(pg_uuid_t));
+  }
+
+  p = provsql_extra(gate);
+  if (p)
+    buffer.insert(buffer.end(), p, p + gate->extra_len);
+}
+
+/* Appends the gates created or modified since the last flush to the
+ * log, or writes a new snapshot when the log cannot be used or has
+ * grown too large. Only called by the background worker, so that the
+ * log has a single writer. Gates, or the whole store for a snapshot,
+ * are copied while the partitions are locked, but sorted, written, and
+ * synced once they are released. */
+static int provsql_log_flush_internal(void)
+{
+  FILE *file;
+  long log_size;
+  std::vector<char> buffer;
+  provsqlSnapshot snapshot;
+  uint64 checkpoint_number = 0;
+  bool checkpoint;
+  int result = 0;
+
+  // Neither the unreadable snapshot nor its log may be overwritten
+  if (provsql_shared_state->persistence_disabled)
+    return 0;
+
+  file = AllocateFile(PROVSQL_LOG_FILE, PG_BINARY_A);
+  if (file == NULL)
+    return 1;
+
+  if (fseek(file, 0, SEEK_END) || (log_size = ftell(file)) < 0)
+  {
+    FreeFile(file);
     return 2;
   }
 
-  if (provsql_shared_state->nb_wires  > 0) {
-    if (! fread(&provsql_shared_state->wires, sizeof(pg_uuid_t),(unsigned long int) (provsql_shared_state->nb_wires), file))
+  provsql_store_acquire();
+  provsql_lock_all_partitions(LW_SHARED);
+
+  checkpoint = provsql_shared_state->checkpoint_needed ||
+    pg_atomic_read_u32(&provsql_shared_state->nb_changed) > PROVSQL_LOG_MAX_CHANGES ||
+    (uint64) log_size > Max(PROVSQL_LOG_CHECKPOINT_SIZE, provsql_shared_state->snapshot_size);
+
+  if (checkpoint)
+  {
+    checkpoint_number = provsql_shared_state->checkpoint + 1;
+    result = provsql_copy_store(snapshot);
+
+    // Gates created or modified from now on go to the log of the new
+    // snapshot; if the snapshot cannot be written, checkpoint_needed is
+    // set again below
+    if (!result)
     {
-      return 2;
+      provsql_shared_state->checkpoint_needed = false;
+      provsql_shared_state->logged_gates = pg_atomic_read_u32(&provsql_shared_state->nb_gates);
+      pg_atomic_write_u32(&provsql_shared_state->nb_changed, 0);
     }
   }
-  
+  else
+  {
+    uint32 nb_gates = pg_atomic_read_u32(&provsql_shared_state->nb_gates);
+    uint32 nb_changed = pg_atomic_read_u32(&provsql_shared_state->nb_changed);
+
+    if (log_size == 0)
+    {
+      const char *p = reinterpret_cast<const char *>(&provsql_shared_state->checkpoint);
+      buffer.insert(buffer.end(), p, p + sizeof(uint64));
+    }
+
+    for (uint32 i = 0; i < nb_changed; i++)
+      provsql_log_gate(buffer, provsql_shared_state->changed[i]);
+    for (uint32 slot = provsql_shared_state->logged_gates; slot < nb_gates; slot++)
+      provsql_log_gate(buffer, slot);
+
+    provsql_shared_state->logged_gates = nb_gates;
+    pg_atomic_write_u32(&provsql_shared_state->nb_changed, 0);
+  }
+
+  provsql_release_all_partitions();
+  provsql_store_release();
+
+  if (checkpoint && !result)
+    result = provsql_checkpoint(snapshot, checkpoint_number);
+  else if (!checkpoint && !buffer.empty())
+  {
+    if (fwrite(buffer.data(), buffer.size(), 1, file) != 1 || fflush(file) || pg_fsync(fileno(file)))
+      result = 2;
+  }
 
   if (FreeFile(file))
+    result = result?4:3;
+
+  // Gates that could not be logged, or a snapshot that could not be
+  // written, are persisted by the next checkpoint
+  if (result)
   {
-    file = NULL;
-    return 3;
+    provsql_store_acquire();
+    provsql_shared_state->checkpoint_needed = true;
+    provsql_store_release();
   }
 
-  return 0;
+  return result;
+}
 
+/* Exceptions must not go through the C frames of the background
+ * worker: they end it, releasing the locks it holds, and it is
+ * restarted; gates are only marked as logged once they are copied, so
+ * none is lost */
+int provsql_log_flush(void)
+{
+  try
+  {
+    return provsql_log_flush_internal();
+  }
+  catch (const std::exception &e)
+  {
+    ereport(ERROR,
+            (errmsg("error while writing \"%s\": %s", PROVSQL_LOG_FILE, e.what())));
+  }
+  return 2;
 }
 
 Datum dump_data(PG_FUNCTION_ARGS)
 {
+  int result;
 
+  provsql_store_acquire();
+  result = provsql_serialize("provsql_test.tmp");
+  provsql_store_release();
 
-  switch (provsql_serialize("provsql_test.tmp"))
+  switch (result)
   {
   case 0:
     elog(INFO,"serializing completed without error");
@@ -272,8 +1039,14 @@ extern "C"
 }
 
 Datum read_data_dump(PG_FUNCTION_ARGS){
+  int result;
+
+  // Gates of an empty store are replaced, see provsql_install_base
+  provsql_lock_all_access();
+  result = provsql_deserialize("provsql_test.tmp");
+  provsql_release_all_access();
 
-  switch(provsql_deserialize("provsql_test.tmp"))
+  switch(result)
   {
     case 0:
     elog(INFO,"deserialization completed without error");
@@ -0,0 +1,107 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "utils/builtins.h"
+#include "utils/uuid.h"
+
+#include "token8.h"
+
+static const uint8 token8_prefix[8] = {
+  0x70, 0x72, 0x6f, 0x76, 0x73, 0x71, 0x80, 0x08
+};
+
+void token8_to_uuid(token8 token, pg_uuid_t *result)
+{
+  memcpy(result->data, token8_prefix, sizeof(token8_prefix));
+  for(int i=0; i<8; ++i)
+    result->data[8+i] = (uint8) ((uint64) token >> (56 - 8 * i));
+}
+
+bool uuid_to_token8(const pg_uuid_t *uuid, token8 *result)
+{
+  uint64 token = 0;
+
+  if(memcmp(uuid->data, token8_prefix, sizeof(token8_prefix)))
+    return false;
+
+  for(int i=0; i<8; ++i)
+    token = (token << 8) | uuid->data[8+i];
+  *result = (token8) token;
+
+  return true;
+}
+
+PG_FUNCTION_INFO_V1(token8_in);
+Datum
+token8_in(PG_FUNCTION_ARGS)
+{
+  return DirectFunctionCall1(int8in, PG_GETARG_DATUM(0));
+}
+
+PG_FUNCTION_INFO_V1(token8_out);
+Datum
+token8_out(PG_FUNCTION_ARGS)
+{
+  return DirectFunctionCall1(int8out, PG_GETARG_DATUM(0));
+}
+
+PG_FUNCTION_INFO_V1(token8_uuid);
+Datum
+token8_uuid(PG_FUNCTION_ARGS)
+{
+  pg_uuid_t *result = palloc(sizeof(pg_uuid_t));
+
+  token8_to_uuid(PG_GETARG_INT64(0), result);
+
+  PG_RETURN_UUID_P(result);
+}
+
+PG_FUNCTION_INFO_V1(uuid_token8);
+Datum
+uuid_token8(PG_FUNCTION_ARGS)
+{
+  pg_uuid_t *uuid = PG_GETARG_UUID_P(0);
+  token8 result;
+
+  if(!uuid_to_token8(uuid, &result))
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("%s is not a compact provenance token",
+                    DatumGetCString(DirectFunctionCall1(uuid_out, UUIDPGetDatum(uuid))))));
+
+  PG_RETURN_INT64(result);
+}
+
+/* Comparison and hashing, the same as for bigint, for the B-tree and
+ * hash operator classes of token8 */
+
+#define TOKEN8_CMP(name, op) \
+  PG_FUNCTION_INFO_V1(token8_ ## name); \
+  Datum \
+  token8_ ## name(PG_FUNCTION_ARGS) \
+  { \
+    PG_RETURN_BOOL(PG_GETARG_INT64(0) op PG_GETARG_INT64(1)); \
+  }
+
+TOKEN8_CMP(eq, ==)
+TOKEN8_CMP(ne, !=)
+TOKEN8_CMP(lt, <)
+TOKEN8_CMP(le, <=)
+TOKEN8_CMP(gt, >)
+TOKEN8_CMP(ge, >=)
+
+PG_FUNCTION_INFO_V1(token8_cmp);
+Datum
+token8_cmp(PG_FUNCTION_ARGS)
+{
+  token8 a = PG_GETARG_INT64(0);
+  token8 b = PG_GETARG_INT64(1);
+
+  PG_RETURN_INT32(a < b ? -1 : (a > b ? 1 : 0));
+}
+
+PG_FUNCTION_INFO_V1(token8_hash);
+Datum
+token8_hash(PG_FUNCTION_ARGS)
+{
+  return DirectFunctionCall1(hashint8, PG_GETARG_DATUM(0));
+}
@@ -0,0 +1,19 @@
+#ifndef TOKEN8_H
+#define TOKEN8_H
+
+#include "provsql_utils.h"
+
+/* Compact provenance tokens (type provsql.token8): 64-bit identifiers
+ * drawn from the sequence provsql.token8_seq, used by tables created
+ * with add_provenance(..., compact => true). The gates of such tokens
+ * are stored under the UUID 70726f76-7371-8008-XXXX-XXXXXXXXXXXX, where
+ * the last 8 bytes are the big-endian identifier; the version nibble 8
+ * keeps these UUIDs apart from random (version 4) input tokens and from
+ * the name-based (version 5) tokens of derived gates. */
+typedef int64 token8;
+
+void token8_to_uuid(token8 token, pg_uuid_t *result);
+/* Returns false if the UUID is not that of a compact token */
+bool uuid_to_token8(const pg_uuid_t *uuid, token8 *result);
+
+#endif /* TOKEN8_H */
@@ -0,0 +1,145 @@
+#include "postgres.h"
+
+#include "uuid_v5.h"
+
+/* 920d4f02-8718-5319-9532-d4ab83a64489, see provsql.uuid_ns_provsql() */
+const pg_uuid_t uuid_ns_provsql = {{
+  0x92, 0x0d, 0x4f, 0x02, 0x87, 0x18, 0x53, 0x19,
+  0x95, 0x32, 0xd4, 0xab, 0x83, 0xa6, 0x44, 0x89
+}};
+
+/* 19257535-6aaf-5275-b02b-899c48576553, see provsql.gate_zero() */
+const pg_uuid_t uuid_gate_zero = {{
+  0x19, 0x25, 0x75, 0x35, 0x6a, 0xaf, 0x52, 0x75,
+  0xb0, 0x2b, 0x89, 0x9c, 0x48, 0x57, 0x65, 0x53
+}};
+
+/* d265daa9-f206-561d-845c-2a85fa0fa72c, see provsql.gate_one() */
+const pg_uuid_t uuid_gate_one = {{
+  0xd2, 0x65, 0xda, 0xa9, 0xf2, 0x06, 0x56, 0x1d,
+  0x84, 0x5c, 0x2a, 0x85, 0xfa, 0x0f, 0xa7, 0x2c
+}};
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/* SHA-1 compression function (FIPS 180-4) */
+static void sha1_block(uint32 h[5], const uint8 block[64])
+{
+  uint32 w[80];
+  uint32 a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+  for(int i=0; i<16; ++i)
+    w[i] = ((uint32) block[4*i] << 24) | ((uint32) block[4*i+1] << 16) |
+           ((uint32) block[4*i+2] << 8) | (uint32) block[4*i+3];
+  for(int i=16; i<80; ++i)
+    w[i] = ROTL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+  for(int i=0; i<80; ++i) {
+    uint32 f, k, t;
+
+    if(i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if(i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if(i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+
+    t = ROTL(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = ROTL(b, 30);
+    b = a;
+    a = t;
+  }
+
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+}
+
+void uuid_v5_init(uuid_v5_state *state)
+{
+  state->h[0] = 0x67452301;
+  state->h[1] = 0xefcdab89;
+  state->h[2] = 0x98badcfe;
+  state->h[3] = 0x10325476;
+  state->h[4] = 0xc3d2e1f0;
+  state->length = 0;
+
+  uuid_v5_update(state, uuid_ns_provsql.data, UUID_LEN);
+}
+
+void uuid_v5_update(uuid_v5_state *state, const void *data, size_t len)
+{
+  const uint8 *p = data;
+
+  while(len > 0) {
+    size_t used = state->length % 64;
+    size_t n = Min(len, 64 - used);
+
+    memcpy(state->block + used, p, n);
+    state->length += n;
+    p += n;
+    len -= n;
+
+    if(used + n == 64)
+      sha1_block(state->h, state->block);
+  }
+}
+
+void uuid_to_text(const pg_uuid_t *token, char *out)
+{
+  static const char hex[] = "0123456789abcdef";
+
+  for(int i=0; i<UUID_LEN; ++i) {
+    // Same format as uuid_out
+    if(i == 4 || i == 6 || i == 8 || i == 10)
+      *out++ = '-';
+    *out++ = hex[token->data[i] >> 4];
+    *out++ = hex[token->data[i] & 0x0f];
+  }
+}
+
+void uuid_v5_update_uuid(uuid_v5_state *state, const pg_uuid_t *token)
+{
+  char buf[36];
+
+  uuid_to_text(token, buf);
+  uuid_v5_update(state, buf, sizeof(buf));
+}
+
+void uuid_v5_update_int(uuid_v5_state *state, int32 value)
+{
+  char buf[12];
+
+  uuid_v5_update(state, buf, snprintf(buf, sizeof(buf), "%d", value));
+}
+
+void uuid_v5_final(uuid_v5_state *state, pg_uuid_t *result)
+{
+  uint64 bits = state->length * 8;
+  uint8 padding[72];
+  size_t padding_len = 64 - (state->length + 8) % 64 + 8;
+
+  memset(padding, 0, sizeof(padding));
+  padding[0] = 0x80;
+  for(int i=0; i<8; ++i)
+    padding[padding_len - 1 - i] = (uint8) (bits >> (8 * i));
+  uuid_v5_update(state, padding, padding_len);
+
+  for(int i=0; i<UUID_LEN; ++i)
+    result->data[i] = (uint8) (state->h[i / 4] >> (24 - 8 * (i % 4)));
+
+  // Version and variant, as in RFC 4122
+  result->data[6] = (result->data[6] & 0x0f) | 0x50;
+  result->data[8] = (result->data[8] & 0x3f) | 0x80;
+}
@@ -0,0 +1,32 @@
+#ifndef UUID_V5_H
+#define UUID_V5_H
+
+#include "provsql_utils.h"
+
+/* Name-based (version 5, SHA-1) UUIDs in the namespace of ProvSQL, the
+ * same as uuid_generate_v5(provsql.uuid_ns_provsql(), name) from the
+ * uuid-ossp extension, computed incrementally: the name is given in
+ * pieces through the update functions. */
+typedef struct uuid_v5_state
+{
+  uint32 h[5];
+  uint64 length; // bytes hashed so far
+  uint8 block[64];
+} uuid_v5_state;
+
+void uuid_v5_init(uuid_v5_state *state);
+void uuid_v5_update(uuid_v5_state *state, const void *data, size_t len);
+/* Appends the text representation of a UUID, as produced by uuid_out */
+void uuid_v5_update_uuid(uuid_v5_state *state, const pg_uuid_t *token);
+void uuid_v5_update_int(uuid_v5_state *state, int32 value);
+void uuid_v5_final(uuid_v5_state *state, pg_uuid_t *result);
+
+/* Writes the text representation of a UUID in out, which must have
+ * room for 36 characters; no terminating null character is written */
+void uuid_to_text(const pg_uuid_t *token, char *out);
+
+extern const pg_uuid_t uuid_ns_provsql;
+extern const pg_uuid_t uuid_gate_zero;
+extern const pg_uuid_t uuid_gate_one;
+
+#endif /* UUID_V5_H */
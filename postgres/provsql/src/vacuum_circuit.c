@@ -0,0 +1,165 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "storage/ipc.h"
+#include "utils/uuid.h"
+
+#include "provsql_shmem.h"
+#include "provsql_utils.h"
+
+PG_FUNCTION_INFO_V1(vacuum_circuit);
+
+/* Gates kept by vacuum_circuit are those reachable from:
+ *  - tokens stored in uuid, token8, or agg_token columns of the tables
+ *    of the current database, outside of the provsql schema;
+ *  - tokens pinned with pin_token, and the zero and one gates;
+ *  - gates created or used since the previous run of vacuum_circuit,
+ *    which may belong to queries that are still running;
+ *  - gates of other databases.
+ * This query lists queries returning these tokens. */
+static const char *roots_query =
+  "SELECT format('SELECT %I::uuid FROM %I.%I WHERE %I IS NOT NULL', a.attname, n.nspname, c.relname, a.attname) "
+  "FROM pg_attribute a JOIN pg_class c ON a.attrelid=c.oid JOIN pg_namespace n ON c.relnamespace=n.oid "
+  "WHERE c.relkind IN ('r','m') AND a.attnum>0 AND NOT a.attisdropped "
+  "AND a.atttypid IN ('uuid'::regtype, 'provsql.token8'::regtype, 'provsql.agg_token'::regtype) "
+  "AND n.nspname NOT IN ('pg_catalog', 'information_schema', 'provsql') "
+  "AND (n.nspname NOT LIKE 'pg_temp%' OR n.oid=pg_my_temp_schema()) "
+  "UNION ALL SELECT 'SELECT token FROM provsql.pinned_tokens' "
+  "UNION ALL SELECT 'SELECT provsql.gate_zero() UNION ALL SELECT provsql.gate_one()'";
+
+static void mark_roots(bits8 *roots, uint32 nb_gates)
+{
+  SPITupleTable *queries;
+  uint64 nb_queries;
+
+  SPI_connect();
+
+  if(SPI_execute(roots_query, true, 0) != SPI_OK_SELECT)
+    elog(ERROR, "Cannot list tables with provenance tokens");
+
+  queries = SPI_tuptable;
+  nb_queries = SPI_processed;
+
+  for(uint64 i=0; i<nb_queries; ++i) {
+    char *query = SPI_getvalue(queries->vals[i], queries->tupdesc, 1);
+    Portal portal = SPI_cursor_open_with_args(NULL, query, 0, NULL, NULL, NULL, true, 0);
+
+    for(;;) {
+      SPI_cursor_fetch(portal, true, 10000);
+      if(SPI_processed == 0)
+        break;
+
+      // Each batch of tokens is looked up under the store lock, as
+      // dumps read in the meantime modify the index. Slots below
+      // nb_gates are only moved by vacuum_circuit, so the slots found
+      // here are still valid once all access locks are taken; gates
+      // installed from a dump into the empty store are above nb_gates.
+      provsql_store_acquire();
+      for(uint64 j=0; j<SPI_processed; ++j) {
+        bool isnull;
+        Datum token = SPI_getbinval(SPI_tuptable->vals[j], SPI_tuptable->tupdesc, 1, &isnull);
+        uint32 slot;
+
+        if(!isnull && provsql_find_gate(DatumGetUUIDP(token), &slot) && slot < nb_gates)
+          roots[slot / BITS_PER_BYTE] |= 1 << (slot % BITS_PER_BYTE);
+      }
+      provsql_store_release();
+
+      SPI_freetuptable(SPI_tuptable);
+    }
+
+    SPI_cursor_close(portal);
+  }
+
+  SPI_finish();
+}
+
+static int64 vacuum_circuit_internal(void)
+{
+  uint32 epoch;
+  uint32 nb_root_gates, nb_gates;
+  bits8 *roots, *keep;
+  uint32 *stack;
+  uint32 stack_size = 0;
+  uint32 nb_freed;
+
+  // Gates created or used from now on are stamped with the next epoch,
+  // so gates stamped with this epoch were used after the previous run
+  // started
+  epoch = pg_atomic_fetch_add_u32(&provsql_shared_state->epoch, 1);
+
+  // Tables are read without holding the store, gates created in the
+  // meantime are kept anyway
+  nb_root_gates = pg_atomic_read_u32(&provsql_shared_state->nb_gates);
+  roots = palloc_extended(nb_root_gates / BITS_PER_BYTE + 1, MCXT_ALLOC_HUGE | MCXT_ALLOC_ZERO);
+  mark_roots(roots, nb_root_gates);
+
+  provsql_lock_all_access();
+
+  nb_gates = pg_atomic_read_u32(&provsql_shared_state->nb_gates);
+  keep = palloc_extended(nb_gates / BITS_PER_BYTE + 1, MCXT_ALLOC_HUGE | MCXT_ALLOC_ZERO);
+  stack = palloc_extended(Max(nb_gates, 1) * sizeof(uint32), MCXT_ALLOC_HUGE);
+
+  for(uint32 s=0; s<nb_gates; ++s) {
+    provsqlGate *gate = provsql_gate(s);
+
+    if(s >= nb_root_gates ||
+       (roots[s / BITS_PER_BYTE] & (1 << (s % BITS_PER_BYTE))) ||
+       gate->epoch >= epoch ||
+       gate->dbid != MyDatabaseId) {
+      keep[s / BITS_PER_BYTE] |= 1 << (s % BITS_PER_BYTE);
+      stack[stack_size++] = s;
+    }
+  }
+
+  while(stack_size > 0) {
+    provsqlGate *gate = provsql_gate(stack[--stack_size]);
+    uint32 *children = provsql_children(gate);
+
+    for(unsigned i=0; i<gate->nb_children; ++i) {
+      uint32 c = children[i];
+
+      if(!(keep[c / BITS_PER_BYTE] & (1 << (c % BITS_PER_BYTE)))) {
+        keep[c / BITS_PER_BYTE] |= 1 << (c % BITS_PER_BYTE);
+        stack[stack_size++] = c;
+      }
+    }
+  }
+
+  nb_freed = provsql_compact_store(keep);
+
+  provsql_release_all_access();
+
+  pfree(stack);
+  pfree(keep);
+  pfree(roots);
+
+  return nb_freed;
+}
+
+static void vacuum_circuit_cleanup(int code, Datum arg)
+{
+  pg_atomic_clear_flag(&provsql_shared_state->vacuum_running);
+}
+
+Datum vacuum_circuit(PG_FUNCTION_ARGS)
+{
+  int64 result;
+
+  provsql_store_attach();
+
+  if(!pg_atomic_test_set_flag(&provsql_shared_state->vacuum_running))
+    elog(ERROR, "vacuum_circuit is already running");
+
+  PG_ENSURE_ERROR_CLEANUP(vacuum_circuit_cleanup, (Datum) 0);
+  {
+    result = vacuum_circuit_internal();
+  }
+  PG_END_ENSURE_ERROR_CLEANUP(vacuum_circuit_cleanup, (Datum) 0);
+
+  vacuum_circuit_cleanup(0, (Datum) 0);
+
+  PG_RETURN_INT64(result);
+}
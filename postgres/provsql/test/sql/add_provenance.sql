@@ -27,3 +27,45 @@ FROM pg_attribute
 WHERE attrelid ='personnel'::regclass AND attnum>1
 ORDER BY attname;
 
+
+-- Gates of rows inserted after add_provenance are created by a
+-- statement-level trigger
+CREATE TABLE bulk(x INT);
+INSERT INTO bulk SELECT generate_series(1,5);
+SELECT add_provenance('bulk');
+INSERT INTO bulk SELECT generate_series(6,10);
+
+CREATE TABLE bulk_tokens AS SELECT x, provenance() AS token FROM bulk;
+SELECT remove_provenance('bulk_tokens');
+SELECT COUNT(*) AS nb, bool_and(get_gate_type(token)='input') AS input
+FROM bulk_tokens;
+
+DROP TABLE bulk_tokens;
+DROP TABLE bulk;
+
+-- Compact tokens
+CREATE TABLE compact(x INT);
+INSERT INTO compact SELECT generate_series(1,5);
+SELECT add_provenance('compact', compact => true);
+INSERT INTO compact SELECT generate_series(6,10);
+CREATE INDEX ON compact USING hash(provsql);
+
+SELECT format_type(atttypid, atttypmod) AS type
+FROM pg_attribute
+WHERE attrelid='compact'::regclass AND attname='provsql';
+
+CREATE TABLE compact_tokens AS SELECT x, provenance() AS token FROM compact;
+SELECT remove_provenance('compact_tokens');
+SELECT COUNT(*) AS nb, bool_and(get_gate_type(token)='input') AS input,
+       bool_and(token::token8::uuid=token) AS compact
+FROM compact_tokens;
+
+CREATE TABLE compact_groups AS
+  SELECT x%2 AS y, provenance() AS token FROM compact GROUP BY x%2;
+SELECT remove_provenance('compact_groups');
+SELECT y, get_gate_type(token) AS type, array_length(get_children(token),1) AS nb
+FROM compact_groups ORDER BY y;
+
+DROP TABLE compact_groups;
+DROP TABLE compact_tokens;
+DROP TABLE compact;
@@ -0,0 +1,31 @@
+\set ECHO none
+SET search_path TO provsql_test, provsql;
+
+SELECT create_gates(
+  ARRAY['b0000000-0000-0000-0000-000000000001',
+        'b0000000-0000-0000-0000-000000000002',
+        'b0000000-0000-0000-0000-000000000003',
+        'b0000000-0000-0000-0000-000000000004']::uuid[],
+  ARRAY['times', 'input', 'input', 'plus']::provenance_gate[],
+  ARRAY[['b0000000-0000-0000-0000-000000000002', 'b0000000-0000-0000-0000-000000000003'],
+        [NULL, NULL],
+        [NULL, NULL],
+        ['b0000000-0000-0000-0000-000000000001', NULL]]::uuid[]);
+
+SELECT set_probs(
+  ARRAY['b0000000-0000-0000-0000-000000000002',
+        'b0000000-0000-0000-0000-000000000003']::uuid[],
+  ARRAY[0.5, 0.25]);
+
+SELECT get_gate_type('b0000000-0000-0000-0000-000000000001') AS type1,
+       get_gate_type('b0000000-0000-0000-0000-000000000004') AS type4,
+       get_children('b0000000-0000-0000-0000-000000000004') AS children4,
+       get_prob('b0000000-0000-0000-0000-000000000003') AS prob3,
+       ROUND(probability_evaluate('b0000000-0000-0000-0000-000000000004', 'possible-worlds')::numeric, 3) AS prob4;
+
+-- Gates created by this backend are found in its local cache
+CREATE TEMP TABLE cache_before AS SELECT * FROM gate_cache_stats();
+SELECT create_gate('b0000000-0000-0000-0000-000000000001', 'times',
+  ARRAY['b0000000-0000-0000-0000-000000000002', 'b0000000-0000-0000-0000-000000000003']::uuid[]);
+SELECT s.hits > b.hits AS cached FROM gate_cache_stats() s, cache_before b;
+DROP TABLE cache_before;
@@ -0,0 +1,30 @@
+\set ECHO none
+SET search_path TO provsql_test,provsql;
+
+-- Will fail because the circuit is not monotone
+CREATE TABLE fpras_result AS
+SELECT city, probability_evaluate(provenance(),'fpras','0.1;0.1') AS prob
+FROM (
+  SELECT DISTINCT city
+  FROM personnel
+EXCEPT 
+  SELECT p1.city
+  FROM personnel p1,personnel p2
+  WHERE p1.id<p2.id AND p1.city=p2.city
+  GROUP BY p1.city
+) t;
+
+CREATE TABLE fpras_result AS
+SELECT p1.city,
+  probability_evaluate(provenance(),'fpras','0.05;0.01;seed=42') AS prob,
+  probability_evaluate(provenance(),'possible-worlds') AS exact
+FROM personnel p1,personnel p2
+WHERE p1.id<p2.id AND p1.city=p2.city
+GROUP BY p1.city;
+
+SELECT remove_provenance('fpras_result');
+
+-- The error is relative, even for small probabilities
+SELECT city, ROUND(exact::numeric,2) AS exact, abs(prob/exact-1) <= 0.05 AS within
+FROM fpras_result ORDER BY city;
+DROP TABLE fpras_result;
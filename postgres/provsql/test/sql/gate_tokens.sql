@@ -0,0 +1,62 @@
+\set ECHO none
+SET search_path TO provsql_test, provsql;
+
+-- Tokens of the gates created by the constructors are the same as the
+-- ones derived in SQL by earlier versions of ProvSQL
+CREATE TEMP TABLE t(a uuid, b uuid, c uuid);
+INSERT INTO t VALUES ('c0000000-0000-0000-0000-000000000001',
+                      'c0000000-0000-0000-0000-000000000002',
+                      'c0000000-0000-0000-0000-000000000003');
+
+SELECT
+  provenance_times(a, b, c) =
+    public.uuid_generate_v5(uuid_ns_provsql(), concat('times',
+      public.uuid_generate_v5(uuid_ns_provsql(), concat(
+        public.uuid_generate_v5(uuid_ns_provsql(), concat(a, b)), c)))) AS times,
+  provenance_plus(ARRAY[c, a, gate_zero()]) =
+    public.uuid_generate_v5(uuid_ns_provsql(), concat('plus', a, ',', c)) AS plus,
+  provenance_monus(a, b) =
+    public.uuid_generate_v5(uuid_ns_provsql(), concat('monus', a, b)) AS monus,
+  provenance_delta(a) =
+    public.uuid_generate_v5(uuid_ns_provsql(), concat('delta', a)) AS delta,
+  provenance_project(a, 1, 0, 2) =
+    public.uuid_generate_v5(uuid_ns_provsql(), concat(a, ARRAY[1, 0, 2])) AS project,
+  provenance_eq(a, 1, 2) =
+    public.uuid_generate_v5(uuid_ns_provsql(), concat(a, 1, 2)) AS eq,
+  provenance_semimod(42, a) =
+    public.uuid_generate_v5(uuid_ns_provsql(), concat('semimod',
+      public.uuid_generate_v5(uuid_ns_provsql(), 'value42'), a)) AS semimod,
+  provenance_aggregate(2108, 20, 42, ARRAY[a, b])::uuid =
+    public.uuid_generate_v5(uuid_ns_provsql(), concat('agg', a, ',', b)) AS aggregate
+FROM t;
+
+SELECT
+  provenance_times(a, gate_one()) = a AS times_one,
+  provenance_plus(ARRAY[b]) = b AS plus_single,
+  provenance_monus(a, gate_zero()) = a AS monus_zero,
+  provenance_monus(a, a) = gate_zero() AS monus_self,
+  provenance_delta(gate_one()) = gate_one() AS delta_one
+FROM t;
+
+SELECT get_gate_type(provenance_plus(ARRAY[c, a, gate_zero()])) AS type,
+       get_children(provenance_plus(ARRAY[c, a, gate_zero()])) AS children
+FROM t;
+
+-- Extra information is stored with the gates
+SELECT
+  get_extra_infos(provenance_project(a, 1, 0, 2)) AS project,
+  get_extra_infos(provenance_eq(a, 1, 2)) AS eq,
+  get_extra((get_children(provenance_semimod(42, a)))[2]) AS value,
+  get_extra(provenance_aggregate(2108, 20, 42, ARRAY[a, b])::uuid) AS agg_value,
+  get_infos(provenance_aggregate(2108, 20, 42, ARRAY[a, b])::uuid) AS agg_infos
+FROM t;
+
+-- provenance_plus_agg(token) is provenance_plus(array_agg(token))
+SELECT
+  (SELECT provenance_plus_agg(x) FROM unnest(ARRAY[c, a, gate_zero(), NULL, a]) x) =
+    provenance_plus(ARRAY[c, a, gate_zero(), NULL, a]) AS plus_agg,
+  (SELECT provenance_plus_agg(x) FROM unnest(ARRAY[gate_zero()]) x) = gate_zero() AS plus_agg_single,
+  (SELECT provenance_plus_agg(x) FROM unnest(ARRAY[]::uuid[]) x) IS NULL AS plus_agg_empty
+FROM t;
+
+DROP TABLE t;
@@ -17,3 +17,45 @@ SELECT remove_provenance('mc_result');
 
 SELECT city, ROUND(prob::numeric,1) FROM mc_result WHERE city = 'Paris';
 DROP TABLE mc_result;
+
+-- With a seed, results do not depend on the number of threads
+CREATE TABLE mc_result AS
+SELECT city,
+  probability_evaluate(provenance(),'monte-carlo','10000;seed=42') AS prob1,
+  probability_evaluate(provenance(),'monte-carlo','10000;seed=42;threads=4') AS prob4
+FROM (
+  SELECT DISTINCT city
+  FROM personnel
+EXCEPT 
+  SELECT p1.city
+  FROM personnel p1,personnel p2
+  WHERE p1.id<p2.id AND p1.city=p2.city
+  GROUP BY p1.city
+) t;
+
+SELECT remove_provenance('mc_result');
+
+SELECT city, ROUND(prob1::numeric,1), prob1=prob4 AS same FROM mc_result WHERE city = 'Paris';
+DROP TABLE mc_result;
+
+-- Adaptive sampling, until the interval is within epsilon
+CREATE TABLE mc_result AS
+SELECT city, probability_interval(provenance(),0.05,0.01,'seed=42') AS r
+FROM (
+  SELECT DISTINCT city
+  FROM personnel
+EXCEPT 
+  SELECT p1.city
+  FROM personnel p1,personnel p2
+  WHERE p1.id<p2.id AND p1.city=p2.city
+  GROUP BY p1.city
+) t;
+
+SELECT remove_provenance('mc_result');
+
+SELECT city, ROUND((r).probability::numeric,1) AS prob,
+  (r).low <= (r).probability AND (r).probability <= (r).high
+    AND (r).high-(r).low < 0.11 AS within,
+  (r).samples <= 1199 AS bounded
+FROM mc_result WHERE city = 'Paris';
+DROP TABLE mc_result;
@@ -0,0 +1,41 @@
+\set ECHO none
+SET search_path TO provsql_test, provsql;
+
+-- Make parallel plans as attractive as possible, gates are then created
+-- by parallel workers
+SET max_parallel_workers_per_gather = 2;
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET parallel_leader_participation = off;
+
+-- The query, as rewritten by ProvSQL, has a parallel plan
+CREATE FUNCTION pg_temp.has_gather(query text) RETURNS boolean AS $$
+DECLARE
+  line text;
+BEGIN
+  FOR line IN EXECUTE 'EXPLAIN (COSTS OFF) ' || query LOOP
+    IF line LIKE '%Gather%' THEN
+      RETURN true;
+    END IF;
+  END LOOP;
+  RETURN false;
+END
+$$ LANGUAGE plpgsql;
+
+SELECT pg_temp.has_gather('SELECT DISTINCT position FROM personnel') AS parallel;
+
+CREATE TABLE parallel_result AS
+  SELECT DISTINCT position FROM personnel;
+
+RESET max_parallel_workers_per_gather;
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET min_parallel_table_scan_size;
+RESET parallel_leader_participation;
+
+SELECT position, formula(provenance(),'personnel_name')
+FROM parallel_result
+ORDER BY position;
+
+DROP TABLE parallel_result;
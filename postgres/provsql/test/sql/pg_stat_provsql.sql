@@ -0,0 +1,15 @@
+\set ECHO none
+SET search_path TO provsql_test, provsql;
+
+SELECT value > 0 AS has_gates FROM pg_stat_provsql WHERE name='gates';
+SELECT value >= 1 AS has_one FROM pg_stat_provsql WHERE name='gates_one';
+SELECT value >= 0 AND value <= 1 AS fill_factor FROM pg_stat_provsql WHERE name='store_fill_factor';
+
+CREATE TEMP TABLE stat_before AS SELECT * FROM pg_stat_provsql;
+SELECT probability_evaluate('b0000000-0000-0000-0000-000000000004', 'possible-worlds') IS NOT NULL AS evaluated;
+SELECT create_gate('b0000000-0000-0000-0000-000000000005', 'input');
+SELECT s.name, s.value > b.value AS increased
+FROM pg_stat_provsql s JOIN stat_before b ON s.name=b.name
+WHERE s.name IN ('evaluations_possible-worlds', 'create_gate_inserts', 'lock_acquisitions')
+ORDER BY s.name;
+DROP TABLE stat_before;
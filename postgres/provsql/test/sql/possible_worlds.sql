@@ -18,3 +18,24 @@ SELECT remove_provenance('pw_result');
 
 SELECT city, ROUND(prob::numeric,2) AS prob FROM pw_result;
 DROP TABLE pw_result;
+
+-- Results do not depend on the number of threads
+CREATE TABLE pw_result AS
+SELECT city,
+  probability_evaluate(provenance(),'possible-worlds') AS prob1,
+  probability_evaluate(provenance(),'possible-worlds','threads=4') AS prob4
+FROM (
+  SELECT DISTINCT city
+  FROM personnel
+EXCEPT 
+  SELECT p1.city
+  FROM personnel p1,personnel p2
+  WHERE p1.id<p2.id AND p1.city=p2.city
+  GROUP BY p1.city
+) t
+ORDER BY city;
+
+SELECT remove_provenance('pw_result');
+
+SELECT city, ROUND(prob4::numeric,2) AS prob, prob1=prob4 AS same FROM pw_result;
+DROP TABLE pw_result;
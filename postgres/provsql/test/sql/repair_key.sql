@@ -0,0 +1,39 @@
+\set ECHO none
+SET search_path TO provsql_test, provsql;
+
+-- Rows with the same key become mutually exclusive, each with the same
+-- probability
+CREATE TABLE repaired(k INT, v INT);
+INSERT INTO repaired VALUES (1,1), (1,2), (1,3), (2,4);
+SELECT repair_key('repaired', 'k');
+
+CREATE TABLE repaired_tokens AS SELECT k, v, provenance() AS token FROM repaired;
+SELECT remove_provenance('repaired_tokens');
+
+SELECT k, COUNT(*) AS nb,
+       COUNT(DISTINCT (get_children(token))[1]) AS keys,
+       ROUND(MIN(get_prob(token))::numeric, 3) AS prob,
+       SUM((get_infos(token)).info1) AS infos,
+       bool_and(get_gate_type(token)='mulinput') AS types
+FROM repaired_tokens
+GROUP BY k
+ORDER BY k;
+
+DROP TABLE repaired_tokens;
+DROP TABLE repaired;
+
+-- Without key, all rows are mutually exclusive
+CREATE TABLE repaired(v INT);
+INSERT INTO repaired VALUES (1), (2);
+SELECT repair_key('repaired', '');
+
+CREATE TABLE repaired_tokens AS SELECT v, provenance() AS token FROM repaired;
+SELECT remove_provenance('repaired_tokens');
+
+SELECT COUNT(*) AS nb,
+       COUNT(DISTINCT (get_children(token))[1]) AS keys,
+       ROUND(MIN(get_prob(token))::numeric, 3) AS prob
+FROM repaired_tokens;
+
+DROP TABLE repaired_tokens;
+DROP TABLE repaired;
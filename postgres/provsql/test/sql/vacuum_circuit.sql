@@ -0,0 +1,40 @@
+\set ECHO none
+SET search_path TO provsql_test, provsql;
+
+CREATE TABLE vacuum_test(token uuid);
+INSERT INTO vacuum_test VALUES ('a0000000-0000-0000-0000-000000000001');
+
+SELECT create_gate('a0000000-0000-0000-0000-000000000001', 'input');
+SELECT create_gate('a0000000-0000-0000-0000-000000000002', 'input');
+SELECT create_gate('a0000000-0000-0000-0000-000000000004', 'times',
+  ARRAY['a0000000-0000-0000-0000-000000000005'::uuid]);
+SELECT pin_token('a0000000-0000-0000-0000-000000000004');
+
+-- Tokens of compact provenance columns are roots as well; they are
+-- kept as text, which does not reference gates
+CREATE TABLE vacuum_compact(x int);
+INSERT INTO vacuum_compact VALUES (1), (2);
+SELECT add_provenance('vacuum_compact', compact => true);
+CREATE TABLE vacuum_compact_tokens AS SELECT provsql::uuid::text AS token FROM vacuum_compact;
+SELECT remove_provenance('vacuum_compact_tokens');
+
+-- Gates used since the previous run are always kept, so that
+-- unreferenced gates are only freed by the second run
+SELECT vacuum_circuit() >= 0 AS vacuumed;
+SELECT get_gate_type('a0000000-0000-0000-0000-000000000002') IS NOT NULL AS kept;
+SELECT vacuum_circuit() >= 0 AS vacuumed;
+
+SELECT get_gate_type('a0000000-0000-0000-0000-000000000001') AS referenced,
+       get_gate_type('a0000000-0000-0000-0000-000000000002') AS freed,
+       get_gate_type('a0000000-0000-0000-0000-000000000004') AS pinned,
+       get_children('a0000000-0000-0000-0000-000000000004') AS children,
+       get_gate_type(gate_zero()) AS zero,
+       get_gate_type(gate_one()) AS one;
+
+SELECT bool_and(get_gate_type(token::uuid)='input') AS compact_kept
+FROM vacuum_compact_tokens;
+
+SELECT unpin_token('a0000000-0000-0000-0000-000000000004');
+DROP TABLE vacuum_test;
+DROP TABLE vacuum_compact_tokens;
+DROP TABLE vacuum_compact;